@@ -0,0 +1,63 @@
+#include "benchmodels.h"
+
+Author::Author(QObject *parent)
+    : NOrmModel(parent)
+{
+}
+
+QString Author::name() const
+{
+    return mName;
+}
+
+void Author::setName(const QString &name)
+{
+    mName = name;
+}
+
+Book::Book(QObject *parent)
+    : NOrmModel(parent)
+    , mPages(0)
+{
+    setForeignKey("author", new Author(this));
+}
+
+Author *Book::author() const
+{
+    return qobject_cast<Author*>(foreignKey("author"));
+}
+
+void Book::setAuthor(Author *author)
+{
+    setForeignKey("author", author);
+}
+
+QString Book::title() const
+{
+    return mTitle;
+}
+
+void Book::setTitle(const QString &title)
+{
+    mTitle = title;
+}
+
+int Book::pages() const
+{
+    return mPages;
+}
+
+void Book::setPages(int pages)
+{
+    mPages = pages;
+}
+
+QDate Book::published() const
+{
+    return mPublished;
+}
+
+void Book::setPublished(const QDate &published)
+{
+    mPublished = published;
+}
@@ -0,0 +1,61 @@
+#ifndef BENCHMODELS_H
+#define BENCHMODELS_H
+/**
+ * 作者: daodaoliang
+ * 时间: 2026年10月19日
+ * 版本: 1.0.1.0
+ * 邮箱: daodaoliang@yeah.net
+ */
+
+#include <QDate>
+#include "NOrmModel.h"
+
+class Author : public NOrmModel {
+    Q_OBJECT
+    Q_PROPERTY(QString name READ name WRITE setName)
+    Q_CLASSINFO("name", "max_length=64 ci=true")
+
+public:
+    Author(QObject *parent = nullptr);
+
+    QString name() const;
+    void setName(const QString &name);
+
+private:
+    // 作者名字
+    QString mName;
+};
+
+class Book : public NOrmModel {
+    Q_OBJECT
+    Q_PROPERTY(Author* author READ author WRITE setAuthor)
+    Q_PROPERTY(QString title READ title WRITE setTitle)
+    Q_PROPERTY(int pages READ pages WRITE setPages)
+    Q_PROPERTY(QDate published READ published WRITE setPublished)
+    Q_CLASSINFO("title", "max_length=128 db_index=true")
+
+public:
+    Book(QObject *parent = nullptr);
+
+    Author *author() const;
+    void setAuthor(Author *author);
+
+    QString title() const;
+    void setTitle(const QString &title);
+
+    int pages() const;
+    void setPages(int pages);
+
+    QDate published() const;
+    void setPublished(const QDate &published);
+
+private:
+    // 书名
+    QString mTitle;
+    // 页数
+    int mPages;
+    // 出版日期
+    QDate mPublished;
+};
+
+#endif // BENCHMODELS_H
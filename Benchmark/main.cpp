@@ -0,0 +1,326 @@
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSqlDatabase>
+#include <QTemporaryDir>
+#include <QtTest/QTest>
+#include "NOrm.h"
+#include "NOrmQuerySet.h"
+#include "benchmodels.h"
+
+// 种子数据规模
+static const int seedAuthors = 50;
+static const int seedBooks = 1000;
+
+// 每次批量插入的行数
+static const int bulkBooks = 100;
+
+class NOrmBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void initTestCase_data();
+    void init();
+    void cleanup();
+
+    void save();
+    void bulkCreate();
+    void filterSize();
+    void filterSizeSelectRelated();
+    void values();
+    void count();
+    void iterate();
+    void foreignKeyLazyLoad();
+    void whereCompile();
+    void createTables();
+    void caseInsensitivePrefix();
+
+private:
+    // 磁盘数据库所在的临时目录
+    QTemporaryDir mDir;
+    // 连接序号, 每个用例使用新的连接名
+    int mConnection = 0;
+};
+
+void NOrmBenchmark::initTestCase()
+{
+    QVERIFY(mDir.isValid());
+    NOrm::registerModel<Author>();
+    NOrm::registerModel<Book>();
+}
+
+void NOrmBenchmark::initTestCase_data()
+{
+    QTest::addColumn<bool>("onDisk");
+    QTest::addColumn<bool>("performance");
+    QTest::newRow("memory") << false << false;
+    QTest::newRow("disk") << true << false;
+    QTest::newRow("memory-performance") << false << true;
+    QTest::newRow("disk-performance") << true << true;
+}
+
+void NOrmBenchmark::init()
+{
+    QFETCH_GLOBAL(bool, onDisk);
+    QFETCH_GLOBAL(bool, performance);
+
+    // 连接打开时应用 sqlite 性能配置, 对比默认配置的效果
+    NOrm::setSqliteProfile(performance ? NOrmSqliteProfile::performance() : NOrmSqliteProfile());
+
+    // 内存数据库在连接关闭后即消失, 每个用例都从空库开始
+    const QString path = onDisk ? mDir.filePath(QStringLiteral("bench.sqlite")) : QStringLiteral(":memory:");
+    if (onDisk) {
+        QFile::remove(path);
+        QFile::remove(path + QStringLiteral("-wal"));
+        QFile::remove(path + QStringLiteral("-shm"));
+    }
+    QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("bench_%1").arg(++mConnection));
+    db.setDatabaseName(path);
+    QVERIFY(NOrm::setDatabase(db));
+    QVERIFY(NOrm::createTables());
+
+    // 填充种子数据
+    QList<Author*> authors;
+    for (int i = 0; i < seedAuthors; ++i) {
+        Author *author = new Author;
+        author->setName(QStringLiteral("author %1").arg(i));
+        authors << author;
+    }
+    QVERIFY(NOrmQuerySet<Author>().bulkCreate(authors));
+    qDeleteAll(authors);
+
+    QList<Book*> books;
+    const QDate date(2000, 1, 1);
+    for (int i = 0; i < seedBooks; ++i) {
+        Book *book = new Book;
+        book->setTitle(QStringLiteral("book %1").arg(i));
+        book->setPages(100 + i % 400);
+        book->setPublished(date.addDays(i));
+        book->setProperty("author_id", i % seedAuthors + 1);
+        books << book;
+    }
+    QVERIFY(NOrmQuerySet<Book>().bulkCreate(books));
+    qDeleteAll(books);
+}
+
+void NOrmBenchmark::cleanup()
+{
+    NOrm::dropTables();
+}
+
+void NOrmBenchmark::save()
+{
+    Book book;
+    book.setTitle(QStringLiteral("saved"));
+    book.setPages(42);
+    book.setPublished(QDate(2020, 2, 2));
+    book.setProperty("author_id", 1);
+    QBENCHMARK {
+        book.setPk(QVariant());
+        book.save();
+    }
+}
+
+void NOrmBenchmark::bulkCreate()
+{
+    QList<Book*> books;
+    for (int i = 0; i < bulkBooks; ++i) {
+        Book *book = new Book;
+        book->setTitle(QStringLiteral("bulk %1").arg(i));
+        book->setPages(i);
+        book->setProperty("author_id", i % seedAuthors + 1);
+        books << book;
+    }
+    QBENCHMARK {
+        NOrmQuerySet<Book>().bulkCreate(books);
+    }
+    qDeleteAll(books);
+}
+
+void NOrmBenchmark::filterSize()
+{
+    const NOrmQuerySet<Book> qs = NOrmQuerySet<Book>().filter(NOrmWhere("pages", NOrmWhere::GreaterOrEquals, 200));
+    QBENCHMARK {
+        NOrmQuerySet<Book> result = qs.all();
+        result.size();
+    }
+}
+
+void NOrmBenchmark::filterSizeSelectRelated()
+{
+    const NOrmQuerySet<Book> qs = NOrmQuerySet<Book>().filter(NOrmWhere("pages", NOrmWhere::GreaterOrEquals, 200)).selectRelated();
+    QBENCHMARK {
+        NOrmQuerySet<Book> result = qs.all();
+        result.size();
+    }
+}
+
+void NOrmBenchmark::values()
+{
+    NOrmQuerySet<Book> qs;
+    QBENCHMARK {
+        qs.values(QStringList() << QStringLiteral("title") << QStringLiteral("pages"));
+    }
+}
+
+void NOrmBenchmark::count()
+{
+    const NOrmQuerySet<Book> qs = NOrmQuerySet<Book>().filter(NOrmWhere("title", NOrmWhere::StartsWith, QStringLiteral("book 1")));
+    QBENCHMARK {
+        qs.count();
+    }
+}
+
+void NOrmBenchmark::iterate()
+{
+    QBENCHMARK {
+        const NOrmQuerySet<Book> qs;
+        int pages = 0;
+        for (NOrmQuerySet<Book>::const_iterator it = qs.constBegin(); it != qs.constEnd(); ++it)
+            pages += it->pages();
+        Q_UNUSED(pages);
+    }
+}
+
+void NOrmBenchmark::foreignKeyLazyLoad()
+{
+    NOrmQuerySet<Book> qs = NOrmQuerySet<Book>().limit(0, 100);
+    QList<Book*> books;
+    QList<Author*> authors;
+    for (int i = 0; i < qs.size(); ++i) {
+        books << qs.at(i);
+        authors << books.last()->author();
+    }
+    QBENCHMARK {
+        // 清空已加载外键的主键, 迫使每次都从数据库重新加载
+        for (int i = 0; i < books.size(); ++i) {
+            authors.at(i)->setPk(QVariant());
+            books.at(i)->author();
+        }
+    }
+    qDeleteAll(books);
+}
+
+void NOrmBenchmark::whereCompile()
+{
+    const QSqlDatabase db = NOrm::database();
+    const NOrmQuerySet<Book> qs = NOrmQuerySet<Book>().filter(
+                (NOrmWhere("pages", NOrmWhere::GreaterThan, 100) && NOrmWhere("author__name", NOrmWhere::IStartsWith, QStringLiteral("author")))
+                || NOrmWhere("title", NOrmWhere::IsIn, QVariantList() << QStringLiteral("book 1") << QStringLiteral("book 2")));
+    QBENCHMARK {
+        qs.where().sql(db);
+    }
+}
+
+void NOrmBenchmark::createTables()
+{
+    QBENCHMARK {
+        NOrm::dropTables();
+        NOrm::createTables();
+    }
+}
+
+void NOrmBenchmark::caseInsensitivePrefix()
+{
+    // 以 '@' 结尾的前缀: NOCASE 下 '_', '[', '`' 排在 '@' 和折叠后的字母之间, 不能落入范围
+    QList<Author*> authors;
+    const QStringList names = QStringList() << QStringLiteral("mail@home") << QStringLiteral("MAIL@work")
+                                            << QStringLiteral("mail_box") << QStringLiteral("mail[1]")
+                                            << QStringLiteral("mail`x") << QStringLiteral("mailbox");
+    foreach (const QString &name, names) {
+        Author *author = new Author;
+        author->setName(name);
+        authors << author;
+    }
+    QVERIFY(NOrmQuerySet<Author>().bulkCreate(authors));
+    qDeleteAll(authors);
+
+    const NOrmQuerySet<Author> qs = NOrmQuerySet<Author>().filter(
+                NOrmWhere("name", NOrmWhere::IStartsWith, QStringLiteral("mail@")));
+    QCOMPARE(qs.count(), 2);
+}
+
+/**
+ * 将 QTest 的 csv 输出转换为 json
+ * csv 每行格式: "function","tag","metric",value,total,iterations
+ */
+static bool writeJson(const QString &csvPath, const QString &jsonPath)
+{
+    QFile csv(csvPath);
+    if (!csv.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << "Benchmark csv open error:" << csv.errorString();
+        return false;
+    }
+
+    QJsonArray results;
+    while (!csv.atEnd()) {
+        const QString line = QString::fromUtf8(csv.readLine()).trimmed();
+        const QStringList columns = line.split(QLatin1Char(','));
+        if (columns.size() < 6)
+            continue;
+        QStringList names;
+        for (int i = 0; i < 3; ++i) {
+            QString name = columns.at(i);
+            if (name.startsWith(QLatin1Char('"')) && name.endsWith(QLatin1Char('"')))
+                name = name.mid(1, name.size() - 2);
+            names << name;
+        }
+        QJsonObject result;
+        result.insert(QStringLiteral("benchmark"), names.at(0));
+        result.insert(QStringLiteral("database"), names.at(1));
+        result.insert(QStringLiteral("metric"), names.at(2));
+        result.insert(QStringLiteral("value"), columns.at(3).toDouble());
+        result.insert(QStringLiteral("total"), columns.at(4).toDouble());
+        result.insert(QStringLiteral("iterations"), columns.at(5).toInt());
+        results << result;
+    }
+
+    QJsonObject root;
+    root.insert(QStringLiteral("qt"), QString::fromLatin1(qVersion()));
+    root.insert(QStringLiteral("date"), QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+    root.insert(QStringLiteral("results"), results);
+
+    QFile json(jsonPath);
+    if (!json.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Benchmark json open error:" << json.errorString();
+        return false;
+    }
+    json.write(QJsonDocument(root).toJson());
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    // --json <file> 额外输出 json 结果, 其余参数原样交给 QTest
+    QStringList args = app.arguments();
+    QString jsonPath;
+    const int index = args.indexOf(QStringLiteral("--json"));
+    if (index > 0 && index + 1 < args.size()) {
+        jsonPath = args.at(index + 1);
+        args.erase(args.begin() + index, args.begin() + index + 2);
+    }
+
+    NOrmBenchmark benchmark;
+    if (jsonPath.isEmpty())
+        return QTest::qExec(&benchmark, args);
+
+    QTemporaryDir dir;
+    const QString csvPath = dir.filePath(QStringLiteral("benchmark.csv"));
+    args << QStringLiteral("-o") << csvPath + QStringLiteral(",csv")
+         << QStringLiteral("-o") << QStringLiteral("-,txt");
+    const int ret = QTest::qExec(&benchmark, args);
+    if (!writeJson(csvPath, jsonPath))
+        return ret ? ret : 1;
+    return ret;
+}
+
+#include "main.moc"
@@ -1,5 +1,5 @@
 QT -= gui
-QT += sql
+QT += sql concurrent
 
 TEMPLATE = lib
 CONFIG += shared
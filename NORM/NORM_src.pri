@@ -1,16 +1,32 @@
 HEADERS += \
     $$PWD/inc/NOrm.h \
     $$PWD/inc/NOrm_p.h \
+    $$PWD/inc/NOrmDiagnosticsScope.h \
+    $$PWD/inc/NOrmImportOptions.h \
     $$PWD/inc/NOrmMetaModel.h \
     $$PWD/inc/NOrmModel.h \
+    $$PWD/inc/NOrmObserver.h \
+    $$PWD/inc/NOrmProfiler.h \
     $$PWD/inc/NOrmQuerySet.h \
     $$PWD/inc/NOrmQuerySet_p.h \
+    $$PWD/inc/NOrmRetryPolicy.h \
+    $$PWD/inc/NOrmSlowQueryLog.h \
+    $$PWD/inc/NOrmSqliteProfile.h \
+    $$PWD/inc/NOrmUnitOfWork.h \
     $$PWD/inc/NOrmWhere.h \
     $$PWD/inc/NOrmWhere_p.h \
     $$PWD/inc/NOrm_global.h
 SOURCES += \
     $$PWD/src/NOrm.cpp \
+    $$PWD/src/NOrmDiagnosticsScope.cpp \
+    $$PWD/src/NOrmImportOptions.cpp \
     $$PWD/src/NOrmMetaModel.cpp \
     $$PWD/src/NOrmModel.cpp \
+    $$PWD/src/NOrmObserver.cpp \
+    $$PWD/src/NOrmProfiler.cpp \
     $$PWD/src/NOrmQuerySet.cpp \
+    $$PWD/src/NOrmRetryPolicy.cpp \
+    $$PWD/src/NOrmSlowQueryLog.cpp \
+    $$PWD/src/NOrmSqliteProfile.cpp \
+    $$PWD/src/NOrmUnitOfWork.cpp \
     $$PWD/src/NOrmWhere.cpp
@@ -7,8 +7,16 @@
  * 时间: 2021-07-16
  */
 
+#include "NOrmDiagnosticsScope.h"
+#include "NOrmImportOptions.h"
 #include "NOrmMetaModel.h"
+#include "NOrmObserver.h"
+#include "NOrmProfiler.h"
+#include "NOrmRetryPolicy.h"
+#include "NOrmSlowQueryLog.h"
+#include "NOrmSqliteProfile.h"
 #include <QStack>
+#include <functional>
 
 class QObject;
 class QSqlDatabase;
@@ -25,6 +33,28 @@ extern QMap<QByteArray, NOrmMetaModel> globalMetaModels;
 class NOrm
 {
 public:
+    /**
+     * @brief The ReplicaPolicy enum 只读副本的选择策略
+     */
+    enum ReplicaPolicy {
+        // 轮询
+        RoundRobin,
+        // 正在执行的读操作最少
+        LeastLoaded
+    };
+
+    /**
+     * @brief The DataFormat enum 导入导出的数据格式
+     */
+    enum DataFormat {
+        // 逗号分隔(RFC 4180), 首行为字段名, QStringList 字段为 JSON 数组文本
+        Csv,
+        // 每行一个 JSON 对象
+        NdJson,
+        // JSON 对象数组
+        Json
+    };
+
     /**
      * @brief createTables 创建数据表
      * @return 创建操作的结果
@@ -37,6 +67,13 @@ public:
      */
     static bool dropTables();
 
+    /**
+     * @brief migrateStringLists 迁移早期版本创建的 QStringList 列: 逗号连接的值改写为 JSON 数组,
+     * postgresql 的列改为 jsonb, mysql 的列改为 json. 这些列在迁移前不能使用 NOrmWhere::ArrayContains
+     * @return 迁移操作的结果
+     */
+    static bool migrateStringLists();
+
     /**
      * @brief database 当前链接的数据库
      * @return 数据库信息
@@ -50,6 +87,100 @@ public:
      */
     static bool setDatabase(QSqlDatabase database);
 
+    /**
+     * @brief addReplica 添加只读副本(须在 setDatabase 之后, 开始访问数据库之前调用),
+     * 之后查询/统计/values 走副本, 写操作和事务中的读操作走主库;
+     * 事务须通过 NOrm::transaction() 开启, 直接调用 QSqlDatabase::transaction() 开启的事务无法感知,
+     * 其中的读操作仍可能走副本
+     * @param database 副本的数据库信息, 链接名可以作为 NOrmQuerySet::use() 的别名
+     * @return 添加操作结果
+     */
+    static bool addReplica(QSqlDatabase database);
+
+    /**
+     * @brief clearReplicas 移除所有只读副本
+     * 同时移除各线程复制的链接, 调用时不应有其他线程在读取副本
+     */
+    static void clearReplicas();
+
+    /**
+     * @brief addShard 添加分片(须在 setDatabase 之后, 开始访问数据库之前调用),
+     * 设置了 shard_key 的模型按分片键分布到各分片上, 其他模型仍使用主库
+     * 分片的模型不能使用自增主键, 保存时也不能修改分片键
+     * @param database 分片的数据库信息, 按添加顺序编号
+     * @return 添加操作结果
+     */
+    static bool addShard(QSqlDatabase database);
+
+    /**
+     * @brief clearShards 移除所有分片
+     */
+    static void clearShards();
+
+    /**
+     * @brief replicaPolicy 只读副本的选择策略
+     * @return 选择策略
+     */
+    static ReplicaPolicy replicaPolicy();
+
+    /**
+     * @brief setReplicaPolicy 设置只读副本的选择策略
+     * @param policy 选择策略
+     */
+    static void setReplicaPolicy(ReplicaPolicy policy);
+
+    /**
+     * @brief replicaStickiness 线程写入之后继续读主库的时长, 用来避开副本的同步延迟
+     * @return 毫秒
+     */
+    static int replicaStickiness();
+
+    /**
+     * @brief setReplicaStickiness 设置线程写入之后继续读主库的时长
+     * @param msecs 毫秒
+     */
+    static void setReplicaStickiness(int msecs);
+
+    /**
+     * @brief sqliteProfile sqlite 连接的性能配置
+     * @return 配置
+     */
+    static NOrmSqliteProfile sqliteProfile();
+
+    /**
+     * @brief setSqliteProfile 设置 sqlite 连接的性能配置, 立即应用到主链接,
+     * 之后各线程新建的链接也会应用该配置
+     * @param profile 配置
+     */
+    static void setSqliteProfile(const NOrmSqliteProfile &profile);
+
+    /**
+     * @brief largeInThreshold IsIn 条件整体绑定为一个参数的元素个数阈值
+     * @return 个数
+     */
+    static int largeInThreshold();
+
+    /**
+     * @brief setLargeInThreshold 设置 IsIn 条件整体绑定为一个参数的元素个数阈值,
+     * 超过阈值的整数/字符串列表在 postgresql 上绑定为数组(= ANY(?)), 在 sqlite/mysql/sqlserver 上绑定为 JSON 数组;
+     * 其他列表的占位符个数按档位补齐, 使预处理语句可以复用
+     * @param count 个数
+     */
+    static void setLargeInThreshold(int count);
+
+    /**
+     * @brief countEstimateThreshold 估计行数的阈值
+     * @return 行数
+     */
+    static qint64 countEstimateThreshold();
+
+    /**
+     * @brief setCountEstimateThreshold 设置估计行数的阈值, NOrmQuerySet<T>::estimatedCount() 和
+     * page() 的估计值低于阈值时改为精确计数(小表的统计信息往往过时, 精确计数也很快)
+     * @param rows 行数
+     */
+    static void setCountEstimateThreshold(qint64 rows);
+
     /**
      * @brief isDebugEnabled 是否是调试模式
      * @return true or false
@@ -62,6 +193,44 @@ public:
      */
     static void setDebugEnabled(bool enabled);
 
+    /**
+     * @brief slowQueryLog 慢查询日志配置
+     * @return 配置
+     */
+    static NOrmSlowQueryLog slowQueryLog();
+
+    /**
+     * @brief setSlowQueryLog 设置慢查询日志(应在开始访问数据库之前设置)
+     * @param log 配置
+     */
+    static void setSlowQueryLog(const NOrmSlowQueryLog &log);
+
+    /**
+     * @brief retryPolicy 锁冲突/死锁等瞬时错误的重试策略
+     * @return 重试策略
+     */
+    static NOrmRetryPolicy retryPolicy();
+
+    /**
+     * @brief setRetryPolicy 设置重试策略(应在开始访问数据库之前设置)
+     * @param policy 重试策略
+     */
+    static void setRetryPolicy(const NOrmRetryPolicy &policy);
+
+    /**
+     * @brief retryCount 启动以来语句和事务的累计重试次数
+     * @return 重试次数
+     */
+    static int retryCount();
+
+    /**
+     * @brief transaction 在事务中执行 work, 事务因死锁等瞬时错误失败时按重试策略整体重放,
+     * 嵌套调用时并入外层事务
+     * @param work 事务内容, 返回 false 时回滚事务
+     * @return 事务是否提交成功
+     */
+    static bool transaction(const std::function<bool()> &work);
+
     template <class T>
     /**
      * @brief registerModel 注册模型(模板)
@@ -0,0 +1,131 @@
+#ifndef NORM_DIAGNOSTICSSCOPE_H
+#define NORM_DIAGNOSTICSSCOPE_H
+
+/*
+ * 描述: NORM N+1 查询检测
+ * 作者: daodaoliang@yeah.net
+ * 时间: 2026-10-19
+ */
+
+#include <QStringList>
+#include <functional>
+
+class NOrmDiagnosticsScopePrivate;
+
+/**
+ * @brief The NOrmDiagnostic class 一次 N+1 查询报告
+ */
+class NOrmDiagnostic
+{
+public:
+    NOrmDiagnostic();
+
+    // 转换成报告文本
+    QString toString() const;
+
+    // 作用域名字
+    QString scope;
+
+    // 重复执行的语句形状
+    QString sql;
+
+    // 次数(达到阈值时)
+    int count;
+
+    // 延迟加载外键时的模型类名, 其他来源的语句为空
+    QString model;
+
+    // 延迟加载的外键名
+    QString foreignKey;
+
+    // 达到阈值那一次执行的调用栈
+    QStringList backtrace;
+};
+
+/**
+ * @brief The NOrmDiagnosticsScope class N+1 查询检测的作用域
+ * 作用域存在期间统计当前线程中同一形状语句的执行次数, 达到阈值时报告一次.
+ * 作用域可以嵌套, 语句计入所有外层作用域. NOrmUnitOfWork::commit() 在
+ * setEnabled(true) 后自动创建作用域, 请求等其他范围由调用者创建.
+ */
+class NOrmDiagnosticsScope
+{
+public:
+    /**
+     * @brief NOrmDiagnosticsScope 开始检测
+     * @param name 作用域名字, 出现在报告中
+     * @param threshold 阈值, 小于等于 0 时使用 defaultThreshold()
+     */
+    explicit NOrmDiagnosticsScope(const QString &name = QString(), int threshold = 0);
+    ~NOrmDiagnosticsScope();
+
+    /**
+     * @brief issues 已检测到的问题
+     * @return 报告列表
+     */
+    QList<NOrmDiagnostic> issues() const;
+
+    /**
+     * @brief isEnabled 是否为工作单元等内部范围自动创建作用域
+     * @return true or false
+     */
+    static bool isEnabled();
+
+    /**
+     * @brief setEnabled 设置是否自动创建作用域
+     * @param enabled true or false
+     */
+    static void setEnabled(bool enabled);
+
+    /**
+     * @brief defaultThreshold 默认阈值
+     * @return 次数
+     */
+    static int defaultThreshold();
+
+    /**
+     * @brief setDefaultThreshold 设置默认阈值
+     * @param threshold 次数
+     */
+    static void setDefaultThreshold(int threshold);
+
+    /**
+     * @brief failOnIssue 检测到问题时是否终止程序(用于测试)
+     * @return true or false
+     */
+    static bool failOnIssue();
+
+    /**
+     * @brief setFailOnIssue 设置检测到问题时是否以 qFatal 终止程序
+     * @param fail true or false
+     */
+    static void setFailOnIssue(bool fail);
+
+    /**
+     * @brief setHandler 设置报告回调, 为空时以 qWarning 输出
+     * @param handler 回调
+     */
+    static void setHandler(const std::function<void(const NOrmDiagnostic &issue)> &handler);
+
+private:
+    Q_DISABLE_COPY(NOrmDiagnosticsScope)
+
+    // 统计一次语句执行
+    static void recordQuery(const QString &sql);
+
+    // 标记当前线程正在延迟加载的外键
+    static void beginLazyLoad(const QString &model, const QString &foreignKey);
+    static void endLazyLoad();
+
+    // 标记当前线程正在逐行执行批量操作, 期间的语句不计入统计
+    static void beginBatch();
+    static void endBatch();
+
+    NOrmDiagnosticsScopePrivate *d;
+
+    friend class NOrmQuery;
+    friend class NOrmMetaModel;
+    friend class NOrmDiagnosticsBatch;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef NORM_IMPORTOPTIONS_H
+#define NORM_IMPORTOPTIONS_H
+
+/*
+ * 描述: NORM 批量导入的选项
+ * 作者: daodaoliang@yeah.net
+ * 时间: 2026-10-19
+ */
+
+#include <QStringList>
+
+/**
+ * @brief The NOrmImportOptions class NOrmQuerySet<T>::importFrom() 的选项
+ * 读取线程按记录切分输入, 解析线程把记录转换成字段值, 调用线程按 transactionSize
+ * 分段开启事务, 每段内按 batchSize 生成多行 INSERT(或 upsert).
+ */
+class NOrmImportOptions
+{
+public:
+    // 构造(默认插入, 推迟外键检查, 遇到无效记录时停止)
+    NOrmImportOptions();
+
+    // 每条 INSERT 语句的最大行数(同时受驱动绑定参数个数的限制)
+    int batchSize;
+
+    // 每个事务的行数, 失败时只回滚当前事务, 之前的事务已经提交
+    int transactionSize;
+
+    // 解析线程个数, 小于等于 0 时使用 CPU 核数减一
+    int parserThreads;
+
+    // 已存在的记录是否更新(upsert), 否则直接插入
+    bool upsert;
+
+    // upsert 判断记录是否存在的字段(需要有唯一约束), 为空时使用主键
+    QStringList conflictFields;
+
+    // 在事务内推迟外键检查到提交时(sqlite defer_foreign_keys / postgresql SET CONSTRAINTS ALL DEFERRED)
+    bool deferForeignKeys;
+
+    // 导入期间关闭外键检查(mysql foreign_key_checks=0), 导入的数据不会再被检查
+    bool disableForeignKeyChecks;
+
+    // 跳过无法解析或转换的记录, 否则遇到时停止导入
+    bool skipInvalidRows;
+};
+
+#endif
@@ -39,6 +39,9 @@ public:
     // 是否自增
     bool isAutoIncrement() const;
 
+    // 是否不区分大小写(ci=true)
+    bool isCaseInsensitive() const;
+
     // 是否空
     bool isBlank() const;
 
@@ -48,15 +51,24 @@ public:
     // 是否唯一
     bool isUnique() const;
 
+    // 是否是 JSON 字段(QVariantMap / QJsonObject)
+    bool isJson() const;
+
     // 是否有效
     bool isValid() const;
 
+    // 是否是版本字段(乐观锁)
+    bool isVersion() const;
+
     // 列名
     QString name() const;
 
     // 最大长度
     int maxLength() const;
 
+    // 字段类型
+    QVariant::Type type() const;
+
     // 转换成数据库中将要存储的数据值
     QVariant toDatabase(const QVariant &value) const;
 
@@ -96,13 +108,16 @@ public:
     // 删除数据表
     bool dropTable() const;
 
+    // 把早期版本创建的字符串列表列迁移为 JSON 数组列
+    bool migrateStringLists() const;
+
     void load(QObject *model, const QVariantList &props, int &pos, const QStringList &relatedFields = QStringList()) const;
 
     // 删除数据记录
     bool remove(QObject *model) const;
 
-    // 插入数据记录
-    bool save(QObject *model) const;
+    // 插入数据记录, 版本字段不匹配时 conflict 置为 true
+    bool save(QObject *model, bool *conflict = nullptr) const;
 
     // 外键
     QObject *foreignKey(const QObject *model, const char *name) const;
@@ -126,6 +141,27 @@ public:
     // 表名字
     QString table() const;
 
+    // 版本字段信息
+    QByteArray versionField() const;
+
+    // 分片键
+    QByteArray shardKey() const;
+
+    // 是否分布在多个分片上
+    bool isSharded() const;
+
+    // 分片键的值所在的分片, 未启用分片时返回 -1
+    int shard(const QVariant &value) const;
+
+    // 全文检索的字段
+    QList<QByteArray> searchFields() const;
+
+    // 全文检索的文档表达式(postgresql), 过滤条件和 GIN 索引使用同一个表达式
+    QString searchDocumentSql(const QStringList &columns) const;
+
+    // 全文检索的查询表达式(postgresql), value 为占位符或字面量
+    QString searchQuerySql(const QString &value) const;
+
 private:
     QString getBoolType(NOrmDatabase::DatabaseType databaseType) const;
     QString getByteArrayType(NOrmDatabase::DatabaseType databaseType, int maxLength) const;
@@ -137,7 +173,9 @@ private:
     QString getStringType(NOrmDatabase::DatabaseType databaseType, int maxLength) const;
     QString getTimeType(NOrmDatabase::DatabaseType databaseType) const;
     QString getStringListType(NOrmDatabase::DatabaseType databaseType, int maxLength) const;
+    QString getJsonType(NOrmDatabase::DatabaseType databaseType) const;
     QString attributeNull(NOrmDatabase::DatabaseType databaseType) const;
+    QString attributeCaseInsensitive(NOrmDatabase::DatabaseType databaseType) const;
     QString attributeUnique(NOrmDatabase::DatabaseType databaseType) const;
     QString attributePrimaryKey(NOrmDatabase::DatabaseType databaseType) const;
     QString attributeAutoIncrement(NOrmDatabase::DatabaseType databaseType, const NOrmMetaField &field) const;
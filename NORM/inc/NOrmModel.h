@@ -10,7 +10,6 @@
 #include <QObject>
 #include <QVariant>
 #include "NOrm_p.h"
-#include "saveinthread.h"
 
 class NOrmModel : public QObject
 {
@@ -36,6 +35,11 @@ public slots:
     // 转打印字串
     QString toString() const;
 
+signals:
+
+    // 保存时版本字段不匹配(记录已被其他写入者修改)
+    void versionConflict();
+
 protected:
     QObject *foreignKey(const char *name) const;
     void setForeignKey(const char *name, QObject *value);
@@ -0,0 +1,154 @@
+#ifndef NORM_OBSERVER_H
+#define NORM_OBSERVER_H
+
+/*
+ * 描述: NORM 执行阶段观察者与追踪导出
+ * 作者: daodaoliang@yeah.net
+ * 时间: 2026-10-19
+ */
+
+#include <QFile>
+#include <QMutex>
+#include <QString>
+
+/**
+ * @brief The NOrmSpan class 一次执行阶段(span)
+ * 同一线程中的 span 按调用关系嵌套, 例如 Fetch 包含 Build/Prepare/Exec
+ */
+class NOrmSpan
+{
+public:
+    /**
+     * @brief The Phase enum 执行阶段
+     */
+    enum Phase {
+        // 解析条件中的字段名(NOrmCompiler::resolve)
+        Resolve,
+        // 拼接语句
+        Build,
+        // 预处理
+        Prepare,
+        // 执行
+        Exec,
+        // 读取结果集
+        Fetch,
+        // 结果写入模型对象(NOrmMetaModel::load)
+        Load
+    };
+
+    NOrmSpan();
+
+    // 阶段名字
+    static QString phaseName(Phase phase);
+
+    // 编号, 进程内唯一
+    quint64 id;
+
+    // 外层 span 的编号, 没有时为 0
+    quint64 parentId;
+
+    // 阶段
+    Phase phase;
+
+    // 模型类名, 没有时继承外层 span 的模型
+    QString model;
+
+    // 归一化后的语句(不含字面量和参数), 没有语句的阶段为空
+    QString sql;
+
+    // 语句形状编号, 同一形状的语句相同
+    QString shapeId;
+
+    // 行数: Exec 为影响的行数, Fetch 为读取的行数, Load 为 1, 未知时为 -1
+    qint64 rows;
+
+    // 开始时间(自 1970-01-01 UTC 起的微秒数)
+    qint64 start;
+
+    // 耗时(微秒)
+    qint64 duration;
+
+    // 线程编号
+    quint64 thread;
+
+    // 是否成功
+    bool ok;
+};
+
+/**
+ * @brief The NOrmObserver class 执行阶段观察者
+ * 回调在执行语句的线程中同步调用, 实现需要线程安全并尽量轻量.
+ * 没有注册观察者时每个阶段只多一次原子读.
+ */
+class NOrmObserver
+{
+public:
+    virtual ~NOrmObserver();
+
+    /**
+     * @brief spanStarted 阶段开始, 此时只有编号/阶段/模型/开始时间有效
+     * @param span 阶段
+     */
+    virtual void spanStarted(const NOrmSpan &span);
+
+    /**
+     * @brief spanFinished 阶段结束
+     * @param span 阶段
+     */
+    virtual void spanFinished(const NOrmSpan &span) = 0;
+
+    /**
+     * @brief addObserver 注册观察者, 不接管所有权
+     * @param observer 观察者
+     */
+    static void addObserver(NOrmObserver *observer);
+
+    /**
+     * @brief removeObserver 注销观察者(应在没有语句执行时注销后再删除)
+     * @param observer 观察者
+     */
+    static void removeObserver(NOrmObserver *observer);
+
+    /**
+     * @brief hasObservers 是否注册了观察者
+     * @return true or false
+     */
+    static bool hasObservers();
+
+private:
+    static void notifyStarted(const NOrmSpan &span);
+    static void notifyFinished(const NOrmSpan &span);
+
+    friend class NOrmSpanScope;
+};
+
+/**
+ * @brief The NOrmTraceFileExporter class 把 span 写入本地文件
+ * 文件为 Chrome Trace Event 格式(每行一个 "X" 事件), 可直接用 chrome://tracing 或 Perfetto 打开,
+ * 也可以逐行解析后转发给其他追踪系统
+ */
+class NOrmTraceFileExporter : public NOrmObserver
+{
+public:
+    /**
+     * @brief NOrmTraceFileExporter 打开(截断)文件
+     * @param filePath 文件路径
+     */
+    explicit NOrmTraceFileExporter(const QString &filePath);
+    ~NOrmTraceFileExporter();
+
+    /**
+     * @brief isOpen 文件是否打开成功
+     * @return true or false
+     */
+    bool isOpen() const;
+
+    void spanFinished(const NOrmSpan &span) override;
+
+private:
+    Q_DISABLE_COPY(NOrmTraceFileExporter)
+    QMutex m_mutex;
+    QFile m_file;
+};
+
+#endif
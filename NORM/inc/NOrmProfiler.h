@@ -0,0 +1,120 @@
+#ifndef NORM_PROFILER_H
+#define NORM_PROFILER_H
+
+/*
+ * 描述: NORM 语句性能统计
+ * 作者: daodaoliang@yeah.net
+ * 时间: 2026-10-19
+ */
+
+#include <QList>
+#include <QString>
+
+/**
+ * @brief The NOrmStageProfile class 某个阶段(prepare/exec/fetch)的耗时统计, 单位为微秒
+ * 分位数取自对数直方图, 误差不超过 20%
+ */
+class NOrmStageProfile
+{
+public:
+    NOrmStageProfile();
+
+    // 次数
+    qint64 count;
+
+    // 总耗时
+    qint64 total;
+
+    // 中位数
+    qint64 p50;
+
+    // 95 分位
+    qint64 p95;
+
+    // 99 分位
+    qint64 p99;
+
+    // 最大值
+    qint64 max;
+};
+
+/**
+ * @brief The NOrmQueryProfile class 同一形状语句的统计
+ */
+class NOrmQueryProfile
+{
+public:
+    NOrmQueryProfile();
+
+    // 归一化后的语句, 字面量和绑定参数替换为 ?, IN 列表折叠为一个 ?
+    QString sql;
+
+    // 执行次数
+    qint64 calls;
+
+    // 预处理耗时
+    NOrmStageProfile prepare;
+
+    // 执行耗时
+    NOrmStageProfile exec;
+
+    // 读取结果耗时
+    NOrmStageProfile fetch;
+
+    // 读取的行数
+    qint64 rows;
+
+    // 读取的数据量(字节, 按内存中的大小估算)
+    qint64 bytes;
+};
+
+/**
+ * @brief The NOrmProfiler class 按语句形状统计次数/耗时/行数/数据量
+ * 关闭时每条语句只多一次原子读
+ */
+class NOrmProfiler
+{
+public:
+    /**
+     * @brief isEnabled 是否在统计
+     * @return true or false
+     */
+    static bool isEnabled();
+
+    /**
+     * @brief setEnabled 开始或停止统计, 已有的统计数据保留
+     * @param enabled true or false
+     */
+    static void setEnabled(bool enabled);
+
+    /**
+     * @brief snapshot 当前的统计数据, 按执行总耗时从大到小排列
+     * @return 各形状语句的统计
+     */
+    static QList<NOrmQueryProfile> snapshot();
+
+    /**
+     * @brief reset 清空统计数据
+     */
+    static void reset();
+
+    /**
+     * @brief normalize 语句的形状
+     * @param sql 语句
+     * @return 归一化后的语句
+     */
+    static QString normalize(const QString &sql);
+
+private:
+    enum Stage {
+        Prepare,
+        Exec,
+        Fetch
+    };
+
+    static void record(const QString &sql, Stage stage, qint64 usecs, qint64 rows = 0, qint64 bytes = 0);
+
+    friend class NOrmQuery;
+};
+
+#endif
@@ -11,6 +11,8 @@
 #include "NOrmWhere.h"
 #include "NOrmQuerySet_p.h"
 
+template <class T> class NOrmPage;
+
 template <class T> class NOrmQuerySet {
 public:
     typedef int size_type;
@@ -125,22 +127,36 @@ public:
     ~NOrmQuerySet();
 
     NOrmQuerySet all() const;
+    NOrmQuerySet distinct() const;
+    NOrmQuerySet annotate(const NOrmWindow &window) const;
     NOrmQuerySet exclude(const NOrmWhere &where) const;
     NOrmQuerySet filter(const NOrmWhere &where) const;
+    NOrmQuerySet groupBy(const QStringList &fields) const;
+    NOrmQuerySet having(const NOrmWhere &where) const;
     NOrmQuerySet limit(int pos, int length = -1) const;
     NOrmQuerySet none() const;
     NOrmQuerySet orderBy(const QStringList &keys) const;
+    NOrmPage<T> page(int number, int size, bool estimate = false) const;
+    NOrmQuerySet qualify(const NOrmWhere &where) const;
     NOrmQuerySet selectRelated(const QStringList &relatedFields = QStringList()) const;
+    NOrmQuerySet use(const QString &alias) const;
 
     int count() const;
+    qint64 estimatedCount() const;
+    qint64 estimatedDistinctCount(const QString &field) const;
     QVariant aggregate(const NOrmWhere::AggregateType func, const QString &field) const;
+    QList<QVariantMap> aggregate(const QList<NOrmAggregate> &aggregates) const;
     NOrmWhere where() const;
+    NOrmSubquery subquery(const QString &field = QLatin1String("pk")) const;
 
+    bool bulkCreate(const QList<T*> &objects);
     bool remove();
     int size();
     int update(const QVariantMap &fields);
     QList<QVariantMap> values(const QStringList &fields = QStringList());
-    QList<QVariantList> valuesList(const QStringList &fields = QStringList());
+    QList<QVariantList> valuesList(const QStringList &fields = QStringList(), bool distinct = false);
+    qint64 exportTo(QIODevice *device, NOrm::DataFormat format, const QStringList &fields = QStringList());
+    qint64 importFrom(QIODevice *device, NOrm::DataFormat format, const NOrmImportOptions &options = NOrmImportOptions());
 
     T *get(const NOrmWhere &where, T *target = 0) const;
     T *at(int index, T *target = 0);
@@ -157,6 +173,23 @@ private:
     NOrmQuerySetPrivate *d;
 };
 
+/**
+ * @brief The NOrmPage class 分页查询的结果, 由 NOrmQuerySet<T>::page() 返回
+ */
+template <class T> class NOrmPage {
+public:
+    NOrmPage() : total(-1), estimated(false) {}
+
+    // 当前页的数据(已经取回)
+    NOrmQuerySet<T> items;
+
+    // 不分页时的总行数, 失败时为 -1
+    qint64 total;
+
+    // 总行数是否为根据统计信息估计的值
+    bool estimated;
+};
+
 template <class T> NOrmQuerySet<T>::NOrmQuerySet() {
     d = new NOrmQuerySetPrivate(T::staticMetaObject.className());
 }
@@ -202,9 +235,21 @@ template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::all() const {
     other.d->lowMark = d->lowMark;
     other.d->highMark = d->highMark;
     other.d->orderBy = d->orderBy;
+    other.d->distinct = d->distinct;
+    other.d->groupBy = d->groupBy;
+    other.d->havingClause = d->havingClause;
+    other.d->windows = d->windows;
+    other.d->qualifyClause = d->qualifyClause;
     other.d->selectRelated = d->selectRelated;
     other.d->relatedFields = d->relatedFields;
     other.d->whereClause = d->whereClause;
+    other.d->databaseAlias = d->databaseAlias;
+    return other;
+}
+
+template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::annotate(const NOrmWindow &window) const {
+    NOrmQuerySet<T> other = all();
+    other.d->windows << window;
     return other;
 }
 
@@ -212,17 +257,37 @@ template <class T> int NOrmQuerySet<T>::count() const {
     if (d->hasResults)
         return d->properties.size();
 
-    QVariant count(aggregate(NOrmWhere::COUNT, "*"));
+    // a set filtered on window functions is counted over the windowed subquery
+    if (!d->qualifyClause.isAll())
+        return int(d->sqlQualifyCount());
+
+    // rows repeated by joins are counted once
+    QVariant count(d->distinct ? aggregate(NOrmWhere::COUNT_DISTINCT, "pk") : aggregate(NOrmWhere::COUNT, "*"));
     return count.isValid() ? count.toInt() : -1;
 }
 
+template <class T> qint64 NOrmQuerySet<T>::estimatedCount() const {
+    return d->sqlEstimatedCount();
+}
+
+template <class T> qint64 NOrmQuerySet<T>::estimatedDistinctCount(const QString &field) const {
+    return d->sqlEstimatedDistinctCount(field);
+}
+
 template <class T>
 QVariant NOrmQuerySet<T>::aggregate(const NOrmWhere::AggregateType func, const QString &field) const {
-    // execute aggregate query
-    NOrmQuery query(d->aggregateQuery(func, field));
-    if (!query.exec() || !query.next())
-        return QVariant();
-    return query.value(0);
+    return d->sqlAggregate(func, field);
+}
+
+template <class T>
+QList<QVariantMap> NOrmQuerySet<T>::aggregate(const QList<NOrmAggregate> &aggregates) const {
+    return d->sqlAggregates(aggregates);
+}
+
+template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::distinct() const {
+    NOrmQuerySet<T> other = all();
+    other.d->distinct = true;
+    return other;
 }
 
 template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::exclude(const NOrmWhere &where) const {
@@ -237,6 +302,18 @@ template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::filter(const NOrmWhere &wher
     return other;
 }
 
+template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::groupBy(const QStringList &fields) const {
+    NOrmQuerySet<T> other = all();
+    other.d->groupBy << fields;
+    return other;
+}
+
+template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::having(const NOrmWhere &where) const {
+    NOrmQuerySet<T> other = all();
+    other.d->havingClause = other.d->havingClause && where;
+    return other;
+}
+
 template <class T> T *NOrmQuerySet<T>::get(const NOrmWhere &where, T *target) const {
     NOrmQuerySet<T> qs = filter(where);
     return qs.size() == 1 ? qs.at(0, target) : 0;
@@ -270,10 +347,35 @@ template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::orderBy(const QStringList &k
     return other;
 }
 
+template <class T> bool NOrmQuerySet<T>::bulkCreate(const QList<T*> &objects) {
+    QList<QObject*> models;
+    foreach (T *object, objects)
+        models << object;
+    return d->sqlBulkCreate(models);
+}
+
 template <class T> bool NOrmQuerySet<T>::remove() {
     return d->sqlDelete();
 }
 
+template <class T> NOrmPage<T> NOrmQuerySet<T>::page(int number, int size, bool estimate) const {
+    Q_ASSERT(!d->lowMark && !d->highMark);
+    Q_ASSERT(number > 0);
+    Q_ASSERT(size > 0);
+
+    NOrmPage<T> result;
+    result.items = limit((number - 1) * size, size);
+    result.total = result.items.d->sqlFetchPage(estimate, &result.estimated);
+    return result;
+}
+
+template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::qualify(const NOrmWhere &where) const {
+    Q_ASSERT(!d->lowMark && !d->highMark);
+    NOrmQuerySet<T> other = all();
+    other.d->qualifyClause = other.d->qualifyClause && where;
+    return other;
+}
+
 template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::selectRelated(const QStringList &relatedFields) const {
     NOrmQuerySet<T> other = all();
     other.d->selectRelated = true;
@@ -281,6 +383,12 @@ template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::selectRelated(const QStringL
     return other;
 }
 
+template <class T> NOrmQuerySet<T> NOrmQuerySet<T>::use(const QString &alias) const {
+    NOrmQuerySet<T> other = all();
+    other.d->databaseAlias = alias;
+    return other;
+}
+
 template <class T> int NOrmQuerySet<T>::size() {
     if (!d->sqlFetch())
         return -1;
@@ -295,14 +403,26 @@ template <class T> QList<QVariantMap> NOrmQuerySet<T>::values(const QStringList
     return d->sqlValues(fields);
 }
 
-template <class T> QList<QVariantList> NOrmQuerySet<T>::valuesList(const QStringList &fields) {
-    return d->sqlValuesList(fields);
+template <class T> QList<QVariantList> NOrmQuerySet<T>::valuesList(const QStringList &fields, bool distinct) {
+    return d->sqlValuesList(fields, distinct);
+}
+
+template <class T> qint64 NOrmQuerySet<T>::exportTo(QIODevice *device, NOrm::DataFormat format, const QStringList &fields) {
+    return d->sqlExport(device, format, fields);
+}
+
+template <class T> qint64 NOrmQuerySet<T>::importFrom(QIODevice *device, NOrm::DataFormat format, const NOrmImportOptions &options) {
+    return d->sqlImport(device, format, options);
 }
 
 template <class T> NOrmWhere NOrmQuerySet<T>::where() const {
     return d->resolvedWhere(NOrm::database());
 }
 
+template <class T> NOrmSubquery NOrmQuerySet<T>::subquery(const QString &field) const {
+    return NOrmSubquery(T::staticMetaObject.className(), d->whereClause, field, d->orderBy, d->lowMark, d->highMark);
+}
+
 template <class T> NOrmQuerySet<T> &NOrmQuerySet<T>::operator=(const NOrmQuerySet<T> &other) {
     other.d->counter.ref();
     if (!d->counter.deref())
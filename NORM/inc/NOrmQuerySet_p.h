@@ -2,9 +2,11 @@
 #define NORM_QUERYSET_P_H
 
 #include <QStringList>
+#include "NOrm.h"
 #include "NOrm_p.h"
 #include "NOrmWhere.h"
 
+class QIODevice;
 class NOrmMetaModel;
 
 class NOrmModelReference
@@ -34,22 +36,44 @@ public:
 class NOrmCompiler
 {
 public:
-    NOrmCompiler(const char *modelName, const QSqlDatabase &db);
+    NOrmCompiler(const char *modelName, const QSqlDatabase &db, const QString &aliasPrefix = QString());
     QString fromSql();
     QStringList fieldNames(bool recurse, const QStringList *fields = nullptr, NOrmMetaModel *metaModel = nullptr, const QString &modelPath = QString(), bool nullable = false);
-    QString orderLimitSql(const QStringList &orderBy, int lowMark, int highMark);
-    void resolve(NOrmWhere &where);
+    QString orderLimitSql(const QStringList &orderBy, int lowMark, int highMark, bool searchOrder = false);
+    QString aggregateSql(NOrmWhere::AggregateType func, const QString &field, bool approximate = false);
+    QString annotate(const NOrmAggregate &aggregate);
+    QStringList groupColumns(const QStringList &fields);
+    QString windowSql(const NOrmWindow &window);
+    QString windowSubquerySql(const QStringList &columns, const QList<NOrmWindow> &windows, const QString &where,
+                              NOrmWhere &qualify, const QStringList &orderBy, int lowMark, int highMark, bool distinct = false);
+    bool resolve(NOrmWhere &where);
 
 private:
     QString databaseColumn(const QString &name);
+    QString orderColumns(const QStringList &fields);
+    QString jsonColumn(const NOrmWhere &where);
+    QString searchSql(NOrmWhere &where, bool rank);
+    QString subquerySql(NOrmWhere &where);
+    bool isCaseInsensitive(const QString &name) const;
+    void resolveCaseInsensitive(NOrmWhere &where);
+    void resolveWhere(NOrmWhere &where, bool rankable);
     QString referenceModel(const QString &modelPath, NOrmMetaModel *metaModel, bool nullable);
     void limitSql(QString &limit, int lowMark, int highMark);
 
+    QSqlDatabase database;
     QSqlDriver *driver;
+    NOrmDatabase::DatabaseType databaseType;
     NOrmMetaModel baseModel;
     QMap<QString, NOrmModelReference> modelRefs;
     QMap<QString, NOrmReverseReference> reverseModelRefs;
     QMap<QString, QString> fieldColumnCache;
+    QString searchJoin;
+    QString searchRank;
+    bool searchOrdered;
+    QMap<QString, QString> annotations;
+    QString aliasPrefix;
+    int subqueryCount;
+    bool resolveFailed;
 };
 
 /** \internal
@@ -63,32 +87,72 @@ public:
     NOrmWhere resolvedWhere(const QSqlDatabase &db) const;
     bool sqlDelete();
     bool sqlFetch();
+    qint64 sqlFetchPage(bool estimate, bool *estimated);
+    qint64 sqlCount() const;
+    qint64 sqlQualifyCount() const;
+    qint64 sqlEstimatedCount() const;
+    qint64 estimatedRows() const;
+    qint64 statisticsRows() const;
+    qint64 plannedRows() const;
+    qint64 sqlEstimatedDistinctCount(const QString &field) const;
+    qint64 statisticsDistinctRows(const QString &field) const;
     bool sqlInsert(const QVariantMap &fields, QVariant *insertId = nullptr);
+    bool sqlBulkInsert(const QList<QVariantMap> &rows, QVariantList *insertIds = nullptr);
+    bool sqlBulkCreate(const QList<QObject*> &models);
     bool sqlLoad(QObject *model, int index);
     int sqlUpdate(const QVariantMap &fields);
+    int sqlBulkUpdate(const QList<QVariantMap> &rows);
+    QVariant sqlAggregate(const NOrmWhere::AggregateType func, const QString &field) const;
+    QList<QVariantMap> sqlAggregates(const QList<NOrmAggregate> &aggregates) const;
+    QList<int> targetShards() const;
+    QSqlDatabase writeDatabase() const;
     QList<QVariantMap> sqlValues(const QStringList &fields);
-    QList<QVariantList> sqlValuesList(const QStringList &fields);
+    QList<QVariantList> sqlValuesList(const QStringList &fields, bool distinct = false);
+    qint64 sqlExport(QIODevice *device, NOrm::DataFormat format, const QStringList &fields);
+    qint64 sqlImport(QIODevice *device, NOrm::DataFormat format, const NOrmImportOptions &options);
+    bool sqlBulkUpsert(const QList<QVariantMap> &rows, const QStringList &conflictFields);
 
     // SQL queries
-    NOrmQuery aggregateQuery(const NOrmWhere::AggregateType func, const QString &field) const;
+    NOrmQuery aggregateQuery(const QSqlDatabase &db, const NOrmWhere::AggregateType func, const QString &field, bool approximate = false) const;
+    NOrmQuery aggregatesQuery(const QSqlDatabase &db, const QList<NOrmAggregate> &aggregates) const;
+    NOrmQuery distinctValuesQuery(const QSqlDatabase &db, const QStringList &fields) const;
     NOrmQuery deleteQuery() const;
-    NOrmQuery insertQuery(const QVariantMap &fields) const;
-    NOrmQuery selectQuery() const;
+    NOrmQuery insertQuery(const QVariantMap &fields, bool returning = false) const;
+    NOrmQuery bulkInsertQuery(const QList<QVariantMap> &rows, bool returning = false) const;
+    NOrmQuery bulkUpsertQuery(const QList<QVariantMap> &rows, const QStringList &conflictFields) const;
+    NOrmQuery selectQuery(const QSqlDatabase &db) const;
+    NOrmQuery qualifyCountQuery(const QSqlDatabase &db) const;
     NOrmQuery updateQuery(const QVariantMap &fields) const;
+    NOrmQuery bulkUpdateQuery(const QList<QVariantMap> &rows) const;
 
     // reference counter
     QAtomicInt counter;
 
     bool hasResults;
+    bool distinct;
     int lowMark;
     int highMark;
     NOrmWhere whereClause;
     QStringList orderBy;
+    QStringList groupBy;
+    NOrmWhere havingClause;
+    QList<NOrmWindow> windows;
+    NOrmWhere qualifyClause;
     QList<QVariantList> properties;
     bool selectRelated;
     QStringList relatedFields;
+    QString databaseAlias;
+
+    // shard the set is bound to, -1 to route by the shard key
+    int shard;
 
 private:
+    bool sqlFetchShards(const QList<int> &shards);
+    QVariant sqlAggregateShards(const QList<int> &shards, const NOrmWhere::AggregateType func, const QString &field) const;
+    int windowIndex(const QString &name) const;
+    QStringList selectedOrderBy() const;
+    static bool shardKeyValues(const NOrmWhere &where, const QStringList &keys, QVariantList *values);
+
     Q_DISABLE_COPY(NOrmQuerySetPrivate)
     QByteArray m_modelName;
     friend class NOrmMetaModel;
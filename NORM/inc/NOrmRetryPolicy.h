@@ -0,0 +1,66 @@
+#ifndef NORM_RETRYPOLICY_H
+#define NORM_RETRYPOLICY_H
+
+/*
+ * 描述: NORM 瞬时错误(锁冲突/死锁)的重试策略
+ * 作者: daodaoliang@yeah.net
+ * 时间: 2026-10-19
+ */
+
+#include <QStringList>
+
+class QSqlError;
+
+/**
+ * @brief The NOrmRetryPolicy class 重试策略
+ * 错误码为驱动返回的 QSqlError::nativeErrorCode(), 例如 sqlite 的 "5"(SQLITE_BUSY),
+ * mysql 的 "1205"(锁等待超时)/"1213"(死锁), postgresql 的 SQLSTATE "40P01".
+ */
+class NOrmRetryPolicy
+{
+public:
+    // 构造(默认不重试, 错误码使用各数据库的常见瞬时错误)
+    NOrmRetryPolicy();
+
+    /**
+     * @brief isStatementRetryable 是否可以直接重放当前语句
+     * @param error 数据库错误
+     * @param inTransaction 是否处于 NOrm::transaction() 中
+     * @return true or false
+     */
+    bool isStatementRetryable(const QSqlError &error, bool inTransaction) const;
+
+    /**
+     * @brief isTransactionRetryable 是否可以重放整个事务
+     * @param error 数据库错误
+     * @return true or false
+     */
+    bool isTransactionRetryable(const QSqlError &error) const;
+
+    /**
+     * @brief backoff 第 attempt 次失败后的等待时间(带随机抖动的指数退避)
+     * @param attempt 失败次数, 从 1 开始
+     * @return 毫秒
+     */
+    int backoff(int attempt) const;
+
+    // 最大执行次数(包含首次执行), 1 表示不重试
+    int maxAttempts;
+
+    // 首次重试前的等待时间上限(毫秒)
+    int initialBackoff;
+
+    // 等待时间的上限(毫秒)
+    int maxBackoff;
+
+    // 每次重试等待时间上限的倍数
+    double multiplier;
+
+    // 只会回滚当前语句的错误码, 可以直接重放语句
+    QStringList statementErrors;
+
+    // 会回滚整个事务的错误码, 只能重放整个事务
+    QStringList transactionErrors;
+};
+
+#endif
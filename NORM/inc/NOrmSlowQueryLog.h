@@ -0,0 +1,90 @@
+#ifndef NORM_SLOWQUERYLOG_H
+#define NORM_SLOWQUERYLOG_H
+
+/*
+ * 描述: NORM 慢查询日志
+ * 作者: daodaoliang@yeah.net
+ * 时间: 2026-10-19
+ */
+
+#include <QDateTime>
+#include <QStringList>
+#include <QVariant>
+#include <functional>
+
+/**
+ * @brief The NOrmSlowQuery class 一条慢查询记录
+ */
+class NOrmSlowQuery
+{
+public:
+    NOrmSlowQuery();
+
+    // 转换成日志文本
+    QString toString() const;
+
+    // 开始执行的时间
+    QDateTime time;
+
+    // 执行的线程
+    QString thread;
+
+    // 语句
+    QString sql;
+
+    // 绑定参数(已按配置脱敏)
+    QVariantList bindValues;
+
+    // 执行耗时(毫秒)
+    qint64 duration;
+
+    // 执行计划, 数据库不支持时为空
+    QString plan;
+};
+
+/**
+ * @brief The NOrmSlowQueryLog class 慢查询日志配置
+ * 语句执行时间超过阈值时, 在同一个链接上用相同的绑定参数执行 EXPLAIN,
+ * 并把语句/参数/耗时/线程/执行计划写入滚动日志文件或回调
+ */
+class NOrmSlowQueryLog
+{
+public:
+    // 构造(默认关闭)
+    NOrmSlowQueryLog();
+
+    /**
+     * @brief isEnabled 是否启用
+     * @return true or false
+     */
+    bool isEnabled() const;
+
+    /**
+     * @brief write 写入一条慢查询记录
+     * @param query 慢查询记录
+     */
+    void write(const NOrmSlowQuery &query) const;
+
+    // 阈值(毫秒), 小于 0 表示关闭
+    int threshold;
+
+    // 是否采集执行计划
+    bool explain;
+
+    // 参数脱敏, 返回写入日志的值, 为空时原样记录
+    std::function<QVariant(int index, const QVariant &value)> redactor;
+
+    // 日志文件路径, 为空时不写文件
+    QString filePath;
+
+    // 单个日志文件的最大字节数, 超过后滚动为 filePath.1, filePath.2 ...
+    qint64 maxFileSize;
+
+    // 保留的历史日志文件个数
+    int maxFiles;
+
+    // 回调, 和日志文件可以同时使用
+    std::function<void(const NOrmSlowQuery &query)> callback;
+};
+
+#endif
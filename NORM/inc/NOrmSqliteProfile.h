@@ -0,0 +1,54 @@
+#ifndef NORM_SQLITEPROFILE_H
+#define NORM_SQLITEPROFILE_H
+
+/*
+ * 描述: NORM sqlite 连接的性能配置
+ * 作者: daodaoliang@yeah.net
+ * 时间: 2026-10-19
+ */
+
+#include <QStringList>
+
+/**
+ * @brief The NOrmSqliteProfile class sqlite 性能配置
+ * 以 PRAGMA 的形式应用到每一个 sqlite 连接(包括各线程克隆出的连接)上.
+ */
+class NOrmSqliteProfile
+{
+public:
+    // 构造(空配置, 不修改 sqlite 的默认值)
+    NOrmSqliteProfile();
+
+    /**
+     * @brief performance 推荐的高并发配置
+     * WAL + synchronous=NORMAL + 256MB mmap + 64MB 页缓存 + 内存临时表 + 5 秒忙等待
+     * @return 配置
+     */
+    static NOrmSqliteProfile performance();
+
+    /**
+     * @brief pragmas 需要在每个连接上执行的 PRAGMA 语句
+     * @return 语句列表
+     */
+    QStringList pragmas() const;
+
+    // 日志模式(DELETE/TRUNCATE/PERSIST/MEMORY/WAL/OFF), 空表示不修改
+    QString journalMode;
+
+    // 同步级别(OFF/NORMAL/FULL/EXTRA), 空表示不修改
+    QString synchronous;
+
+    // 内存映射大小(字节), 小于 0 表示不修改
+    qint64 mmapSize;
+
+    // 页缓存大小, 正数为页数, 负数为 KiB, 0 表示不修改
+    int cacheSize;
+
+    // 临时表的存储位置(DEFAULT/FILE/MEMORY), 空表示不修改
+    QString tempStore;
+
+    // 数据库被锁时的等待时间(毫秒), 小于 0 表示不修改
+    int busyTimeout;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef NORM_UNITOFWORK_H
+#define NORM_UNITOFWORK_H
+
+/*
+ * 描述: NORM 工作单元(按外键依赖顺序批量提交对象图)
+ * 作者: daodaoliang@yeah.net
+ * 时间: 2026-10-19
+ */
+
+#include <QList>
+#include "NOrm_p.h"
+
+class NOrmUnitOfWorkPrivate;
+
+/**
+ * @brief The NOrmUnitOfWork class 工作单元
+ * 登记新增、修改和删除的模型对象, 提交时在一个事务中按外键拓扑顺序
+ * 以多行 INSERT/UPDATE/DELETE 的方式批量写入, 并把生成的主键回填到
+ * 依赖对象的 _id 属性中. 工作单元不持有对象的所有权.
+ */
+class NOrmUnitOfWork
+{
+public:
+    // 构造
+    NOrmUnitOfWork();
+
+    // 析构
+    ~NOrmUnitOfWork();
+
+    /**
+     * @brief registerNew 登记新增对象
+     * @param model 模型对象
+     */
+    void registerNew(QObject *model);
+
+    /**
+     * @brief registerDirty 登记已修改的对象
+     * @param model 模型对象
+     */
+    void registerDirty(QObject *model);
+
+    /**
+     * @brief registerDeleted 登记需要删除的对象
+     * @param model 模型对象
+     */
+    void registerDeleted(QObject *model);
+
+    /**
+     * @brief batchSize 单条语句写入的最大行数
+     * @return 行数
+     */
+    int batchSize() const;
+
+    /**
+     * @brief setBatchSize 设置单条语句写入的最大行数
+     * @param size 行数
+     */
+    void setBatchSize(int size);
+
+    // 是否没有登记任何对象
+    bool isEmpty() const;
+
+    // 清空登记的对象
+    void clear();
+
+    /**
+     * @brief commit 提交所有登记的对象
+     * @return 提交操作的结果, 失败时登记的对象保持不变
+     */
+    bool commit();
+
+private:
+    Q_DISABLE_COPY(NOrmUnitOfWork)
+    NOrmUnitOfWorkPrivate *d;
+};
+
+#endif
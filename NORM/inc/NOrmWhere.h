@@ -2,12 +2,14 @@
 #define NORM_WHERE_H
 
 #include <QSharedDataPointer>
+#include <QStringList>
 #include <QVariant>
 
 #include "NOrm_p.h"
 
 class NOrmMetaModel;
 class NOrmQuery;
+class NOrmSubquery;
 class NOrmWherePrivate;
 
 class NOrmWhere
@@ -31,7 +33,10 @@ public:
         INotEquals,
         IStartsWith,
         IEndsWith,
-        IContains
+        IContains,
+        ArrayContains,
+        Search,
+        Exists
     };
 
     enum AggregateType{
@@ -39,11 +44,13 @@ public:
         COUNT,
         SUM,
         MIN,
-        MAX
+        MAX,
+        COUNT_DISTINCT
     };
     NOrmWhere();
     NOrmWhere(const NOrmWhere &other);
     NOrmWhere(const QString &key, NOrmWhere::Operation operation, QVariant value);
+    NOrmWhere(const QString &key, NOrmWhere::Operation operation, const NOrmSubquery &subquery);
     ~NOrmWhere();
 
     NOrmWhere& operator=(const NOrmWhere &other);
@@ -67,6 +74,113 @@ private:
 private:
     QSharedDataPointer<NOrmWherePrivate> d;
     friend class NOrmCompiler;
+    friend class NOrmQuerySetPrivate;
+};
+
+/**
+ * @brief The NOrmSubquery class 作为过滤条件值的子查询, 由 NOrmQuerySet<T>::subquery() 生成
+ * 编译在外层语句中, 结果不会先取回客户端, 子查询的参数按位置合并到外层语句:
+ * IsIn 编译为 key IN (SELECT field ...), Equals 编译为 key = (SELECT field ...),
+ * Exists 编译为 EXISTS (SELECT 1 ...), 指定 key 时子查询的 field 与外层的 key 关联
+ */
+class NOrmSubquery
+{
+public:
+    NOrmSubquery(const QByteArray &modelName, const NOrmWhere &where, const QString &field,
+                 const QStringList &orderBy = QStringList(), int lowMark = 0, int highMark = 0);
+
+    // 模型类名
+    QByteArray modelName;
+
+    // 过滤条件
+    NOrmWhere where;
+
+    // 投影的字段
+    QString field;
+
+    // 排序, 只在限定了范围时生效
+    QStringList orderBy;
+
+    // 范围
+    int lowMark;
+    int highMark;
+};
+
+/**
+ * @brief The NOrmAggregate class 分组统计中的一个聚合, 结果按 name 返回
+ * field 可以是关联模型的字段(author__age), COUNT 可以使用 "*";
+ * name 可以在 having() 的条件和 orderBy() 中引用
+ */
+class NOrmAggregate
+{
+public:
+    NOrmAggregate(const QString &name, NOrmWhere::AggregateType type, const QString &field);
+
+    // 结果名字
+    QString name;
+
+    // 聚合函数
+    NOrmWhere::AggregateType type;
+
+    // 字段
+    QString field;
+};
+
+/**
+ * @brief The NOrmWindow class 窗口函数, 由 NOrmQuerySet<T>::annotate() 附加到查询结果,
+ * 结果按 name 在 values()/valuesList() 中返回, 可以在 qualify() 的条件和 orderBy() 中引用.
+ * 字段可以是关联模型的字段, orderBy 的字段前加 "-" 表示降序;
+ * 需要 sqlite 3.25 / mysql 8 / postgresql 以上
+ */
+class NOrmWindow
+{
+public:
+    /**
+     * @brief The Function enum 窗口函数
+     */
+    enum Function {
+        // 分区内的行号
+        RowNumber,
+        // 分区内的排名(并列时跳号)
+        Rank,
+        // 分区内的排名(并列时不跳号)
+        DenseRank,
+        // 前 offset 行的字段值
+        Lag,
+        // 后 offset 行的字段值
+        Lead,
+        // 分区内第一行的字段值
+        FirstValue,
+        // 分区内到当前行为止最后一行的字段值
+        LastValue,
+        // 以下为聚合, 指定排序时为累计值(running total)
+        Sum,
+        Avg,
+        Count,
+        Min,
+        Max
+    };
+
+    NOrmWindow(const QString &name, Function function, const QString &field = QString(),
+               const QStringList &partitionBy = QStringList(), const QStringList &orderBy = QStringList(), int offset = 1);
+
+    // 结果名字
+    QString name;
+
+    // 窗口函数
+    Function function;
+
+    // 字段, Count 可以使用 "*"
+    QString field;
+
+    // 分区字段
+    QStringList partitionBy;
+
+    // 排序字段
+    QStringList orderBy;
+
+    // Lag / Lead 的偏移行数
+    int offset;
 };
 
 #endif
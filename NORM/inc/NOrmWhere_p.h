@@ -2,6 +2,7 @@
 #define NORM_WHERE_P_H
 
 #include <QSharedData>
+#include <QSharedPointer>
 #include "NOrmWhere.h"
 
 class NOrmWherePrivate : public QSharedData
@@ -26,6 +27,9 @@ public:
     QList<NOrmWhere> children;
     Combine combine;
     bool negate;
+
+    // 子查询, 由 NOrmCompiler 编译后 key 为完整的条件, children 为子查询解析后的条件
+    QSharedPointer<NOrmSubquery> subquery;
 };
 
 #endif
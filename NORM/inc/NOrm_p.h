@@ -14,6 +14,7 @@
 #include <QSqlError>
 #include <QSqlQuery>
 #include <QVariant>
+#include "NOrmObserver.h"
 
 /**
  * @brief The NOrmDatabase class
@@ -25,6 +26,7 @@ class NOrmDatabase : public QObject
 
 public:
     NOrmDatabase(QObject *parent = nullptr);
+    ~NOrmDatabase();
 
     /**
      * @brief The DatabaseType enum 数据库类型
@@ -59,9 +61,101 @@ public:
      */
     static DatabaseType databaseType(const QSqlDatabase &db);
 
+    /**
+     * @brief hasInsertReturning 插入语句能否直接返回生成的主键(RETURNING / OUTPUT)
+     * @param db 数据库信息
+     * @return true or false
+     */
+    static bool hasInsertReturning(const QSqlDatabase &db);
+
+    /**
+     * @brief insertIdStep 多行插入时自增主键的步长
+     * @param db 数据库信息
+     * @return 生成的主键连续时返回步长, 不保证连续时返回 0
+     */
+    static int insertIdStep(const QSqlDatabase &db);
+
+    /**
+     * @brief hasWindowFunctions 是否支持窗口函数(sqlite 3.25 / mysql 8 / mariadb 10.2 以上)
+     * @param db 数据库信息
+     * @return true or false
+     */
+    static bool hasWindowFunctions(const QSqlDatabase &db);
+
+    /**
+     * @brief hasJsonArrays 能否把绑定的 JSON 数组展开成行(sqlite JSON1 / mysql 8.0.4 / mariadb 10.6 /
+     * sqlserver 2016 以上), postgresql 直接绑定数组
+     * @param db 数据库信息
+     * @return true or false
+     */
+    static bool hasJsonArrays(const QSqlDatabase &db);
+
+    /**
+     * @brief maxBindValues 单条语句允许绑定的参数个数
+     * @param db 数据库信息
+     * @return 参数个数
+     */
+    static int maxBindValues(const QSqlDatabase &db);
+
+    /**
+     * @brief inTransaction 当前线程是否处于 NOrm::transaction() 或 NOrmUnitOfWork::commit() 开启的事务中,
+     * 不查询数据库
+     * @return true or false
+     */
+    static bool inTransaction();
+
+    /**
+     * @brief enterTransaction 标记当前线程进入 NOrm 开启的事务
+     */
+    static void enterTransaction();
+
+    /**
+     * @brief leaveTransaction 标记当前线程离开 NOrm 开启的事务
+     */
+    static void leaveTransaction();
+
+    /**
+     * @brief isInMemory 是否是 sqlite 内存数据库, 其他线程的链接看到的是另一个空数据库
+     * @param db 数据库信息
+     * @return true or false
+     */
+    static bool isInMemory(const QSqlDatabase &db);
+
+    /**
+     * @brief inTransaction 链接是否处于事务中, 包括直接调用 QSqlDatabase::transaction() 开启的事务,
+     * 需要查询数据库, 无法确定时返回 true; 只在语句出错决定能否重放时使用
+     * @param db 数据库信息
+     * @return true or false
+     */
+    static bool inTransaction(const QSqlDatabase &db);
+
+    /**
+     * @brief shardCount 分片个数
+     * @return 个数, 0 表示没有启用分片
+     */
+    static int shardCount();
+
+    /**
+     * @brief shardDatabase 当前线程访问分片使用的链接
+     * @param index 分片序号
+     * @return 数据库信息
+     */
+    static QSqlDatabase shardDatabase(int index);
+
+    /**
+     * @brief markWrite 记录当前线程刚刚执行过写操作, 之后一段时间内的读操作走主库
+     */
+    static void markWrite();
+
     // 数据库对象
     QSqlDatabase reference;
 
+    // 线程链接名的前缀
+    QString prefix;
+
+    // 正在执行的读操作个数
+    QAtomicInt load;
+
     // 数据库锁
     QMutex mutex;
 
@@ -77,6 +171,103 @@ private slots:
     void threadFinished();
 };
 
+/**
+ * @brief The NOrmReadDatabase class 读操作使用的数据库链接
+ * 构造时按路由策略选择主库或只读副本, 存在期间计入该副本的负载;
+ * 指定分片时直接使用该分片
+ */
+class NOrmReadDatabase
+{
+public:
+    NOrmReadDatabase(const QString &alias = QString(), int shard = -1);
+    ~NOrmReadDatabase();
+
+    // 选中的数据库链接
+    QSqlDatabase database() const;
+
+private:
+    Q_DISABLE_COPY(NOrmReadDatabase)
+    NOrmDatabase *m_replica;
+    QSqlDatabase m_database;
+};
+
+/**
+ * @brief The NOrmSpanScope class 在存在期间记录一个执行阶段
+ * 没有观察者时不做任何事情
+ */
+class NOrmSpanScope
+{
+public:
+    NOrmSpanScope(NOrmSpan::Phase phase, const QString &model = QString());
+    ~NOrmSpanScope();
+
+    // 是否有观察者在记录
+    bool isActive() const;
+
+    // 设置语句, 归一化和计算形状编号在结束时进行
+    void setSql(const QString &sql);
+
+    // 设置行数
+    void setRows(qint64 rows);
+
+    // 设置是否成功
+    void setOk(bool ok);
+
+    // 提前结束
+    void finish();
+
+private:
+    Q_DISABLE_COPY(NOrmSpanScope)
+    NOrmSpan *m_span;
+    NOrmSpan *m_parent;
+    qint64 m_started;
+};
+
+/**
+ * @brief The NOrmStringListCodec class QStringList 字段在数据库中的编码
+ * 编码为 JSON 字符串数组(postgresql 存为 jsonb, mysql 存为 json, 其他为文本),
+ * 元素中可以包含逗号, 并且可以在数据库端按元素过滤(NOrmWhere::ArrayContains)
+ */
+class NOrmStringListCodec
+{
+public:
+    // 编码为 JSON 数组
+    static QString encode(const QStringList &items);
+
+    // 把一个元素编码为 JSON 字符串并追加到 out
+    static void encodeString(QString &out, const QString &item);
+
+    // 解码, 兼容早期版本以逗号连接的值
+    static QStringList decode(const QString &text);
+};
+
+/**
+ * @brief The NOrmJsonCodec class JSON 字段(QVariantMap / QJsonObject)的编码和按路径取值
+ * 过滤条件(payload__json__a__b)和表达式索引(json_index)使用同一个取值表达式, 数据库才能使用索引
+ */
+class NOrmJsonCodec
+{
+public:
+    // 是否是 JSON 字段的类型
+    static bool isJsonType(int type);
+
+    // 编码为紧凑的 JSON 文本
+    static QString encode(const QVariant &value);
+
+    // 把数据库中的 JSON 文本解码为 type(QVariantMap 或 QJsonObject), 无法解析时返回空值
+    static QVariant decode(const QVariant &value, int type);
+
+    // 路径是否合法(字母/数字/下划线, 纯数字表示数组下标)
+    static bool isValidPath(const QStringList &path);
+
+    // 取值表达式, column 为已转义的列名, cast 为 postgresql 上的类型转换(numeric/boolean), 为空时按文本取值
+    static QString pathExpression(NOrmDatabase::DatabaseType databaseType, const QString &column,
+                                  const QStringList &path, const QString &cast = QString());
+
+    // 按绑定的值选择 postgresql 上的类型转换
+    static QString pathCast(const QVariant &value);
+};
+
 /**
  * @brief The NOrmQuery class 数据库查询对象
  */
@@ -84,9 +275,37 @@ class NOrmQuery : public QSqlQuery
 {
 public:
     NOrmQuery(QSqlDatabase db);
+    ~NOrmQuery();
     void addBindValue(const QVariant &val, QSql::ParamType paramType = QSql::In);
+    bool prepare(const QString &query);
     bool exec();
     bool exec(const QString &query);
+    bool next();
+
+    // 设置语句所属的模型, 用于执行阶段的追踪
+    void setModel(const QString &model);
+
+    // 执行语句的链接
+    QSqlDatabase database() const;
+
+private:
+    // 提交上一次执行读取结果的统计
+    void flushFetchProfile();
+
+    // 记录执行耗时, 超过阈值时写慢查询日志(只对执行成功的语句获取执行计划)
+    void recordExec(const QString &sql, qint64 usecs, bool prepared, bool ok);
+
+    // 链接
+    QSqlDatabase m_database;
+
+    // 所属的模型
+    QString m_model;
+
+    // 读取结果的耗时(纳秒) / 行数 / 数据量
+    qint64 m_fetchTime;
+    qint64 m_fetchRows;
+    qint64 m_fetchBytes;
+    bool m_fetched;
 };
 
 #endif
@@ -1,13 +1,20 @@
 #include <QCoreApplication>
 #include <QDateTime>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QSqlRecord>
 #include <QSqlDriver>
 #include <QSqlError>
 #include <QSqlQuery>
 #include <QStringList>
 #include <QThread>
+#include <QThreadStorage>
 #include <QStack>
+#include <QVersionNumber>
 #include "NOrm.h"
+#include "NOrmDiagnosticsScope.h"
+#include "NOrmProfiler.h"
+#include "NOrmSlowQueryLog.h"
 
 // 链接前缀
 static const char *connectionPrefix = "_norm_";
@@ -18,16 +25,86 @@ QMap<QByteArray, NOrmMetaModel> globalMetaModels = QMap<QByteArray, NOrmMetaMode
 // 数据库对象
 static NOrmDatabase *globalDatabase = nullptr;
 
+// 只读副本
+static QList<NOrmDatabase*> globalReplicas;
+
+// 分片
+static QList<NOrmDatabase*> globalShards;
+
+// 只读副本的选择策略
+static NOrm::ReplicaPolicy globalReplicaPolicy = NOrm::RoundRobin;
+
+// 写操作之后读主库的时长(毫秒)
+static int globalReplicaStickiness = 1000;
+
+// 轮询计数
+static QAtomicInt replicaCounter;
+
+// 当前线程最近一次写操作的时间
+static QThreadStorage<qint64> lastWriteTime;
+
 // 数据库类型
 static NOrmDatabase::DatabaseType globalDatabaseType = NOrmDatabase::UnknownDB;
 
+// IsIn 条件整体绑定为一个参数的元素个数阈值
+static int globalLargeInThreshold = 64;
+
+// 估计行数低于该值时改为精确计数
+static qint64 globalCountEstimateThreshold = 10000;
+
 // 调试模式
 static bool globalDebugEnabled = false;
 
-NOrmDatabase::NOrmDatabase(QObject *parent) : QObject(parent), connectionId(0)
+// 插入语句能否直接返回生成的主键
+static bool globalInsertReturning = false;
+
+// 多行插入时自增主键的步长(0 表示不保证连续)
+static int globalInsertIdStep = 0;
+
+// 是否支持窗口函数
+static bool globalWindowFunctions = false;
+
+// 能否把 JSON 数组展开成行(IN 列表整体绑定)
+static bool globalJsonArrays = false;
+
+// 重试策略
+static NOrmRetryPolicy globalRetryPolicy;
+
+// 慢查询日志
+static NOrmSlowQueryLog globalSlowQueryLog;
+
+// sqlite 性能配置
+static NOrmSqliteProfile globalSqliteProfile;
+
+// 累计重试次数
+static QAtomicInt globalRetryCount;
+
+// 当前线程 NOrm::transaction() 的嵌套层数
+static QThreadStorage<int> transactionDepth;
+
+// 当前线程最近一次执行失败的错误
+static QThreadStorage<QSqlError> lastQueryError;
+
+NOrmDatabase::NOrmDatabase(QObject *parent) : QObject(parent), prefix(QLatin1String(connectionPrefix)), connectionId(0)
 {
 }
 
+NOrmDatabase::~NOrmDatabase()
+{
+    // 移除各线程的链接, 重新添加时链接名会从头编号
+    QMutexLocker locker(&mutex);
+    QStringList connectionNames;
+    for (QMap<QThread*, QSqlDatabase>::const_iterator it = copies.constBegin(); it != copies.constEnd(); ++it) {
+        disconnect(it.key(), SIGNAL(finished()), this, SLOT(threadFinished()));
+        connectionNames << it.value().connectionName();
+    }
+    copies.clear();
+    foreach (const QString &connectionName, connectionNames) {
+        if (connectionName.startsWith(QLatin1String(connectionPrefix)))
+            QSqlDatabase::removeDatabase(connectionName);
+    }
+}
+
 void NOrmDatabase::threadFinished()
 {
     QThread *thread = qobject_cast<QThread*>(sender());
@@ -53,6 +130,10 @@ void NOrmDatabase::threadFinished()
 
 static void closeDatabase()
 {
+    qDeleteAll(globalReplicas);
+    globalReplicas.clear();
+    qDeleteAll(globalShards);
+    globalShards.clear();
     delete globalDatabase;
     globalDatabase = nullptr;
 }
@@ -95,9 +176,70 @@ static NOrmDatabase::DatabaseType getDatabaseType(QSqlDatabase &db)
     return NOrmDatabase::UnknownDB;
 }
 
+static void getDatabaseFeatures(QSqlDatabase &db)
+{
+    globalInsertReturning = false;
+    globalInsertIdStep = 0;
+    globalWindowFunctions = false;
+    globalJsonArrays = false;
+
+    QSqlQuery query(db);
+    switch (globalDatabaseType) {
+    case NOrmDatabase::PostgreSQL:
+        globalInsertReturning = true;
+        globalWindowFunctions = true;
+        globalJsonArrays = true;
+        break;
+    case NOrmDatabase::MSSqlServer:
+        globalInsertReturning = true;
+        globalWindowFunctions = true;
+        // OPENJSON 需要 sqlserver 2016 以上并且兼容级别不低于 130
+        globalJsonArrays = query.exec("SELECT value FROM OPENJSON('[1]')");
+        break;
+    case NOrmDatabase::Oracle:
+    case NOrmDatabase::DB2:
+    case NOrmDatabase::DaMeng:
+        globalWindowFunctions = true;
+        break;
+    case NOrmDatabase::SQLite:
+        // sqlite 3.35 开始支持 RETURNING, 3.25 开始支持窗口函数
+        if (query.exec("SELECT sqlite_version()") && query.next()) {
+            const QVersionNumber version = QVersionNumber::fromString(query.value(0).toString());
+            globalInsertReturning = version >= QVersionNumber(3, 35);
+            globalWindowFunctions = version >= QVersionNumber(3, 25);
+        }
+        // json_each 需要 JSON1 扩展(3.38 开始默认编译)
+        globalJsonArrays = query.exec("SELECT value FROM json_each('[1]')");
+        break;
+    case NOrmDatabase::MySqlServer:
+        // mariadb 10.5 开始支持 RETURNING; 窗口函数需要 mysql 8.0 / mariadb 10.2;
+        // JSON_TABLE 需要 mysql 8.0.4 / mariadb 10.6
+        if (query.exec("SELECT VERSION()") && query.next()) {
+            const QString version = query.value(0).toString();
+            if (version.contains(QLatin1String("MariaDB"))) {
+                globalInsertReturning = QVersionNumber::fromString(version) >= QVersionNumber(10, 5);
+                globalWindowFunctions = QVersionNumber::fromString(version) >= QVersionNumber(10, 2);
+                globalJsonArrays = QVersionNumber::fromString(version) >= QVersionNumber(10, 6);
+            } else {
+                globalWindowFunctions = QVersionNumber::fromString(version) >= QVersionNumber(8);
+                globalJsonArrays = QVersionNumber::fromString(version) >= QVersionNumber(8, 0, 4);
+            }
+        }
+
+        // innodb_autoinc_lock_mode 为 0 或 1 时同一条语句生成的主键是连续的
+        if (query.exec("SELECT @@innodb_autoinc_lock_mode, @@auto_increment_increment") && query.next()) {
+            if (query.value(0).toInt() < 2)
+                globalInsertIdStep = query.value(1).toInt();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// 每个链接(包括线程克隆出的链接)都需要的会话设置
 static bool initDatabase(QSqlDatabase db)
 {
-    // 数据库的默认创建(目前仅支持 sqlite 和 mysql)
     NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
 
     // sqlite
@@ -106,7 +248,22 @@ static bool initDatabase(QSqlDatabase db)
         NOrmQuery query(db);
         query.prepare("PRAGMA foreign_keys=on");
         query.exec();
-    } else if (databaseType == NOrmDatabase::MySqlServer) {
+
+        // 性能配置
+        foreach (const QString &pragma, globalSqliteProfile.pragmas()) {
+            if (!query.exec(pragma))
+                qWarning() << "SQL: " << pragma << " SQL error: " << query.lastError();
+        }
+    }
+    return true;
+}
+
+// 数据库的默认创建(目前仅支持 mysql), 只在设置数据库时执行一次
+static bool createDatabase(QSqlDatabase db)
+{
+    NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+
+    if (databaseType == NOrmDatabase::MySqlServer) {
         // create db if not exist
         auto dbName = QObject::tr("%1_tmp").arg(QString::number(quintptr(QThread::currentThreadId())));
         {
@@ -127,7 +284,7 @@ static bool initDatabase(QSqlDatabase db)
     return true;
 }
 
-NOrmQuery::NOrmQuery(QSqlDatabase db) : QSqlQuery(db)
+NOrmQuery::NOrmQuery(QSqlDatabase db) : QSqlQuery(db), m_database(db), m_fetchTime(0), m_fetchRows(0), m_fetchBytes(0), m_fetched(false)
 {
     if (NOrmDatabase::databaseType(db) == NOrmDatabase::MSSqlServer) {
         // 设置前置游标
@@ -135,6 +292,82 @@ NOrmQuery::NOrmQuery(QSqlDatabase db) : QSqlQuery(db)
     }
 }
 
+NOrmQuery::~NOrmQuery()
+{
+    flushFetchProfile();
+}
+
+void NOrmQuery::flushFetchProfile()
+{
+    if (!m_fetched)
+        return;
+    NOrmProfiler::record(lastQuery(), NOrmProfiler::Fetch, m_fetchTime / 1000, m_fetchRows, m_fetchBytes);
+    m_fetchTime = 0;
+    m_fetchRows = 0;
+    m_fetchBytes = 0;
+    m_fetched = false;
+}
+
+// 结果值在内存中的大小
+static qint64 valueBytes(const QVariant &value)
+{
+    if (value.isNull())
+        return 0;
+    switch (value.type()) {
+    case QVariant::String:
+        return value.toString().size() * qint64(sizeof(QChar));
+    case QVariant::ByteArray:
+        return value.toByteArray().size();
+    default:
+        return QMetaType::sizeOf(value.userType());
+    }
+}
+
+bool NOrmQuery::prepare(const QString &query)
+{
+    NOrmSpanScope span(NOrmSpan::Prepare, m_model);
+    span.setSql(query);
+    QElapsedTimer timer;
+    const bool timing = NOrmProfiler::isEnabled();
+    if (timing)
+        timer.start();
+
+    const bool ok = QSqlQuery::prepare(query);
+    if (timing)
+        NOrmProfiler::record(query, NOrmProfiler::Prepare, timer.nsecsElapsed() / 1000);
+    span.setOk(ok);
+    return ok;
+}
+
+bool NOrmQuery::next()
+{
+    if (!NOrmProfiler::isEnabled())
+        return QSqlQuery::next();
+
+    QElapsedTimer timer;
+    timer.start();
+    const bool ok = QSqlQuery::next();
+    if (ok) {
+        const int count = record().count();
+        for (int i = 0; i < count; ++i)
+            m_fetchBytes += valueBytes(value(i));
+        ++m_fetchRows;
+    }
+    m_fetchTime += timer.nsecsElapsed();
+    m_fetched = true;
+    return ok;
+}
+
+void NOrmQuery::setModel(const QString &model)
+{
+    m_model = model;
+}
+
+QSqlDatabase NOrmQuery::database() const
+{
+    return m_database;
+}
+
 void NOrmQuery::addBindValue(const QVariant &val, QSql::ParamType paramType)
 {
     // this hack is required so that we do not store a mix of local and UTC times
@@ -145,11 +378,130 @@ void NOrmQuery::addBindValue(const QVariant &val, QSql::ParamType paramType)
     }
 }
 
-bool NOrmQuery::exec()
+static void waitForRetry(int attempt, const QSqlError &error)
 {
-    if (!QSqlQuery::exec()) {
+    const int delay = globalRetryPolicy.backoff(attempt);
+    globalRetryCount.ref();
+    if (globalDebugEnabled)
+        qWarning() << "SQL retry" << attempt << "in" << delay << "ms, SQL error: " << error;
+    QThread::msleep(delay);
+}
+
+// 语句因瞬时错误失败时按重试策略等待, 返回是否需要重放
+static bool retryStatement(const QSqlDatabase &db, int attempt, const QSqlError &error)
+{
+    // 会回滚整个事务的错误, 还要确认链接没有处于调用者自己开启的事务中
+    if (attempt >= globalRetryPolicy.maxAttempts
+            || !globalRetryPolicy.isStatementRetryable(error, NOrmDatabase::inTransaction())
+            || (globalRetryPolicy.isTransactionRetryable(error) && NOrmDatabase::inTransaction(db))) {
+        lastQueryError.setLocalData(error);
         return false;
     }
+    waitForRetry(attempt, error);
+    return true;
+}
+
+// 在同一个链接上用相同的参数获取执行计划
+static QString explainPlan(QSqlDatabase db, const QString &sql, const QVariantList &values)
+{
+    // 只有增删改查语句有执行计划
+    const QString verb = sql.trimmed().section(QLatin1Char(' '), 0, 0).toUpper();
+    if (verb != QLatin1String("SELECT") && verb != QLatin1String("INSERT") && verb != QLatin1String("UPDATE")
+            && verb != QLatin1String("DELETE") && verb != QLatin1String("WITH"))
+        return QString();
+
+    QString prefix;
+    switch (NOrmDatabase::databaseType(db)) {
+    case NOrmDatabase::SQLite:
+        prefix = QLatin1String("EXPLAIN QUERY PLAN ");
+        break;
+    case NOrmDatabase::MySqlServer:
+    case NOrmDatabase::PostgreSQL:
+    case NOrmDatabase::DaMeng:
+        // 不带 ANALYZE, 写语句不会被执行
+        prefix = QLatin1String("EXPLAIN ");
+        break;
+    default:
+        // sqlserver 需要在单独的批次中 SET SHOWPLAN_TEXT ON
+        return QString();
+    }
+
+    // 直接使用 QSqlQuery, 执行计划本身不计入统计和慢查询
+    QSqlQuery query(db);
+    if (!query.prepare(prefix + sql))
+        return QString();
+    foreach (const QVariant &value, values)
+        query.addBindValue(value);
+    if (!query.exec())
+        return QString();
+
+    QStringList lines;
+    while (query.next()) {
+        QStringList columns;
+        const int count = query.record().count();
+        for (int i = 0; i < count; ++i)
+            columns << query.value(i).toString();
+        lines << columns.join(QLatin1String(" | "));
+    }
+    return lines.join(QLatin1Char('\n'));
+}
+
+void NOrmQuery::recordExec(const QString &sql, qint64 usecs, bool prepared, bool ok)
+{
+    if (NOrmProfiler::isEnabled())
+        NOrmProfiler::record(sql, NOrmProfiler::Exec, usecs);
+    if (!globalSlowQueryLog.isEnabled() || usecs < qint64(globalSlowQueryLog.threshold) * 1000)
+        return;
+
+    QVariantList values;
+    if (prepared) {
+        const int count = boundValues().size();
+        for (int i = 0; i < count; ++i)
+            values << boundValue(i);
+    }
+
+    NOrmSlowQuery slowQuery;
+    slowQuery.time = QDateTime::currentDateTime().addMSecs(-usecs / 1000);
+    slowQuery.thread = QThread::currentThread()->objectName();
+    if (slowQuery.thread.isEmpty())
+        slowQuery.thread = QLatin1String("0x") + QString::number(quintptr(QThread::currentThreadId()), 16);
+    slowQuery.sql = sql;
+    slowQuery.duration = usecs / 1000;
+    for (int i = 0; i < values.size(); ++i)
+        slowQuery.bindValues << (globalSlowQueryLog.redactor ? globalSlowQueryLog.redactor(i, values.at(i)) : values.at(i));
+    // 失败的语句可能无法解析, 重新执行 EXPLAIN 只会再失败一次
+    if (globalSlowQueryLog.explain && ok)
+        slowQuery.plan = explainPlan(m_database, sql, values);
+    globalSlowQueryLog.write(slowQuery);
+}
+
+bool NOrmQuery::exec()
+{
+    flushFetchProfile();
+    NOrmSpanScope span(NOrmSpan::Exec, m_model);
+    QElapsedTimer timer;
+    const bool timing = NOrmProfiler::isEnabled() || globalSlowQueryLog.isEnabled();
+    if (timing)
+        timer.start();
+
+    bool ok = true;
+    for (int attempt = 1; !QSqlQuery::exec(); ++attempt) {
+        if (!retryStatement(m_database, attempt, lastError())) {
+            ok = false;
+            break;
+        }
+    }
+    if (span.isActive()) {
+        span.setSql(lastQuery());
+        span.setRows(ok && !isSelect() ? numRowsAffected() : -1);
+        span.setOk(ok);
+        span.finish();
+    }
+    if (timing)
+        recordExec(lastQuery(), timer.nsecsElapsed() / 1000, true, ok);
+    NOrmDiagnosticsScope::recordQuery(lastQuery());
+    if (!ok)
+        return false;
     if (globalDebugEnabled)
         qWarning() << "SQL: " << executedQuery() << " SQL error: " <<  lastError();
     return true;
@@ -157,44 +509,110 @@ bool NOrmQuery::exec()
 
 bool NOrmQuery::exec(const QString &query)
 {
-    if (!QSqlQuery::exec(query)) {
-        return false;
+    flushFetchProfile();
+    NOrmSpanScope span(NOrmSpan::Exec, m_model);
+    QElapsedTimer timer;
+    const bool timing = NOrmProfiler::isEnabled() || globalSlowQueryLog.isEnabled();
+    if (timing)
+        timer.start();
+
+    bool ok = true;
+    for (int attempt = 1; !QSqlQuery::exec(query); ++attempt) {
+        if (!retryStatement(m_database, attempt, lastError())) {
+            ok = false;
+            break;
+        }
     }
+    if (span.isActive()) {
+        span.setSql(query);
+        span.setRows(ok && !isSelect() ? numRowsAffected() : -1);
+        span.setOk(ok);
+        span.finish();
+    }
+    if (timing)
+        recordExec(query, timer.nsecsElapsed() / 1000, false, ok);
+    NOrmDiagnosticsScope::recordQuery(query);
+    if (!ok)
+        return false;
     if (globalDebugEnabled)
         qWarning() << "SQL: " << executedQuery() << " SQL error: " <<  lastError();
     return true;
 }
 
-QSqlDatabase NOrm::database()
+// 当前线程使用的链接
+static QSqlDatabase threadDatabase(NOrmDatabase *database)
 {
-    if (!globalDatabase)
-        return QSqlDatabase();
-
     // 主线程返回主链接
     QThread *thread = QThread::currentThread();
-    if (thread == globalDatabase->thread())
-        return globalDatabase->reference;
+    if (thread == database->thread())
+        return database->reference;
 
     // 该链接已经创建过则直接返回
-    QMutexLocker locker(&globalDatabase->mutex);
-    if (globalDatabase->copies.contains(thread))
-        return globalDatabase->copies[thread];
+    QMutexLocker locker(&database->mutex);
+    if (database->copies.contains(thread))
+        return database->copies[thread];
 
     // 新的线程则创建一个新的数据库链接
-    QObject::connect(thread, SIGNAL(finished()), globalDatabase, SLOT(threadFinished()));
-    QSqlDatabase db = QSqlDatabase::cloneDatabase(globalDatabase->reference, QLatin1String(connectionPrefix) + QString::number(globalDatabase->connectionId++));
+    QObject::connect(thread, SIGNAL(finished()), database, SLOT(threadFinished()));
+    QSqlDatabase db = QSqlDatabase::cloneDatabase(database->reference, database->prefix + QString::number(database->connectionId++));
     if(db.open()){
         initDatabase(db);
         if(globalDebugEnabled){
-            qDebug() << "线程:" << QThread::currentThread() << "创建了一个新的数据库链接 " << globalDatabase->connectionId;
+            qDebug() << "线程:" << QThread::currentThread() << "创建了一个新的数据库链接 " << db.connectionName();
         }
     } else {
-        qWarning() << "线程:" << QThread::currentThread() << "创建了一个新的数据库链接失败 " << globalDatabase->connectionId;
+        qWarning() << "线程:" << QThread::currentThread() << "创建了一个新的数据库链接失败 " << db.connectionName();
     }
-    globalDatabase->copies.insert(thread, db);
+    database->copies.insert(thread, db);
     return db;
 }
 
+// 按别名和路由策略选择只读副本, 返回空表示使用主库
+static NOrmDatabase *selectReplica(const QString &alias)
+{
+    if (globalReplicas.isEmpty() || alias == QLatin1String("primary"))
+        return nullptr;
+
+    // 指定了副本的链接名
+    if (!alias.isEmpty()) {
+        foreach (NOrmDatabase *replica, globalReplicas) {
+            if (replica->reference.connectionName() == alias)
+                return replica;
+        }
+        qWarning("NOrm cannot find database '%s', using the primary", qPrintable(alias));
+        return nullptr;
+    }
+
+    // 事务中需要读到本事务的写入
+    if (NOrmDatabase::inTransaction())
+        return nullptr;
+
+    // 刚写入的数据可能还没有同步到副本
+    if (lastWriteTime.hasLocalData()
+            && QDateTime::currentMSecsSinceEpoch() - lastWriteTime.localData() < globalReplicaStickiness)
+        return nullptr;
+
+    const int start = int(uint(replicaCounter.fetchAndAddRelaxed(1)) % uint(globalReplicas.size()));
+    if (globalReplicaPolicy == NOrm::RoundRobin)
+        return globalReplicas.at(start);
+
+    // 负载相同时从轮询位置开始选, 避免总是落到第一个副本上
+    NOrmDatabase *best = nullptr;
+    for (int i = 0; i < globalReplicas.size(); ++i) {
+        NOrmDatabase *replica = globalReplicas.at((start + i) % globalReplicas.size());
+        if (!best || replica->load.load() < best->load.load())
+            best = replica;
+    }
+    return best;
+}
+
+QSqlDatabase NOrm::database()
+{
+    if (!globalDatabase)
+        return QSqlDatabase();
+    return threadDatabase(globalDatabase);
+}
+
 bool NOrm::setDatabase(QSqlDatabase database)
 {
     // 数据库确保打开
@@ -209,6 +627,7 @@ bool NOrm::setDatabase(QSqlDatabase database)
     if (globalDatabaseType == NOrmDatabase::UnknownDB) {
         qWarning() << "Unsupported database driver" << database.driverName();
     }
+    getDatabaseFeatures(database);
 
     if (!globalDatabase) {
         globalDatabase = new NOrmDatabase();
@@ -216,12 +635,133 @@ bool NOrm::setDatabase(QSqlDatabase database)
     }
 
     // 初始化数据库
-    bool ret = initDatabase(database);
+    bool ret = createDatabase(database) && initDatabase(database);
 
     globalDatabase->reference = database;
     return ret && ret_openDB;
 }
 
+bool NOrm::addReplica(QSqlDatabase database)
+{
+    if (!globalDatabase) {
+        qWarning("NOrm::addReplica requires a primary database to be set first");
+        return false;
+    }
+
+    // 数据库确保打开
+    if (!database.isOpen() && !database.open()) {
+        qWarning() << "Replica open error:" << database.lastError();
+        return false;
+    }
+
+    // 副本与主库共用同一套 SQL 方言
+    if (getDatabaseType(database) != globalDatabaseType) {
+        qWarning() << "Replica driver" << database.driverName() << "does not match the primary database";
+        return false;
+    }
+    initDatabase(database);
+
+    NOrmDatabase *replica = new NOrmDatabase();
+    replica->prefix = QLatin1String(connectionPrefix) + QLatin1String("replica")
+            + QString::number(globalReplicas.size()) + QLatin1Char('_');
+    replica->reference = database;
+    globalReplicas << replica;
+    return true;
+}
+
+void NOrm::clearReplicas()
+{
+    qDeleteAll(globalReplicas);
+    globalReplicas.clear();
+}
+
+bool NOrm::addShard(QSqlDatabase database)
+{
+    if (!globalDatabase) {
+        qWarning("NOrm::addShard requires a primary database to be set first");
+        return false;
+    }
+
+    // 数据库确保打开
+    if (!database.isOpen() && !database.open()) {
+        qWarning() << "Shard open error:" << database.lastError();
+        return false;
+    }
+
+    // 分片与主库共用同一套 SQL 方言
+    if (getDatabaseType(database) != globalDatabaseType) {
+        qWarning() << "Shard driver" << database.driverName() << "does not match the primary database";
+        return false;
+    }
+    if (!createDatabase(database) || !initDatabase(database))
+        return false;
+
+    NOrmDatabase *shard = new NOrmDatabase();
+    shard->prefix = QLatin1String(connectionPrefix) + QLatin1String("shard")
+            + QString::number(globalShards.size()) + QLatin1Char('_');
+    shard->reference = database;
+    globalShards << shard;
+    return true;
+}
+
+void NOrm::clearShards()
+{
+    qDeleteAll(globalShards);
+    globalShards.clear();
+}
+
+NOrm::ReplicaPolicy NOrm::replicaPolicy()
+{
+    return globalReplicaPolicy;
+}
+
+void NOrm::setReplicaPolicy(ReplicaPolicy policy)
+{
+    globalReplicaPolicy = policy;
+}
+
+int NOrm::replicaStickiness()
+{
+    return globalReplicaStickiness;
+}
+
+void NOrm::setReplicaStickiness(int msecs)
+{
+    globalReplicaStickiness = qMax(0, msecs);
+}
+
+NOrmSqliteProfile NOrm::sqliteProfile()
+{
+    return globalSqliteProfile;
+}
+
+void NOrm::setSqliteProfile(const NOrmSqliteProfile &profile)
+{
+    globalSqliteProfile = profile;
+    if (globalDatabase && globalDatabase->reference.isOpen())
+        initDatabase(globalDatabase->reference);
+}
+
+int NOrm::largeInThreshold()
+{
+    return globalLargeInThreshold;
+}
+
+void NOrm::setLargeInThreshold(int count)
+{
+    globalLargeInThreshold = qMax(0, count);
+}
+
+qint64 NOrm::countEstimateThreshold()
+{
+    return globalCountEstimateThreshold;
+}
+
+void NOrm::setCountEstimateThreshold(qint64 rows)
+{
+    globalCountEstimateThreshold = qMax<qint64>(0, rows);
+}
+
 bool NOrm::isDebugEnabled()
 {
     return globalDebugEnabled;
@@ -232,6 +772,58 @@ void NOrm::setDebugEnabled(bool enabled)
     globalDebugEnabled = enabled;
 }
 
+NOrmSlowQueryLog NOrm::slowQueryLog()
+{
+    return globalSlowQueryLog;
+}
+
+void NOrm::setSlowQueryLog(const NOrmSlowQueryLog &log)
+{
+    globalSlowQueryLog = log;
+}
+
+NOrmRetryPolicy NOrm::retryPolicy()
+{
+    return globalRetryPolicy;
+}
+
+void NOrm::setRetryPolicy(const NOrmRetryPolicy &policy)
+{
+    globalRetryPolicy = policy;
+}
+
+int NOrm::retryCount()
+{
+    return globalRetryCount.load();
+}
+
+bool NOrm::transaction(const std::function<bool()> &work)
+{
+    // 嵌套时并入外层事务
+    if (NOrmDatabase::inTransaction())
+        return work();
+
+    QSqlDatabase db = NOrm::database();
+    for (int attempt = 1; ; ++attempt) {
+        if (!db.transaction())
+            return false;
+
+        lastQueryError.setLocalData(QSqlError());
+        NOrmDatabase::enterTransaction();
+        const bool ok = work();
+        NOrmDatabase::leaveTransaction();
+        if (ok && db.commit())
+            return true;
+
+        // 提交失败时取提交的错误, 否则取事务中最后一次失败的语句
+        const QSqlError error = ok ? db.lastError() : lastQueryError.localData();
+        db.rollback();
+        if (attempt >= globalRetryPolicy.maxAttempts || !globalRetryPolicy.isTransactionRetryable(error))
+            return false;
+        waitForRetry(attempt, error);
+    }
+}
+
 static void norm_topsort(const QByteArray &modelName,
                          QHash<QByteArray, bool> &visited,
                          QStack<NOrmMetaModel> &stack)
@@ -288,6 +880,16 @@ bool NOrm::dropTables()
     return result;
 }
 
+bool NOrm::migrateStringLists()
+{
+    bool result = true;
+    foreach (const NOrmMetaModel &model, norm_sorted_metamodels()) {
+        if (!model.migrateStringLists())
+            result = false;
+    }
+    return result;
+}
+
 NOrmMetaModel NOrm::metaModel(const char *name)
 {
     if (globalMetaModels.contains(name))
@@ -320,3 +922,134 @@ NOrmDatabase::DatabaseType NOrmDatabase::databaseType(const QSqlDatabase &db)
     Q_UNUSED(db);
     return globalDatabaseType;
 }
+
+bool NOrmDatabase::hasInsertReturning(const QSqlDatabase &db)
+{
+    Q_UNUSED(db);
+    return globalInsertReturning;
+}
+
+int NOrmDatabase::insertIdStep(const QSqlDatabase &db)
+{
+    Q_UNUSED(db);
+    return globalInsertIdStep;
+}
+
+bool NOrmDatabase::hasWindowFunctions(const QSqlDatabase &db)
+{
+    Q_UNUSED(db);
+    return globalWindowFunctions;
+}
+
+bool NOrmDatabase::hasJsonArrays(const QSqlDatabase &db)
+{
+    Q_UNUSED(db);
+    return globalJsonArrays;
+}
+
+int NOrmDatabase::maxBindValues(const QSqlDatabase &db)
+{
+    switch (databaseType(db)) {
+    case SQLite:
+        // SQLITE_MAX_VARIABLE_NUMBER 在 3.32 之前默认为 999
+        return 999;
+    case MSSqlServer:
+        return 2100;
+    default:
+        return 65535;
+    }
+}
+
+bool NOrmDatabase::inTransaction()
+{
+    return transactionDepth.localData() > 0;
+}
+
+void NOrmDatabase::enterTransaction()
+{
+    ++transactionDepth.localData();
+}
+
+void NOrmDatabase::leaveTransaction()
+{
+    --transactionDepth.localData();
+}
+
+bool NOrmDatabase::isInMemory(const QSqlDatabase &db)
+{
+    const QString name = db.databaseName();
+    return databaseType(db) == SQLite
+            && (name.isEmpty() || name == QLatin1String(":memory:") || name.contains(QLatin1String("mode=memory")));
+}
+
+bool NOrmDatabase::inTransaction(const QSqlDatabase &db)
+{
+    if (inTransaction())
+        return true;
+
+    // QSqlDatabase::transaction() 开启的事务只能向数据库查询
+    QSqlQuery query(db);
+    switch (databaseType(db)) {
+    case SQLite:
+        // 事务中不能再次 BEGIN
+        if (!query.exec(QLatin1String("BEGIN")))
+            return true;
+        query.exec(QLatin1String("ROLLBACK"));
+        return false;
+    case MySqlServer:
+        // mysql 5.7 / mariadb 10.3 以上
+        return !query.exec(QLatin1String("SELECT @@in_transaction")) || !query.next() || query.value(0).toInt() != 0;
+    case PostgreSQL:
+        // 自动提交时每条语句是一个事务; 事务中出错后查询也会失败
+        return !query.exec(QLatin1String("SELECT now() = statement_timestamp()")) || !query.next() || !query.value(0).toBool();
+    case MSSqlServer:
+        return !query.exec(QLatin1String("SELECT @@TRANCOUNT")) || !query.next() || query.value(0).toInt() != 0;
+    case Oracle:
+        return !query.exec(QLatin1String("SELECT DBMS_TRANSACTION.LOCAL_TRANSACTION_ID FROM DUAL")) || !query.next() || !query.value(0).isNull();
+    default:
+        // 无法确定时按在事务中处理
+        return true;
+    }
+}
+
+int NOrmDatabase::shardCount()
+{
+    return globalShards.size();
+}
+
+QSqlDatabase NOrmDatabase::shardDatabase(int index)
+{
+    if (index < 0 || index >= globalShards.size())
+        return QSqlDatabase();
+    return threadDatabase(globalShards.at(index));
+}
+
+void NOrmDatabase::markWrite()
+{
+    if (!globalReplicas.isEmpty())
+        lastWriteTime.setLocalData(QDateTime::currentMSecsSinceEpoch());
+}
+
+NOrmReadDatabase::NOrmReadDatabase(const QString &alias, int shard)
+    : m_replica(shard < 0 ? selectReplica(alias) : nullptr)
+{
+    if (shard >= 0) {
+        m_database = NOrmDatabase::shardDatabase(shard);
+    } else if (m_replica) {
+        m_replica->load.ref();
+        m_database = threadDatabase(m_replica);
+    } else {
+        m_database = NOrm::database();
+    }
+}
+
+NOrmReadDatabase::~NOrmReadDatabase()
+{
+    if (m_replica)
+        m_replica->load.deref();
+}
+
+QSqlDatabase NOrmReadDatabase::database() const
+{
+    return m_database;
+}
@@ -0,0 +1,202 @@
+#include <cstdlib>
+#include <QDebug>
+#include <QHash>
+#include <QMutex>
+#include <QThreadStorage>
+#include "NOrmDiagnosticsScope.h"
+#include "NOrmProfiler.h"
+
+#if (defined(Q_OS_LINUX) && defined(__GLIBC__)) || defined(Q_OS_MAC)
+#include <execinfo.h>
+#define NORM_HAVE_BACKTRACE
+#endif
+
+// 调用栈的最大深度
+static const int maxBacktraceFrames = 32;
+
+// 是否自动创建作用域
+static QAtomicInt diagnosticsEnabled;
+
+// 默认阈值
+static QAtomicInt diagnosticsThreshold(10);
+
+// 检测到问题时是否终止
+static QAtomicInt diagnosticsFail;
+
+// 报告回调
+static QMutex handlerMutex;
+static std::function<void(const NOrmDiagnostic &)> diagnosticsHandler;
+
+// 所有线程中存在的作用域个数, 为 0 时执行语句不做任何统计
+static QAtomicInt activeScopes;
+
+// 作用域私有类
+class NOrmDiagnosticsScopePrivate
+{
+public:
+    QString name;
+    int threshold;
+    QHash<QString, int> counts;
+    QList<NOrmDiagnostic> issues;
+};
+
+// 当前线程的作用域(由外到内)
+static QThreadStorage<QList<NOrmDiagnosticsScopePrivate*> > threadScopes;
+
+// 当前线程正在延迟加载的模型和外键
+static QThreadStorage<QStringList> threadLazyLoad;
+
+// 当前线程正在逐行执行的批量操作层数
+static QThreadStorage<int> threadBatchDepth;
+
+static QStringList captureBacktrace()
+{
+    QStringList frames;
+#ifdef NORM_HAVE_BACKTRACE
+    void *addresses[maxBacktraceFrames];
+    const int count = backtrace(addresses, maxBacktraceFrames);
+    char **symbols = backtrace_symbols(addresses, count);
+    if (symbols) {
+        // 跳过检测器自身的栈帧
+        for (int i = 2; i < count; ++i)
+            frames << QString::fromLocal8Bit(symbols[i]);
+        free(symbols);
+    }
+#endif
+    return frames;
+}
+
+NOrmDiagnostic::NOrmDiagnostic()
+    : count(0)
+{
+}
+
+QString NOrmDiagnostic::toString() const
+{
+    QString text = QString::fromLatin1("N+1 query detected in scope '%1': %2 executions of \"%3\"")
+            .arg(scope, QString::number(count), sql);
+    if (!model.isEmpty())
+        text += QString::fromLatin1(" (lazy load of %1.%2)").arg(model, foreignKey);
+    if (!backtrace.isEmpty())
+        text += QLatin1String("\n    ") + backtrace.join(QLatin1String("\n    "));
+    return text;
+}
+
+NOrmDiagnosticsScope::NOrmDiagnosticsScope(const QString &name, int threshold)
+    : d(new NOrmDiagnosticsScopePrivate)
+{
+    d->name = name;
+    d->threshold = threshold > 0 ? threshold : defaultThreshold();
+    threadScopes.localData() << d;
+    activeScopes.ref();
+}
+
+NOrmDiagnosticsScope::~NOrmDiagnosticsScope()
+{
+    threadScopes.localData().removeOne(d);
+    activeScopes.deref();
+    delete d;
+}
+
+QList<NOrmDiagnostic> NOrmDiagnosticsScope::issues() const
+{
+    return d->issues;
+}
+
+bool NOrmDiagnosticsScope::isEnabled()
+{
+    return diagnosticsEnabled.load();
+}
+
+void NOrmDiagnosticsScope::setEnabled(bool enabled)
+{
+    diagnosticsEnabled.store(enabled);
+}
+
+int NOrmDiagnosticsScope::defaultThreshold()
+{
+    return diagnosticsThreshold.load();
+}
+
+void NOrmDiagnosticsScope::setDefaultThreshold(int threshold)
+{
+    diagnosticsThreshold.store(qMax(2, threshold));
+}
+
+bool NOrmDiagnosticsScope::failOnIssue()
+{
+    return diagnosticsFail.load();
+}
+
+void NOrmDiagnosticsScope::setFailOnIssue(bool fail)
+{
+    diagnosticsFail.store(fail);
+}
+
+void NOrmDiagnosticsScope::setHandler(const std::function<void(const NOrmDiagnostic &)> &handler)
+{
+    QMutexLocker locker(&handlerMutex);
+    diagnosticsHandler = handler;
+}
+
+void NOrmDiagnosticsScope::recordQuery(const QString &sql)
+{
+    if (!activeScopes.load() || !threadScopes.hasLocalData() || threadScopes.localData().isEmpty())
+        return;
+    if (threadBatchDepth.hasLocalData() && threadBatchDepth.localData() > 0)
+        return;
+
+    const QString shape = NOrmProfiler::normalize(sql);
+    foreach (NOrmDiagnosticsScopePrivate *scope, threadScopes.localData()) {
+        // 每种语句在每个作用域中只报告一次
+        const int count = ++scope->counts[shape];
+        if (count != scope->threshold)
+            continue;
+
+        NOrmDiagnostic issue;
+        issue.scope = scope->name;
+        issue.sql = shape;
+        issue.count = count;
+        if (threadLazyLoad.hasLocalData() && threadLazyLoad.localData().size() == 2) {
+            issue.model = threadLazyLoad.localData().at(0);
+            issue.foreignKey = threadLazyLoad.localData().at(1);
+        }
+        issue.backtrace = captureBacktrace();
+        scope->issues << issue;
+
+        std::function<void(const NOrmDiagnostic &)> handler;
+        {
+            QMutexLocker locker(&handlerMutex);
+            handler = diagnosticsHandler;
+        }
+        if (handler)
+            handler(issue);
+        else
+            qWarning().noquote() << issue.toString();
+        if (failOnIssue())
+            qFatal("%s", qPrintable(issue.toString()));
+    }
+}
+
+void NOrmDiagnosticsScope::beginLazyLoad(const QString &model, const QString &foreignKey)
+{
+    if (activeScopes.load())
+        threadLazyLoad.setLocalData(QStringList() << model << foreignKey);
+}
+
+void NOrmDiagnosticsScope::endLazyLoad()
+{
+    if (threadLazyLoad.hasLocalData())
+        threadLazyLoad.localData().clear();
+}
+
+void NOrmDiagnosticsScope::beginBatch()
+{
+    ++threadBatchDepth.localData();
+}
+
+void NOrmDiagnosticsScope::endBatch()
+{
+    if (threadBatchDepth.hasLocalData() && threadBatchDepth.localData() > 0)
+        --threadBatchDepth.localData();
+}
@@ -0,0 +1,12 @@
+#include "NOrmImportOptions.h"
+
+NOrmImportOptions::NOrmImportOptions()
+    : batchSize(500)
+    , transactionSize(10000)
+    , parserThreads(0)
+    , upsert(false)
+    , deferForeignKeys(true)
+    , disableForeignKeyChecks(false)
+    , skipInvalidRows(false)
+{
+}
@@ -1,4 +1,6 @@
 #include <QDebug>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QMetaProperty>
 #include <QSqlDriver>
 #include <QStringList>
@@ -21,6 +23,17 @@ static long string_hash(const QString &s)
     return (x == -1) ? -2 : x;
 }
 
+// FNV-1a, 分片位置需要在不同进程和平台间保持一致
+static quint32 stable_hash(const QByteArray &a)
+{
+    quint32 x = 2166136261u;
+    for (int i = 0; i < a.size(); ++i) {
+        x ^= quint8(a.at(i));
+        x *= 16777619u;
+    }
+    return x;
+}
+
 static long stringlist_hash(const QStringList &l)
 {
     long x = 0x345678L;
@@ -84,8 +97,17 @@ public:
     // 是否是空
     bool blank;
 
+    // 是否是版本字段
+    bool version;
+
     // 是否含有删除约束
     ForeignKeyConstraint deleteConstraint;
+
+    // JSON 字段按路径建立的索引(路径[:类型])
+    QStringList jsonIndexes;
+
+    // 是否不区分大小写
+    bool caseInsensitive;
 };
 
 NOrmMetaFieldPrivate::NOrmMetaFieldPrivate()
@@ -95,7 +117,9 @@ NOrmMetaFieldPrivate::NOrmMetaFieldPrivate()
     , null(false)
     , unique(false)
     , blank(false)
+    , version(false)
     , deleteConstraint(NoAction)
+    , caseInsensitive(false)
 {
 }
 
@@ -139,16 +163,31 @@ bool NOrmMetaField::isAutoIncrement() const
     return d->autoIncrement;
 }
 
+bool NOrmMetaField::isCaseInsensitive() const
+{
+    return d->caseInsensitive;
+}
+
 bool NOrmMetaField::isUnique() const
 {
     return d->unique;
 }
 
+bool NOrmMetaField::isJson() const
+{
+    return NOrmJsonCodec::isJsonType(d->type);
+}
+
 bool NOrmMetaField::isBlank() const
 {
     return d->blank;
 }
 
+bool NOrmMetaField::isVersion() const
+{
+    return d->version;
+}
+
 QString NOrmMetaField::name() const
 {
     return QString::fromLatin1(d->name);
@@ -159,6 +198,243 @@ int NOrmMetaField::maxLength() const
     return d->maxLength;
 }
 
+QVariant::Type NOrmMetaField::type() const
+{
+    return d->type;
+}
+
+QString NOrmStringListCodec::encode(const QStringList &items)
+{
+    QString out;
+    out.reserve(2 + items.size() * 8);
+    out += QLatin1Char('[');
+    for (int i = 0; i < items.size(); ++i) {
+        if (i)
+            out += QLatin1Char(',');
+        encodeString(out, items.at(i));
+    }
+    out += QLatin1Char(']');
+    return out;
+}
+
+void NOrmStringListCodec::encodeString(QString &out, const QString &item)
+{
+    const QChar *data = item.constData();
+    const int size = item.size();
+    int start = 0;
+    out += QLatin1Char('"');
+    for (int i = 0; i < size; ++i) {
+        const ushort c = data[i].unicode();
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        // 只转义必须转义的字符, 其余整段复制
+        out.append(data + start, i - start);
+        start = i + 1;
+        switch (c) {
+        case '"':
+            out += QLatin1String("\\\"");
+            break;
+        case '\\':
+            out += QLatin1String("\\\\");
+            break;
+        case '\n':
+            out += QLatin1String("\\n");
+            break;
+        case '\r':
+            out += QLatin1String("\\r");
+            break;
+        case '\t':
+            out += QLatin1String("\\t");
+            break;
+        default:
+            out += QString::fromLatin1("\\u%1").arg(c, 4, 16, QLatin1Char('0'));
+            break;
+        }
+    }
+    out.append(data + start, size - start);
+    out += QLatin1Char('"');
+}
+
+QStringList NOrmStringListCodec::decode(const QString &text)
+{
+    const QChar *data = text.constData();
+    const int size = text.size();
+    int i = 0;
+    while (i < size && data[i].isSpace())
+        ++i;
+    if (i >= size)
+        return QStringList();
+
+    // 早期版本以逗号连接
+    if (data[i] != QLatin1Char('['))
+        return text.split(QLatin1Char(','));
+
+    QStringList items;
+    bool valid = false;
+    ++i;
+    forever {
+        while (i < size && data[i].isSpace())
+            ++i;
+        if (i >= size)
+            break;
+        if (data[i] == QLatin1Char(']') && items.isEmpty()) {
+            valid = true;
+            break;
+        }
+        if (data[i] != QLatin1Char('"'))
+            break;
+
+        // 没有转义字符的部分整段复制
+        QString item;
+        int start = ++i;
+        while (i < size && data[i] != QLatin1Char('"')) {
+            if (data[i] != QLatin1Char('\\')) {
+                ++i;
+                continue;
+            }
+            item.append(data + start, i - start);
+            if (++i >= size)
+                break;
+            switch (data[i].unicode()) {
+            case 'b':
+                item += QLatin1Char('\b');
+                break;
+            case 'f':
+                item += QLatin1Char('\f');
+                break;
+            case 'n':
+                item += QLatin1Char('\n');
+                break;
+            case 'r':
+                item += QLatin1Char('\r');
+                break;
+            case 't':
+                item += QLatin1Char('\t');
+                break;
+            case 'u': {
+                bool ok = false;
+                const ushort code = text.midRef(i + 1, 4).toUShort(&ok, 16);
+                if (!ok)
+                    return text.split(QLatin1Char(','));
+                item += QChar(code);
+                i += 4;
+                break;
+            }
+            default:
+                item += data[i];
+                break;
+            }
+            start = ++i;
+        }
+        if (i >= size)
+            break;
+        item.append(data + start, i - start);
+        items << item;
+        ++i;
+
+        while (i < size && data[i].isSpace())
+            ++i;
+        if (i < size && data[i] == QLatin1Char(',')) {
+            ++i;
+        } else {
+            valid = (i < size && data[i] == QLatin1Char(']'));
+            break;
+        }
+    }
+    return valid ? items : text.split(QLatin1Char(','));
+}
+
+bool NOrmJsonCodec::isJsonType(int type)
+{
+    return type == QMetaType::QVariantMap || type == QMetaType::QJsonObject;
+}
+
+QString NOrmJsonCodec::encode(const QVariant &value)
+{
+    QJsonObject object;
+    if (value.userType() == QMetaType::QJsonObject)
+        object = value.toJsonObject();
+    else if (value.type() == QVariant::String || value.type() == QVariant::ByteArray)
+        object = QJsonDocument::fromJson(value.toByteArray()).object();
+    else
+        object = QJsonObject::fromVariantMap(value.toMap());
+    return QString::fromUtf8(QJsonDocument(object).toJson(QJsonDocument::Compact));
+}
+
+QVariant NOrmJsonCodec::decode(const QVariant &value, int type)
+{
+    if (value.isNull())
+        return QVariant();
+
+    const QJsonObject object = QJsonDocument::fromJson(value.toByteArray()).object();
+    if (type == QMetaType::QJsonObject)
+        return object;
+    return object.toVariantMap();
+}
+
+bool NOrmJsonCodec::isValidPath(const QStringList &path)
+{
+    // 路径直接写入语句, 只允许标识符和数组下标
+    if (path.isEmpty())
+        return false;
+    foreach (const QString &bit, path) {
+        if (bit.isEmpty())
+            return false;
+        foreach (const QChar &c, bit) {
+            if (c.unicode() > 127 || (!c.isLetterOrNumber() && c != QLatin1Char('_')))
+                return false;
+        }
+    }
+    return true;
+}
+
+QString NOrmJsonCodec::pathExpression(NOrmDatabase::DatabaseType databaseType, const QString &column,
+                                      const QStringList &path, const QString &cast)
+{
+    // $.a.b[0] 形式的路径
+    QString jsonPath = QLatin1String("$");
+    foreach (const QString &bit, path) {
+        bool index = false;
+        bit.toUInt(&index);
+        jsonPath += index ? QLatin1Char('[') + bit + QLatin1Char(']') : QLatin1Char('.') + bit;
+    }
+
+    switch (databaseType) {
+    case NOrmDatabase::SQLite:
+        // json_extract 返回数字和布尔值本身, 不需要类型转换
+        return QString::fromLatin1("json_extract(%1, '%2')").arg(column, jsonPath);
+    case NOrmDatabase::MySqlServer:
+        return QString::fromLatin1("JSON_UNQUOTE(JSON_EXTRACT(%1, '%2'))").arg(column, jsonPath);
+    case NOrmDatabase::PostgreSQL: {
+        const QString text = QString::fromLatin1("(%1 #>> '{%2}')").arg(column, path.join(QLatin1Char(',')));
+        return cast.isEmpty() ? text : QString::fromLatin1("(%1::%2)").arg(text, cast);
+    }
+    default:
+        return QString::fromLatin1("JSON_VALUE(%1, '%2')").arg(column, jsonPath);
+    }
+}
+
+QString NOrmJsonCodec::pathCast(const QVariant &value)
+{
+    switch (value.type()) {
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+    case QVariant::ULongLong:
+    case QVariant::Double:
+        return QLatin1String("numeric");
+    case QVariant::Bool:
+        return QLatin1String("boolean");
+    case QVariant::List: {
+        const QVariantList values = value.toList();
+        return values.isEmpty() ? QString() : pathCast(values.first());
+    }
+    default:
+        return QString();
+    }
+}
+
 QVariant NOrmMetaField::toDatabase(const QVariant &value) const
 {
     if (d->type == QVariant::String && !d->null && value.isNull()){
@@ -166,17 +442,13 @@ QVariant NOrmMetaField::toDatabase(const QVariant &value) const
     } else if (!d->foreignModel.isEmpty() && d->type == QVariant::Int && d->null && !value.toInt()) {
         return QVariant();
     } else if (d->type == QVariant::StringList) {
-        QStringList tmpStr = value.value<QStringList>();
-        QString arrary_data;
-        foreach (QString item, tmpStr) {
-            arrary_data += QObject::tr("%1,").arg(item);
-        }
-        arrary_data = arrary_data.left(arrary_data.length()-1);
-        if(arrary_data.isNull()){
-            arrary_data = "";
-        }
-        QVariant tmpValue(arrary_data);
-        return tmpValue;
+        if (d->null && value.isNull())
+            return QVariant();
+        return NOrmStringListCodec::encode(value.toStringList());
+    } else if (isJson()) {
+        if (d->null && value.isNull())
+            return QVariant();
+        return NOrmJsonCodec::encode(value);
     } else {
         return value;
     }
@@ -223,6 +495,21 @@ public:
 
     // 唯一性字段
     QList<QByteArray> uniqueTogether;
+
+    // 版本字段
+    QByteArray versionField;
+
+    // 分片键
+    QByteArray shardKey;
+
+    // 按范围分片时各分片的下边界(第一个分片之后), 为空时按哈希分片
+    QStringList shardRanges;
+
+    // 全文检索的字段
+    QList<QByteArray> searchFields;
+
+    // 全文检索的分词配置(postgresql)
+    QString searchConfig;
 };
 
 NOrmMetaModel::NOrmMetaModel(const QMetaObject *meta) : d(new NOrmMetaModelPrivate)
@@ -247,6 +534,14 @@ NOrmMetaModel::NOrmMetaModel(const QMetaObject *meta) : d(new NOrmMetaModelPriva
                 d->table = option.value();
             } else if (option.key() == QLatin1String("unique_together")) {
                 d->uniqueTogether = option.value().toLatin1().split(',');
+            } else if (option.key() == QLatin1String("shard_key")) {
+                d->shardKey = option.value().toLatin1();
+            } else if (option.key() == QLatin1String("shard_ranges")) {
+                d->shardRanges = option.value().split(QLatin1Char(','), QString::SkipEmptyParts);
+            } else if (option.key() == QLatin1String("search")) {
+                d->searchFields = option.value().toLatin1().split(',');
+            } else if (option.key() == QLatin1String("search_config")) {
+                d->searchConfig = option.value();
             }
         }
     }
@@ -269,6 +564,9 @@ NOrmMetaModel::NOrmMetaModel(const QMetaObject *meta) : d(new NOrmMetaModelPriva
         bool nullOption = false;
         bool uniqueOption = false;
         bool blankOption = false;
+        bool versionOption = false;
+        bool ciOption = false;
+        QStringList jsonIndexOption;
         ForeignKeyConstraint deleteConstraint = NoAction;
         const int infoIndex = meta->indexOfClassInfo(meta->property(i).name());
         if (infoIndex >= 0)
@@ -298,6 +596,12 @@ NOrmMetaModel::NOrmMetaModel(const QMetaObject *meta) : d(new NOrmMetaModelPriva
                     uniqueOption = stringToBool(value);
                 } else if (key == QLatin1String("blank")) {
                     blankOption = stringToBool(value);
+                } else if (key == QLatin1String("version")) {
+                    versionOption = stringToBool(value);
+                } else if (key == QLatin1String("ci")) {
+                    ciOption = stringToBool(value);
+                } else if (key == QLatin1String("json_index")) {
+                    jsonIndexOption = value.split(QLatin1Char(','), QString::SkipEmptyParts);
                 } else if (option.key() == "on_delete") {
                     if (value.toLower() == "cascade") {
                         deleteConstraint = Cascade;
@@ -350,6 +654,30 @@ NOrmMetaModel::NOrmMetaModel(const QMetaObject *meta) : d(new NOrmMetaModelPriva
             field.d->index = true;
         }
 
+        // 只有字符串字段可以不区分大小写
+        if (ciOption) {
+            if (field.d->type == QVariant::String)
+                field.d->caseInsensitive = true;
+            else
+                qWarning() << "Case-insensitive field" << field.d->name << "must be a string";
+        }
+        // 路径索引只能建在 JSON 字段上
+        if (!jsonIndexOption.isEmpty()) {
+            if (field.isJson())
+                field.d->jsonIndexes = jsonIndexOption;
+            else
+                qWarning() << "JSON index on" << field.d->name << "which is not a JSON field";
+        }
+        // 版本字段只能是整型
+        if (versionOption) {
+            if (field.d->type == QVariant::Int || field.d->type == QVariant::LongLong) {
+                field.d->version = true;
+                d->versionField = field.d->name;
+            } else {
+                qWarning() << "Version field" << field.d->name << "must be an integer";
+            }
+        }
+
         d->localFields << field;
     }
 
@@ -365,6 +693,31 @@ NOrmMetaModel::NOrmMetaModel(const QMetaObject *meta) : d(new NOrmMetaModelPriva
         d->primaryKey = field.d->name;
     }
 
+    // 分片键必须是本表字段
+    if (d->shardKey == "pk")
+        d->shardKey = d->primaryKey;
+    if (!d->shardKey.isEmpty() && !localField(d->shardKey).isValid()) {
+        qWarning() << "Shard key" << d->shardKey << "is not a field of" << d->className;
+        d->shardKey.clear();
+    }
+    // 自增主键在每个分片上各自从 1 开始, 主键无法唯一确定一行
+    if (!d->shardKey.isEmpty() && localField("pk").d->autoIncrement) {
+        qWarning() << "Sharded model" << d->className << "cannot have an auto_increment primary key";
+        d->shardKey.clear();
+    }
+    // 全文检索的字段必须是本表的字符串字段
+    foreach (const QByteArray &name, d->searchFields) {
+        if (localField(name).type() != QVariant::String) {
+            qWarning() << "Search field" << name << "is not a string field of" << d->className;
+            d->searchFields.removeAll(name);
+        }
+    }
+    // 分词配置直接写入语句
+    if (!QRegExp(QLatin1String("[a-z_]+")).exactMatch(d->searchConfig)) {
+        if (!d->searchConfig.isEmpty())
+            qWarning() << "Invalid search configuration" << d->searchConfig << "for" << d->className;
+        d->searchConfig = QLatin1String("simple");
+    }
 }
 
 NOrmMetaModel::NOrmMetaModel(const NOrmMetaModel &other) : d(other.d)
@@ -393,10 +746,22 @@ NOrmMetaModel& NOrmMetaModel::operator=(const NOrmMetaModel& other)
 
 bool NOrmMetaModel::createTable() const
 {
-    NOrmQuery createQuery(NOrm::database());
-    foreach (const QString &sql, createTableSql()) {
-        if (!createQuery.exec(sql))
-            return false;
+    // 分片的模型在每个分片上建表
+    QList<QSqlDatabase> databases;
+    if (isSharded()) {
+        for (int i = 0; i < NOrmDatabase::shardCount(); ++i)
+            databases << NOrmDatabase::shardDatabase(i);
+    } else {
+        databases << NOrm::database();
+    }
+
+    const QStringList queries = createTableSql();
+    foreach (const QSqlDatabase &db, databases) {
+        NOrmQuery createQuery(db);
+        foreach (const QString &sql, queries) {
+            if (!createQuery.exec(sql))
+                return false;
+        }
     }
     return true;
 }
@@ -415,7 +780,7 @@ QStringList NOrmMetaModel::createTableSql() const
     {
         QString fieldSql = driver->escapeIdentifier(field.column(), QSqlDriver::FieldName);
         fieldSql += " ";
-        switch (field.d->type) {
+        switch (int(field.d->type)) {
         case QVariant::Bool:
             fieldSql += getBoolType(databaseType);
             break;
@@ -439,6 +804,8 @@ QStringList NOrmMetaModel::createTableSql() const
             break;
         case QVariant::String:
             fieldSql += getStringType(databaseType, field.d->maxLength);
+            if (field.d->caseInsensitive)
+                fieldSql += attributeCaseInsensitive(databaseType);
             break;
         case QVariant::Time:
             fieldSql += getTimeType(databaseType);
@@ -446,6 +813,10 @@ QStringList NOrmMetaModel::createTableSql() const
         case QVariant::StringList:
             fieldSql += getStringListType(databaseType, field.d->maxLength);
             break;
+        case QMetaType::QVariantMap:
+        case QMetaType::QJsonObject:
+            fieldSql += getJsonType(databaseType);
+            break;
         default:
             qWarning() << "Unhandled type" << field.d->type << "for property" << field.d->name;
             continue;
@@ -541,6 +912,41 @@ QStringList NOrmMetaModel::createTableSql() const
         propSql << fieldSql;
     }
 
+    // JSON 字段按路径建立的索引, 索引表达式与过滤条件编译出的表达式相同;
+    // mysql 和 sqlserver 不能直接索引表达式, 为其建立计算列, 过滤条件的表达式与计算列相同时会使用计算列的索引
+    QStringList jsonIndexSql;
+    foreach (const NOrmMetaField &field, d->localFields) {
+        foreach (const QString &spec, field.d->jsonIndexes) {
+            const QStringList path = spec.section(QLatin1Char(':'), 0, 0).split(QLatin1String("__"));
+            const QString cast = spec.section(QLatin1Char(':'), 1);
+            if (!NOrmJsonCodec::isValidPath(path) || (!cast.isEmpty() && cast != QLatin1String("numeric") && cast != QLatin1String("boolean"))) {
+                qWarning() << "Invalid JSON index" << spec << "for property" << field.d->name;
+                continue;
+            }
+
+            const QString expression = NOrmJsonCodec::pathExpression(databaseType,
+                        driver->escapeIdentifier(field.column(), QSqlDriver::FieldName), path, cast);
+            QString indexed = expression;
+            if (databaseType == NOrmDatabase::MySqlServer || databaseType == NOrmDatabase::MSSqlServer) {
+                indexed = driver->escapeIdentifier(field.column() + QLatin1String("__") + path.join(QLatin1String("__")), QSqlDriver::FieldName);
+                if (databaseType == NOrmDatabase::MySqlServer)
+                    propSql << QString::fromLatin1("%1 varchar(255) AS (%2) VIRTUAL").arg(indexed, expression);
+                else
+                    propSql << QString::fromLatin1("%1 AS %2").arg(indexed, expression);
+            } else if (databaseType != NOrmDatabase::SQLite && databaseType != NOrmDatabase::PostgreSQL) {
+                qWarning() << "JSON index" << spec << "is not supported by this database";
+                continue;
+            }
+
+            const QString indexName = d->table + QLatin1Char('_')
+                    + stringlist_digest(QStringList() << field.column() << spec);
+            jsonIndexSql << QString::fromLatin1("CREATE INDEX %1 ON %2 (%3)").arg(
+                                driver->escapeIdentifier(indexName, QSqlDriver::FieldName),
+                                quotedTable,
+                                indexed);
+        }
+    }
+
     // add constraints if we need them
     if (!constraintSql.isEmpty())
         propSql << constraintSql.join(QLatin1String(", "));
@@ -571,19 +977,184 @@ QStringList NOrmMetaModel::createTableSql() const
                            driver->escapeIdentifier(field.column(), QSqlDriver::FieldName));
         }
     }
+    queries << jsonIndexSql;
+
+    // postgresql 的不区分大小写字段按 lower() 建立表达式索引, 与过滤条件编译出的表达式相同
+    if (databaseType == NOrmDatabase::PostgreSQL) {
+        foreach (const NOrmMetaField &field, d->localFields) {
+            if (!field.d->caseInsensitive)
+                continue;
+            const QString indexName = d->table + QLatin1Char('_')
+                    + stringlist_digest(QStringList() << QLatin1String("lower") << field.column());
+            queries << QString::fromLatin1("CREATE %1INDEX %2 ON %3 ((lower(%4) COLLATE \"C\"))").arg(
+                           QLatin1String(field.d->unique ? "UNIQUE " : ""),
+                           driver->escapeIdentifier(indexName, QSqlDriver::FieldName),
+                           quotedTable,
+                           driver->escapeIdentifier(field.column(), QSqlDriver::FieldName));
+        }
+    }
+
+    // 全文检索
+    if (!d->searchFields.isEmpty()) {
+        QStringList columns;
+        foreach (const QByteArray &name, d->searchFields)
+            columns << driver->escapeIdentifier(localField(name).column(), QSqlDriver::FieldName);
+        const QString indexName = driver->escapeIdentifier(d->table + QLatin1Char('_')
+                    + stringlist_digest(QStringList() << QLatin1String("search") << columns), QSqlDriver::FieldName);
+
+        switch (databaseType) {
+        case NOrmDatabase::SQLite: {
+            // 外部内容的 FTS5 表, 由触发器与数据表保持同步
+            const NOrmMetaField primaryKey = localField("pk");
+            if (primaryKey.type() != QVariant::Int && primaryKey.type() != QVariant::LongLong) {
+                qWarning() << "Full-text search on" << d->className << "requires an integer primary key";
+                break;
+            }
+            const QString ftsTable = driver->escapeIdentifier(d->table + QLatin1String("_fts"), QSqlDriver::TableName);
+            const QString pk = driver->escapeIdentifier(primaryKey.column(), QSqlDriver::FieldName);
+            const QString ftsColumns = columns.join(QLatin1String(", "));
+            QStringList newValues;
+            QStringList oldValues;
+            foreach (const QString &column, columns) {
+                newValues << QLatin1String("new.") + column;
+                oldValues << QLatin1String("old.") + column;
+            }
+            const QString insertNew = QString::fromLatin1("INSERT INTO %1 (rowid, %2) VALUES (new.%3, %4);").arg(
+                        ftsTable, ftsColumns, pk, newValues.join(QLatin1String(", ")));
+            const QString deleteOld = QString::fromLatin1("INSERT INTO %1 (%1, rowid, %2) VALUES ('delete', old.%3, %4);").arg(
+                        ftsTable, ftsColumns, pk, oldValues.join(QLatin1String(", ")));
+            const QString trigger = QString::fromLatin1("CREATE TRIGGER %1 AFTER %2 ON %3 BEGIN %4 END");
+
+            queries << QString::fromLatin1("CREATE VIRTUAL TABLE %1 USING fts5(%2, content=%3, content_rowid=%4)").arg(
+                           ftsTable, ftsColumns, quotedTable, pk);
+            queries << trigger.arg(driver->escapeIdentifier(d->table + QLatin1String("_fts_ai"), QSqlDriver::TableName),
+                                   QLatin1String("INSERT"), quotedTable, insertNew);
+            queries << trigger.arg(driver->escapeIdentifier(d->table + QLatin1String("_fts_ad"), QSqlDriver::TableName),
+                                   QLatin1String("DELETE"), quotedTable, deleteOld);
+            queries << trigger.arg(driver->escapeIdentifier(d->table + QLatin1String("_fts_au"), QSqlDriver::TableName),
+                                   QLatin1String("UPDATE"), quotedTable, deleteOld + QLatin1Char(' ') + insertNew);
+            break;
+        }
+        case NOrmDatabase::MySqlServer:
+            queries << QString::fromLatin1("CREATE FULLTEXT INDEX %1 ON %2 (%3)").arg(
+                           indexName, quotedTable, columns.join(QLatin1String(", ")));
+            break;
+        case NOrmDatabase::PostgreSQL:
+            queries << QString::fromLatin1("CREATE INDEX %1 ON %2 USING GIN (%3)").arg(
+                           indexName, quotedTable, searchDocumentSql(columns));
+            break;
+        default:
+            qWarning() << "Full-text search is not supported by this database, searches on" << d->className << "use LIKE";
+            break;
+        }
+    }
 
     return queries;
 }
 
 bool NOrmMetaModel::dropTable() const
 {
-    QSqlDatabase db = NOrm::database();
-    if (!db.tables().contains(d->table))
-        return true;
+    QList<QSqlDatabase> databases;
+    if (isSharded()) {
+        for (int i = 0; i < NOrmDatabase::shardCount(); ++i)
+            databases << NOrmDatabase::shardDatabase(i);
+    } else {
+        databases << NOrm::database();
+    }
+
+    foreach (const QSqlDatabase &db, databases) {
+        if (!db.tables().contains(d->table))
+            continue;
+
+        NOrmQuery query(db);
+        if (!query.exec(QLatin1String("DROP TABLE ") +
+                        db.driver()->escapeIdentifier(d->table, QSqlDriver::TableName)))
+            return false;
+
+        // 全文检索表(触发器随数据表删除)
+        if (!d->searchFields.isEmpty() && NOrmDatabase::databaseType(db) == NOrmDatabase::SQLite
+                && !query.exec(QLatin1String("DROP TABLE IF EXISTS ") +
+                               db.driver()->escapeIdentifier(d->table + QLatin1String("_fts"), QSqlDriver::TableName)))
+            return false;
+    }
+    return true;
+}
+
+bool NOrmMetaModel::migrateStringLists() const
+{
+    QList<QSqlDatabase> databases;
+    if (isSharded()) {
+        for (int i = 0; i < NOrmDatabase::shardCount(); ++i)
+            databases << NOrmDatabase::shardDatabase(i);
+    } else {
+        databases << NOrm::database();
+    }
+
+    const NOrmMetaField primaryKey = localField("pk");
+    foreach (const QSqlDatabase &db, databases) {
+        if (!db.tables().contains(d->table))
+            continue;
+
+        QSqlDriver *driver = db.driver();
+        const NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+        const QString quotedTable = driver->escapeIdentifier(d->table, QSqlDriver::TableName);
+        const QString pkColumn = driver->escapeIdentifier(primaryKey.column(), QSqlDriver::FieldName);
+        foreach (const NOrmMetaField &field, d->localFields) {
+            if (field.d->type != QVariant::StringList)
+                continue;
+            const QString column = driver->escapeIdentifier(field.column(), QSqlDriver::FieldName);
+
+            // 已经是 JSON 列时不需要迁移
+            QString columnType;
+            NOrmQuery query(db);
+            if (databaseType == NOrmDatabase::PostgreSQL || databaseType == NOrmDatabase::MySqlServer) {
+                query.prepare(QLatin1String(databaseType == NOrmDatabase::PostgreSQL
+                                            ? "SELECT data_type FROM information_schema.columns WHERE table_schema = current_schema() AND table_name = ? AND column_name = ?"
+                                            : "SELECT DATA_TYPE FROM information_schema.COLUMNS WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = ? AND COLUMN_NAME = ?"));
+                query.addBindValue(d->table);
+                query.addBindValue(field.column());
+                if (!query.exec() || !query.next())
+                    return false;
+                columnType = query.value(0).toString().toLower();
+                if (columnType == QLatin1String("jsonb") || columnType == QLatin1String("json"))
+                    continue;
+            }
+
+            // 早期版本以逗号连接的值改写为 JSON 数组
+            QList<QPair<QVariant, QString> > updates;
+            query.setForwardOnly(true);
+            if (!query.exec(QString::fromLatin1("SELECT %1, %2 FROM %3 WHERE %2 IS NOT NULL").arg(pkColumn, column, quotedTable)))
+                return false;
+            while (query.next()) {
+                const QString text = query.value(1).toString();
+                if (!text.startsWith(QLatin1Char('[')))
+                    updates << qMakePair(query.value(0), NOrmStringListCodec::encode(NOrmStringListCodec::decode(text)));
+            }
+            for (int i = 0; i < updates.size(); ++i) {
+                NOrmQuery update(db);
+                update.prepare(QString::fromLatin1("UPDATE %1 SET %2 = ? WHERE %3 = ?").arg(quotedTable, column, pkColumn));
+                update.addBindValue(updates.at(i).second);
+                update.addBindValue(updates.at(i).first);
+                if (!update.exec())
+                    return false;
+            }
 
-    NOrmQuery query(db);
-    return query.exec(QLatin1String("DROP TABLE ") +
-                      db.driver()->escapeIdentifier(d->table, QSqlDriver::TableName));
+            // 修改列类型, 数据库端的 ArrayContains 需要 JSON 列
+            QString sql;
+            if (databaseType == NOrmDatabase::PostgreSQL) {
+                sql = QString::fromLatin1("ALTER TABLE %1 ALTER COLUMN %2 TYPE %3 USING %2::jsonb")
+                        .arg(quotedTable, column, getStringListType(databaseType, field.d->maxLength));
+            } else if (databaseType == NOrmDatabase::MySqlServer) {
+                sql = QString::fromLatin1("ALTER TABLE %1 MODIFY %2 %3")
+                        .arg(quotedTable, column, getStringListType(databaseType, field.d->maxLength));
+                if (field.d->null)
+                    sql += QLatin1Char(' ') + attributeNull(databaseType);
+            }
+            if (!sql.isEmpty() && !query.exec(sql))
+                return false;
+        }
+    }
+    return true;
 }
 
 QObject *NOrmMetaModel::foreignKey(const QObject *model, const char *name) const
@@ -607,7 +1178,9 @@ QObject *NOrmMetaModel::foreignKey(const QObject *model, const char *name) const
     {
         NOrmQuerySetPrivate qs(foreignClass);
         qs.addFilter(NOrmWhere(QLatin1String("pk"), NOrmWhere::Equals, foreignPk));
+        NOrmDiagnosticsScope::beginLazyLoad(d->className, QString::fromLatin1(prop));
         qs.sqlFetch();
+        NOrmDiagnosticsScope::endLazyLoad();
         if (qs.properties.size() != 1 || !qs.sqlLoad(foreign, 0))
             return nullptr;
     }
@@ -639,19 +1212,16 @@ void NOrmMetaModel::setForeignKey(QObject *model, const char *name, QObject *val
 
 void NOrmMetaModel::load(QObject *model, const QVariantList &properties, int &pos, const QStringList &relatedFields) const
 {
+    NOrmSpanScope span(NOrmSpan::Load, d->className);
+    span.setRows(1);
+
     // process local fields
     foreach (const NOrmMetaField &field, d->localFields){
 
         if(field.d->type == QVariant::StringList) {
-            QVariant tmpObj;
-            QStringList tmpStrList = properties.at(pos++).toStringList();
-            if(tmpStrList.size() > 0){
-                QString tmpStr = tmpStrList.first();
-                tmpObj = QVariant::fromValue(tmpStr.split(','));
-            } else {
-                tmpObj = QVariant::fromValue(QString(""));
-            }
-            model->setProperty(field.d->name, tmpObj);
+            model->setProperty(field.d->name, NOrmStringListCodec::decode(properties.at(pos++).toString()));
+        } else if (field.isJson()) {
+            model->setProperty(field.d->name, NOrmJsonCodec::decode(properties.at(pos++), field.d->type));
         } else {
             model->setProperty(field.d->name, properties.at(pos++));
         }
@@ -722,6 +1292,73 @@ QString NOrmMetaModel::table() const
     return d->table;
 }
 
+QByteArray NOrmMetaModel::versionField() const
+{
+    return d->versionField;
+}
+
+QByteArray NOrmMetaModel::shardKey() const
+{
+    return d->shardKey;
+}
+
+bool NOrmMetaModel::isSharded() const
+{
+    return !d->shardKey.isEmpty() && NOrmDatabase::shardCount() > 0;
+}
+
+int NOrmMetaModel::shard(const QVariant &value) const
+{
+    const int count = NOrmDatabase::shardCount();
+    if (d->shardKey.isEmpty() || !count)
+        return -1;
+
+    // 过滤条件中的值按字段类型归一, 与保存时的属性值落到同一分片
+    QVariant key = value;
+    key.convert(localField(d->shardKey).d->type);
+
+    // 按范围分片: 落在第几个边界之后
+    if (!d->shardRanges.isEmpty()) {
+        int index = 0;
+        bool keyNumeric = false;
+        const double keyNumber = key.toDouble(&keyNumeric);
+        foreach (const QString &bound, d->shardRanges) {
+            bool boundNumeric = false;
+            const double boundNumber = bound.toDouble(&boundNumeric);
+            const bool below = (keyNumeric && boundNumeric) ? keyNumber < boundNumber : key.toString() < bound;
+            if (below)
+                break;
+            ++index;
+        }
+        return qMin(index, count - 1);
+    }
+
+    // 按哈希分片, 整数直接取模
+    bool isInteger = false;
+    const qlonglong number = key.toLongLong(&isInteger);
+    if (isInteger && key.type() != QVariant::String)
+        return int(quint64(number) % quint64(count));
+    return int(stable_hash(key.toString().toUtf8()) % quint32(count));
+}
+
+QList<QByteArray> NOrmMetaModel::searchFields() const
+{
+    return d->searchFields;
+}
+
+QString NOrmMetaModel::searchDocumentSql(const QStringList &columns) const
+{
+    QStringList parts;
+    foreach (const QString &column, columns)
+        parts << QString::fromLatin1("coalesce(%1, '')").arg(column);
+    return QString::fromLatin1("to_tsvector('%1', %2)").arg(d->searchConfig, parts.join(QLatin1String(" || ' ' || ")));
+}
+
+QString NOrmMetaModel::searchQuerySql(const QString &value) const
+{
+    return QString::fromLatin1("plainto_tsquery('%1', %2)").arg(d->searchConfig, value);
+}
+
 QString NOrmMetaModel::getBoolType(NOrmDatabase::DatabaseType databaseType) const
 {
     switch (databaseType) {
@@ -915,7 +1552,41 @@ QString NOrmMetaModel::getTimeType(NOrmDatabase::DatabaseType databaseType) cons
 
 QString NOrmMetaModel::getStringListType(NOrmDatabase::DatabaseType databaseType, int maxLength) const
 {
-    return getStringType(databaseType,maxLength);
+    // 编码后的 JSON 数组, 支持的数据库使用原生 JSON 类型以便按元素过滤和建立索引
+    switch (databaseType) {
+    case NOrmDatabase::PostgreSQL:
+        return QString("jsonb");
+    case NOrmDatabase::MySqlServer:
+        return QString("json");
+    case NOrmDatabase::SQLite:
+        return QString("text");
+    default:
+        return getStringType(databaseType,maxLength);
+    }
+}
+
+QString NOrmMetaModel::getJsonType(NOrmDatabase::DatabaseType databaseType) const
+{
+    switch (databaseType) {
+    case NOrmDatabase::PostgreSQL:
+        return QString("jsonb");
+    case NOrmDatabase::MySqlServer:
+        return QString("json");
+    default:
+        return getStringType(databaseType, 0);
+    }
+}
+
+QString NOrmMetaModel::attributeCaseInsensitive(NOrmDatabase::DatabaseType databaseType) const
+{
+    switch (databaseType) {
+    case NOrmDatabase::SQLite:
+        return QString(" COLLATE NOCASE");
+    case NOrmDatabase::MySqlServer:
+        return QString(" CHARACTER SET utf8mb4 COLLATE utf8mb4_unicode_ci");
+    default:
+        return QString();
+    }
 }
 
 QString NOrmMetaModel::attributeNull(NOrmDatabase::DatabaseType databaseType) const
@@ -1000,24 +1671,33 @@ bool NOrmMetaModel::remove(QObject *model) const
 {
     const QVariant pk = model->property(d->primaryKey);
     NOrmQuerySetPrivate qs(model->metaObject()->className());
+    qs.shard = shard(model->property(d->shardKey));
     qs.addFilter(NOrmWhere(QLatin1String("pk"), NOrmWhere::Equals, pk));
     return qs.sqlDelete();
 }
 
-bool NOrmMetaModel::save(QObject *model) const
+bool NOrmMetaModel::save(QObject *model, bool *conflict) const
 {
+    if (conflict)
+        *conflict = false;
+
     // find primary key
     const NOrmMetaField primaryKey = localField("pk");
     const QVariant pk = model->property(d->primaryKey);
-    if (!pk.isNull() && !(primaryKey.d->type == QVariant::Int && !pk.toInt()))
-    {
-        QSqlDatabase db = NOrm::database();
+
+    // the row lives on the shard of its shard key
+    const int shardIndex = isSharded() ? shard(model->property(d->shardKey)) : -1;
+    const auto rowExists = [&](const QSqlDatabase &db) {
         NOrmQuery query(db);
         query.prepare(QString::fromLatin1("SELECT 1 AS a FROM %1 WHERE %2 = ?").arg(
                           db.driver()->escapeIdentifier(d->table, QSqlDriver::FieldName),
                           db.driver()->escapeIdentifier(primaryKey.column(), QSqlDriver::FieldName)));
         query.addBindValue(pk);
-        if (query.exec() && query.next())
+        return query.exec() && query.next();
+    };
+    if (!pk.isNull() && !(primaryKey.d->type == QVariant::Int && !pk.toInt()))
+    {
+        if (rowExists(shardIndex < 0 ? NOrm::database() : NOrmDatabase::shardDatabase(shardIndex)))
         {
             // prepare data
             QVariantMap fields;
@@ -1028,10 +1708,36 @@ bool NOrmMetaModel::save(QObject *model) const
                 }
             }
 
-            // perform UPDATE
+            // perform UPDATE, a versioned row is only updated if nobody else changed it
+            NOrmWhere where(QLatin1String("pk"), NOrmWhere::Equals, pk);
+            if (!d->versionField.isEmpty())
+                where = where && NOrmWhere(QString::fromLatin1(d->versionField), NOrmWhere::Equals, model->property(d->versionField));
             NOrmQuerySetPrivate qs(model->metaObject()->className());
-            qs.addFilter(NOrmWhere(QLatin1String("pk"), NOrmWhere::Equals, pk));
-            return qs.sqlUpdate(fields) != -1;
+            qs.shard = shardIndex;
+            qs.addFilter(where);
+            const int affected = qs.sqlUpdate(fields);
+            if (affected == -1)
+                return false;
+
+            if (!d->versionField.isEmpty()) {
+                if (!affected) {
+                    qWarning("NOrmMetaModel detected a concurrent update of '%s'", qPrintable(model->property(d->primaryKey).toString()));
+                    if (conflict)
+                        *conflict = true;
+                    return false;
+                }
+                model->setProperty(d->versionField, model->property(d->versionField).toLongLong() + 1);
+            }
+            return true;
+        }
+
+        // the shard key changed: the shards are separate databases, the row
+        // cannot be moved atomically
+        for (int i = 0; shardIndex >= 0 && i < NOrmDatabase::shardCount(); ++i) {
+            if (i != shardIndex && rowExists(NOrmDatabase::shardDatabase(i))) {
+                qWarning("NOrmMetaModel cannot move '%s' to another shard", qPrintable(pk.toString()));
+                return false;
+            }
         }
     }
 
@@ -1046,6 +1752,7 @@ bool NOrmMetaModel::save(QObject *model) const
 
     // perform INSERT
     NOrmQuerySetPrivate qs(model->metaObject()->className());
+    qs.shard = shardIndex;
     if (primaryKey.d->autoIncrement) {
         // fetch autoincrement pk
         QVariant insertId;
@@ -43,7 +43,13 @@ bool NOrmModel::remove()
 bool NOrmModel::save()
 {
     const NOrmMetaModel metaModel = NOrm::metaModel(metaObject()->className());
-    return metaModel.save(this);
+    bool conflict = false;
+    if (metaModel.save(this, &conflict))
+        return true;
+
+    if (conflict)
+        emit versionConflict();
+    return false;
 }
 
 /** Returns a string representation of the model instance.
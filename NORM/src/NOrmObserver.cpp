@@ -0,0 +1,238 @@
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <QThreadStorage>
+#include "NOrm_p.h"
+#include "NOrmObserver.h"
+#include "NOrmProfiler.h"
+
+// 已注册的观察者
+static QMutex observerMutex;
+static QList<NOrmObserver*> observers;
+
+// 观察者个数, 为 0 时不创建 span
+static QAtomicInt observerCount;
+
+// span 编号
+static QAtomicInteger<quint64> spanCounter;
+
+// 当前线程中未结束的 span(由外到内)
+static QThreadStorage<QList<NOrmSpan*> > threadSpans;
+
+// 当前时间(自 1970-01-01 UTC 起的微秒数), 进程内单调
+static qint64 currentUsecs()
+{
+    static const qint64 epoch = QDateTime::currentMSecsSinceEpoch() * 1000;
+    static const QElapsedTimer clock = [] {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+    return epoch + clock.nsecsElapsed() / 1000;
+}
+
+NOrmSpan::NOrmSpan()
+    : id(0)
+    , parentId(0)
+    , phase(Exec)
+    , rows(-1)
+    , start(0)
+    , duration(0)
+    , thread(0)
+    , ok(true)
+{
+}
+
+QString NOrmSpan::phaseName(Phase phase)
+{
+    switch (phase) {
+    case Resolve:
+        return QLatin1String("resolve");
+    case Build:
+        return QLatin1String("build");
+    case Prepare:
+        return QLatin1String("prepare");
+    case Exec:
+        return QLatin1String("exec");
+    case Fetch:
+        return QLatin1String("fetch");
+    case Load:
+        return QLatin1String("load");
+    }
+    return QString();
+}
+
+NOrmObserver::~NOrmObserver()
+{
+    removeObserver(this);
+}
+
+void NOrmObserver::spanStarted(const NOrmSpan &span)
+{
+    Q_UNUSED(span);
+}
+
+void NOrmObserver::addObserver(NOrmObserver *observer)
+{
+    QMutexLocker locker(&observerMutex);
+    if (!observer || observers.contains(observer))
+        return;
+    observers << observer;
+    observerCount.store(observers.size());
+}
+
+void NOrmObserver::removeObserver(NOrmObserver *observer)
+{
+    QMutexLocker locker(&observerMutex);
+    observers.removeAll(observer);
+    observerCount.store(observers.size());
+}
+
+bool NOrmObserver::hasObservers()
+{
+    return observerCount.load();
+}
+
+void NOrmObserver::notifyStarted(const NOrmSpan &span)
+{
+    observerMutex.lock();
+    const QList<NOrmObserver*> current = observers;
+    observerMutex.unlock();
+    foreach (NOrmObserver *observer, current)
+        observer->spanStarted(span);
+}
+
+void NOrmObserver::notifyFinished(const NOrmSpan &span)
+{
+    observerMutex.lock();
+    const QList<NOrmObserver*> current = observers;
+    observerMutex.unlock();
+    foreach (NOrmObserver *observer, current)
+        observer->spanFinished(span);
+}
+
+NOrmSpanScope::NOrmSpanScope(NOrmSpan::Phase phase, const QString &model)
+    : m_span(nullptr)
+    , m_parent(nullptr)
+    , m_started(0)
+{
+    if (!observerCount.load())
+        return;
+
+    QList<NOrmSpan*> &spans = threadSpans.localData();
+    if (!spans.isEmpty())
+        m_parent = spans.last();
+
+    m_span = new NOrmSpan;
+    m_span->id = spanCounter.fetchAndAddRelaxed(1) + 1;
+    m_span->parentId = m_parent ? m_parent->id : 0;
+    m_span->phase = phase;
+    m_span->model = (model.isEmpty() && m_parent) ? m_parent->model : model;
+    m_span->thread = quint64(quintptr(QThread::currentThreadId()));
+    m_span->start = m_started = currentUsecs();
+    spans << m_span;
+    NOrmObserver::notifyStarted(*m_span);
+}
+
+NOrmSpanScope::~NOrmSpanScope()
+{
+    finish();
+}
+
+bool NOrmSpanScope::isActive() const
+{
+    return m_span != nullptr;
+}
+
+void NOrmSpanScope::setSql(const QString &sql)
+{
+    if (m_span)
+        m_span->sql = sql;
+}
+
+void NOrmSpanScope::setRows(qint64 rows)
+{
+    if (m_span)
+        m_span->rows = rows;
+}
+
+void NOrmSpanScope::setOk(bool ok)
+{
+    if (m_span)
+        m_span->ok = ok;
+}
+
+void NOrmSpanScope::finish()
+{
+    if (!m_span)
+        return;
+
+    m_span->duration = currentUsecs() - m_started;
+    if (!m_span->sql.isEmpty()) {
+        m_span->sql = NOrmProfiler::normalize(m_span->sql);
+        m_span->shapeId = QString::fromLatin1(QCryptographicHash::hash(m_span->sql.toUtf8(), QCryptographicHash::Md5).toHex().left(16));
+    }
+    threadSpans.localData().removeOne(m_span);
+    NOrmObserver::notifyFinished(*m_span);
+    delete m_span;
+    m_span = nullptr;
+}
+
+NOrmTraceFileExporter::NOrmTraceFileExporter(const QString &filePath)
+    : m_file(filePath)
+{
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Trace file open error:" << m_file.errorString();
+        return;
+    }
+    // 事件数组可以不闭合, 程序异常退出时文件仍然可用
+    m_file.write("[\n");
+}
+
+NOrmTraceFileExporter::~NOrmTraceFileExporter()
+{
+    removeObserver(this);
+    QMutexLocker locker(&m_mutex);
+    if (m_file.isOpen())
+        m_file.close();
+}
+
+bool NOrmTraceFileExporter::isOpen() const
+{
+    return m_file.isOpen();
+}
+
+void NOrmTraceFileExporter::spanFinished(const NOrmSpan &span)
+{
+    QJsonObject args;
+    args.insert(QStringLiteral("id"), QString::number(span.id));
+    args.insert(QStringLiteral("parent"), QString::number(span.parentId));
+    args.insert(QStringLiteral("model"), span.model);
+    if (!span.sql.isEmpty()) {
+        args.insert(QStringLiteral("sql"), span.sql);
+        args.insert(QStringLiteral("shape"), span.shapeId);
+    }
+    if (span.rows >= 0)
+        args.insert(QStringLiteral("rows"), span.rows);
+    args.insert(QStringLiteral("ok"), span.ok);
+
+    QJsonObject event;
+    event.insert(QStringLiteral("name"), NOrmSpan::phaseName(span.phase));
+    event.insert(QStringLiteral("cat"), QStringLiteral("norm"));
+    event.insert(QStringLiteral("ph"), QStringLiteral("X"));
+    event.insert(QStringLiteral("ts"), span.start);
+    event.insert(QStringLiteral("dur"), span.duration);
+    event.insert(QStringLiteral("pid"), QCoreApplication::applicationPid());
+    event.insert(QStringLiteral("tid"), qint64(span.thread));
+    event.insert(QStringLiteral("args"), args);
+
+    const QByteArray line = QJsonDocument(event).toJson(QJsonDocument::Compact) + ",\n";
+    QMutexLocker locker(&m_mutex);
+    if (m_file.isOpen())
+        m_file.write(line);
+}
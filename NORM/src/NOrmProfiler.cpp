@@ -0,0 +1,238 @@
+#include <QHash>
+#include <QMutex>
+#include <QtMath>
+#include <algorithm>
+#include "NOrmProfiler.h"
+
+// 直方图的桶数, 每 4 个桶耗时翻倍, 覆盖 1 微秒到约 18 小时
+static const int bucketCount = 144;
+
+// 是否在统计
+static QAtomicInt profilerEnabled;
+
+// 统计数据锁
+static QMutex profilerMutex;
+
+// 某个阶段的耗时直方图
+class NOrmStageHistogram
+{
+public:
+    NOrmStageHistogram();
+
+    void add(qint64 usecs);
+    NOrmStageProfile profile() const;
+
+private:
+    qint64 percentile(double fraction) const;
+
+    qint64 count;
+    qint64 total;
+    qint64 max;
+    quint32 buckets[bucketCount];
+};
+
+// 同一形状语句的统计
+class NOrmProfileEntry
+{
+public:
+    NOrmProfileEntry() : calls(0), rows(0), bytes(0) {}
+
+    qint64 calls;
+    NOrmStageHistogram prepare;
+    NOrmStageHistogram exec;
+    NOrmStageHistogram fetch;
+    qint64 rows;
+    qint64 bytes;
+};
+
+// 语句形状 和 统计数据的映射
+static QHash<QString, NOrmProfileEntry> profileEntries;
+
+static int bucketIndex(qint64 usecs)
+{
+    if (usecs < 1)
+        return 0;
+    return qMin(bucketCount - 1, int(std::log2(double(usecs)) * 4) + 1);
+}
+
+static qint64 bucketUpperBound(int index)
+{
+    return index ? qCeil(qPow(2.0, index / 4.0)) : 1;
+}
+
+NOrmStageHistogram::NOrmStageHistogram()
+    : count(0)
+    , total(0)
+    , max(0)
+{
+    std::fill(buckets, buckets + bucketCount, 0u);
+}
+
+void NOrmStageHistogram::add(qint64 usecs)
+{
+    ++count;
+    total += usecs;
+    max = qMax(max, usecs);
+    ++buckets[bucketIndex(usecs)];
+}
+
+qint64 NOrmStageHistogram::percentile(double fraction) const
+{
+    const qint64 target = qMax<qint64>(1, qCeil(count * fraction));
+    qint64 seen = 0;
+    for (int i = 0; i < bucketCount; ++i) {
+        seen += buckets[i];
+        if (seen >= target)
+            return qMin(max, bucketUpperBound(i));
+    }
+    return max;
+}
+
+NOrmStageProfile NOrmStageHistogram::profile() const
+{
+    NOrmStageProfile profile;
+    profile.count = count;
+    profile.total = total;
+    profile.max = max;
+    if (count) {
+        profile.p50 = percentile(0.50);
+        profile.p95 = percentile(0.95);
+        profile.p99 = percentile(0.99);
+    }
+    return profile;
+}
+
+NOrmStageProfile::NOrmStageProfile()
+    : count(0)
+    , total(0)
+    , p50(0)
+    , p95(0)
+    , p99(0)
+    , max(0)
+{
+}
+
+NOrmQueryProfile::NOrmQueryProfile()
+    : calls(0)
+    , rows(0)
+    , bytes(0)
+{
+}
+
+bool NOrmProfiler::isEnabled()
+{
+    return profilerEnabled.load();
+}
+
+void NOrmProfiler::setEnabled(bool enabled)
+{
+    profilerEnabled.store(enabled);
+}
+
+QList<NOrmQueryProfile> NOrmProfiler::snapshot()
+{
+    QList<NOrmQueryProfile> profiles;
+    {
+        QMutexLocker locker(&profilerMutex);
+        QHash<QString, NOrmProfileEntry>::const_iterator it;
+        for (it = profileEntries.constBegin(); it != profileEntries.constEnd(); ++it) {
+            NOrmQueryProfile profile;
+            profile.sql = it.key();
+            profile.calls = it->calls;
+            profile.prepare = it->prepare.profile();
+            profile.exec = it->exec.profile();
+            profile.fetch = it->fetch.profile();
+            profile.rows = it->rows;
+            profile.bytes = it->bytes;
+            profiles << profile;
+        }
+    }
+
+    // 最耗时的语句排在前面
+    std::sort(profiles.begin(), profiles.end(), [](const NOrmQueryProfile &a, const NOrmQueryProfile &b) {
+        return a.exec.total + a.fetch.total > b.exec.total + b.fetch.total;
+    });
+    return profiles;
+}
+
+void NOrmProfiler::reset()
+{
+    QMutexLocker locker(&profilerMutex);
+    profileEntries.clear();
+}
+
+static void appendPlaceholder(QString &shape)
+{
+    // IN 列表 和 多行 VALUES 的长度不影响形状
+    if (shape.endsWith(QLatin1String("?, ")) || shape.endsWith(QLatin1String("?,"))) {
+        shape.chop(shape.endsWith(QLatin1Char(' ')) ? 2 : 1);
+        return;
+    }
+    shape += QLatin1Char('?');
+}
+
+QString NOrmProfiler::normalize(const QString &sql)
+{
+    QString shape;
+    shape.reserve(sql.size());
+    const int size = sql.size();
+    for (int i = 0; i < size; ) {
+        const QChar c = sql.at(i);
+        if (c == QLatin1Char('\'')) {
+            // 字符串字面量, '' 为转义的引号
+            for (++i; i < size; ++i) {
+                if (sql.at(i) == QLatin1Char('\'')) {
+                    if (i + 1 < size && sql.at(i + 1) == QLatin1Char('\'')) {
+                        ++i;
+                        continue;
+                    }
+                    ++i;
+                    break;
+                }
+            }
+            appendPlaceholder(shape);
+        } else if (c.isDigit() && (shape.isEmpty() || !(shape.at(shape.size() - 1).isLetterOrNumber() || shape.at(shape.size() - 1) == QLatin1Char('_')))) {
+            // 数字字面量, 标识符中的数字保留
+            while (i < size && (sql.at(i).isDigit() || sql.at(i) == QLatin1Char('.')))
+                ++i;
+            appendPlaceholder(shape);
+        } else if (c == QLatin1Char('?')) {
+            ++i;
+            appendPlaceholder(shape);
+        } else if (c.isSpace()) {
+            if (!shape.endsWith(QLatin1Char(' ')))
+                shape += QLatin1Char(' ');
+            ++i;
+        } else {
+            shape += c;
+            ++i;
+        }
+    }
+
+    // 多行 VALUES (?), (?) 折叠为一行
+    while (shape.contains(QLatin1String("(?), (?)")))
+        shape.replace(QLatin1String("(?), (?)"), QLatin1String("(?)"));
+    return shape.trimmed();
+}
+
+void NOrmProfiler::record(const QString &sql, Stage stage, qint64 usecs, qint64 rows, qint64 bytes)
+{
+    const QString shape = normalize(sql);
+
+    QMutexLocker locker(&profilerMutex);
+    NOrmProfileEntry &entry = profileEntries[shape];
+    switch (stage) {
+    case Prepare:
+        entry.prepare.add(usecs);
+        break;
+    case Exec:
+        ++entry.calls;
+        entry.exec.add(usecs);
+        break;
+    case Fetch:
+        entry.fetch.add(usecs);
+        entry.rows += rows;
+        entry.bytes += bytes;
+        break;
+    }
+}
@@ -1,32 +1,96 @@
+#include <algorithm>
+#include <QDataStream>
+#include <QDateTime>
 #include <QDebug>
+#include <QIODevice>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocale>
+#include <QQueue>
+#include <QSet>
 #include <QSqlDriver>
+#include <QSqlField>
 #include <QSqlRecord>
+#include <QThread>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
+#include <QtNumeric>
 #include "NOrm.h"
 #include "NOrm_p.h"
+#include "NOrmDiagnosticsScope.h"
 #include "NOrmQuerySet.h"
 #include "NOrmWhere_p.h"
 
-NOrmCompiler::NOrmCompiler(const char* modelName, const QSqlDatabase& db) {
+// upper bound of rows in a single INSERT ... VALUES statement (MSSQL limit)
+static const int maxRowsPerInsert = 1000;
+
+// size of the buffer filled before an export writes to its device
+static const int exportBufferSize = 64 * 1024;
+
+// bytes read from the device at once by an import
+static const int importReadSize = 64 * 1024;
+
+// records handed from the import reader to a parser at once
+static const int importRecordsPerChunk = 1024;
+
+/** Excludes the statements of a row by row fallback from N+1 detection,
+    they come from one batch operation.
+ */
+class NOrmDiagnosticsBatch {
+public:
+    NOrmDiagnosticsBatch() { NOrmDiagnosticsScope::beginBatch(); }
+    ~NOrmDiagnosticsBatch() { NOrmDiagnosticsScope::endBatch(); }
+};
+
+static QString aggregationToString(NOrmWhere::AggregateType type) {
+    switch (type) {
+    case NOrmWhere::AVG:
+        return QLatin1String("AVG");
+    case NOrmWhere::COUNT:
+        return QLatin1String("COUNT");
+    case NOrmWhere::SUM:
+        return QLatin1String("SUM");
+    case NOrmWhere::MIN:
+        return QLatin1String("MIN");
+    case NOrmWhere::MAX:
+        return QLatin1String("MAX");
+    case NOrmWhere::COUNT_DISTINCT:
+        return QLatin1String("COUNT");
+    }
+    return QString();
+}
+
+/** Constructs a compiler for \a modelName. A non-empty \a aliasPrefix
+    aliases the base table and prefixes the join aliases, so that a
+    subquery does not clash with the tables of the statement it is in.
+ */
+NOrmCompiler::NOrmCompiler(const char* modelName, const QSqlDatabase& db, const QString& aliasPrefix) {
+    database = db;
     driver = db.driver();
+    databaseType = NOrmDatabase::databaseType(db);
     baseModel = NOrm::metaModel(modelName);
+    this->aliasPrefix = aliasPrefix;
+    subqueryCount = 0;
+    searchOrdered = false;
+    resolveFailed = false;
 }
 
 QString NOrmCompiler::referenceModel(const QString& modelPath, NOrmMetaModel* metaModel, bool nullable) {
     if (modelPath.isEmpty())
-        return driver->escapeIdentifier(baseModel.table(), QSqlDriver::TableName);
+        return aliasPrefix.isEmpty() ? driver->escapeIdentifier(baseModel.table(), QSqlDriver::TableName) : aliasPrefix;
 
     if (modelRefs.contains(modelPath))
         return modelRefs.value(modelPath).tableReference;
 
-    const QString modelRef = QLatin1String("T") + QString::number(modelRefs.size());
+    const QString modelRef = aliasPrefix + QLatin1String("T") + QString::number(modelRefs.size());
     modelRefs.insert(modelPath, NOrmModelReference(modelRef, *metaModel, nullable));
     return modelRef;
 }
 
 void NOrmCompiler::limitSql(QString &limit, int lowMark, int highMark)
 {
-    NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(NOrm::database());
-
     switch (databaseType) {
     case NOrmDatabase::UnknownDB:
     case NOrmDatabase::MySqlServer:
@@ -51,8 +115,12 @@ void NOrmCompiler::limitSql(QString &limit, int lowMark, int highMark)
         }
         break;
     case NOrmDatabase::MSSqlServer:
-        if (limit.isEmpty() && (highMark > 0 || lowMark > 0))
-            limit += QLatin1String(" ORDER BY ") + databaseColumn(baseModel.primaryKey());
+        if (limit.isEmpty() && (highMark > 0 || lowMark > 0)) {
+            // a wrapping subquery orders on the primary key it selects
+            const QString primaryKey = QString::fromLatin1(baseModel.primaryKey());
+            limit += QLatin1String(" ORDER BY ")
+                    + (annotations.contains(primaryKey) ? annotations.value(primaryKey) : databaseColumn(primaryKey));
+        }
 
         if (lowMark > 0 || (lowMark == 0 && highMark > 0)) {
             limit += QLatin1String(" OFFSET ") + QString::number(lowMark);
@@ -96,6 +164,7 @@ QString NOrmCompiler::databaseColumn(const QString& name) {
 
             if (rev.leftHandKey.isEmpty()) {
                 qWarning() << "Invalid field lookup" << name;
+                resolveFailed = true;
                 return QString();
             }
             rev.rightHandKey = foreignModel.primaryKey();
@@ -155,6 +224,8 @@ QStringList NOrmCompiler::fieldNames(bool recurse,
 
 QString NOrmCompiler::fromSql() {
     QString from = driver->escapeIdentifier(baseModel.table(), QSqlDriver::TableName);
+    if (!aliasPrefix.isEmpty())
+        from += QLatin1Char(' ') + aliasPrefix;
     foreach (const QString& name, modelRefs.keys()) {
         const NOrmModelReference& ref = modelRefs[name];
 
@@ -176,16 +247,19 @@ QString NOrmCompiler::fromSql() {
                 .arg(leftHandColumn)
                 .arg(rightHandColumn);
     }
+    // the search rank is only joined when it orders the set
+    if (searchOrdered)
+        from += searchJoin;
     return from;
 }
 
-QString NOrmCompiler::orderLimitSql(const QStringList& orderBy, int lowMark, int highMark) {
-    QString limit;
-
-    // order
+/** Returns the columns of an ORDER BY on \a fields, a leading "-" sorts
+    a field in descending order. Annotations are referred to by name.
+ */
+QString NOrmCompiler::orderColumns(const QStringList& fields) {
     QStringList bits;
     QString field;
-    foreach (field, orderBy) {
+    foreach (field, fields) {
         QString order = QLatin1String("ASC");
         if (field.startsWith(QLatin1Char('-'))) {
             order = QLatin1String("DESC");
@@ -193,11 +267,28 @@ QString NOrmCompiler::orderLimitSql(const QStringList& orderBy, int lowMark, int
         } else if (field.startsWith(QLatin1Char('+'))) {
             field = field.mid(1);
         }
-        bits.append(databaseColumn(field) + QLatin1Char(' ') + order);
+        const QString column = annotations.contains(field) ? annotations.value(field) : databaseColumn(field);
+        bits.append(column + QLatin1Char(' ') + order);
+    }
+    return bits.join(QLatin1String(", "));
+}
+
+/** Returns the ORDER BY and LIMIT clauses. With \a searchOrder a set which
+    has no explicit order and is filtered by a full-text search is ordered
+    by relevance.
+ */
+QString NOrmCompiler::orderLimitSql(const QStringList& orderBy, int lowMark, int highMark, bool searchOrder) {
+    QString limit;
+
+    // order
+    QString order = orderColumns(orderBy);
+    if (order.isEmpty() && searchOrder) {
+        order = searchRank;
+        searchOrdered = !order.isEmpty();
     }
 
-    if (!bits.isEmpty())
-        limit += QLatin1String(" ORDER BY ") + bits.join(QLatin1String(", "));
+    if (!order.isEmpty())
+        limit += QLatin1String(" ORDER BY ") + order;
 
     // limits
     limitSql(limit, lowMark, highMark);
@@ -205,18 +296,465 @@ QString NOrmCompiler::orderLimitSql(const QStringList& orderBy, int lowMark, int
     return limit;
 }
 
-void NOrmCompiler::resolve(NOrmWhere& where) {
+/** Returns the aggregate \a func over \a field, which may follow foreign
+    keys. COUNT also accepts "*". An \a approximate distinct count uses
+    APPROX_COUNT_DISTINCT (SQL Server 2019, Oracle 12c).
+ */
+QString NOrmCompiler::aggregateSql(NOrmWhere::AggregateType func, const QString& field, bool approximate) {
+    const QString column = field == QLatin1String("*") ? field : databaseColumn(field);
+    if (func == NOrmWhere::COUNT_DISTINCT)
+        return QString::fromLatin1(approximate ? "APPROX_COUNT_DISTINCT(%1)" : "COUNT(DISTINCT %1)").arg(column);
+    return aggregationToString(func) + QLatin1Char('(') + column + QLatin1Char(')');
+}
+
+/** Returns the expression of \a aggregate and records it under its name,
+    so that HAVING clauses and orderings can refer to it.
+ */
+QString NOrmCompiler::annotate(const NOrmAggregate& aggregate) {
+    const QString expression = aggregateSql(aggregate.type, aggregate.field);
+    annotations.insert(aggregate.name, expression);
+    return expression;
+}
+
+/** Returns the columns of the grouped \a fields.
+ */
+QStringList NOrmCompiler::groupColumns(const QStringList& fields) {
+    QStringList columns;
+    foreach (const QString& field, fields)
+        columns << databaseColumn(field);
+    return columns;
+}
+
+/** Returns the expression of the window function \a window and records
+    it under its name, so that orderings can refer to it.
+ */
+QString NOrmCompiler::windowSql(const NOrmWindow& window) {
+    const QString column = (window.field.isEmpty() || window.field == QLatin1String("*"))
+            ? QString::fromLatin1("*") : databaseColumn(window.field);
+
+    QString function;
+    switch (window.function) {
+    case NOrmWindow::RowNumber:
+        function = QLatin1String("ROW_NUMBER()");
+        break;
+    case NOrmWindow::Rank:
+        function = QLatin1String("RANK()");
+        break;
+    case NOrmWindow::DenseRank:
+        function = QLatin1String("DENSE_RANK()");
+        break;
+    case NOrmWindow::Lag:
+        function = QString::fromLatin1("LAG(%1, %2)").arg(column).arg(window.offset);
+        break;
+    case NOrmWindow::Lead:
+        function = QString::fromLatin1("LEAD(%1, %2)").arg(column).arg(window.offset);
+        break;
+    case NOrmWindow::FirstValue:
+        function = QString::fromLatin1("FIRST_VALUE(%1)").arg(column);
+        break;
+    case NOrmWindow::LastValue:
+        function = QString::fromLatin1("LAST_VALUE(%1)").arg(column);
+        break;
+    case NOrmWindow::Sum:
+        function = aggregationToString(NOrmWhere::SUM) + QLatin1Char('(') + column + QLatin1Char(')');
+        break;
+    case NOrmWindow::Avg:
+        function = aggregationToString(NOrmWhere::AVG) + QLatin1Char('(') + column + QLatin1Char(')');
+        break;
+    case NOrmWindow::Count:
+        function = aggregationToString(NOrmWhere::COUNT) + QLatin1Char('(') + column + QLatin1Char(')');
+        break;
+    case NOrmWindow::Min:
+        function = aggregationToString(NOrmWhere::MIN) + QLatin1Char('(') + column + QLatin1Char(')');
+        break;
+    case NOrmWindow::Max:
+        function = aggregationToString(NOrmWhere::MAX) + QLatin1Char('(') + column + QLatin1Char(')');
+        break;
+    }
+
+    QStringList over;
+    if (!window.partitionBy.isEmpty())
+        over << QLatin1String("PARTITION BY ") + groupColumns(window.partitionBy).join(QLatin1String(", "));
+    if (!window.orderBy.isEmpty())
+        over << QLatin1String("ORDER BY ") + orderColumns(window.orderBy);
+
+    const QString expression = function + QLatin1String(" OVER (") + over.join(QLatin1String(" ")) + QLatin1Char(')');
+    annotations.insert(window.name, expression);
+    return expression;
+}
+
+/** Wraps the select of \a columns, which end with the \a windows, into a
+    derived table so that \a qualify can filter on the windows by name.
+    The outer statement keeps the order and the range of the set, the
+    fields it orders on are selected by the inner one.
+ */
+QString NOrmCompiler::windowSubquerySql(const QStringList& columns, const QList<NOrmWindow>& windows, const QString& where,
+                                        NOrmWhere& qualify, const QStringList& orderBy, int lowMark, int highMark, bool distinct) {
+    const QString table = aliasPrefix + QLatin1Char('W');
+
+    // a derived table cannot have duplicate column names
+    QStringList inner;
+    QStringList outer;
+    for (int i = 0; i < columns.size(); i++) {
+        const QString alias = QLatin1Char('C') + QString::number(i);
+        inner << columns.at(i) + QLatin1String(" AS ") + alias;
+        outer << table + QLatin1Char('.') + alias;
+    }
+    const int windowStart = columns.size() - windows.size();
+    for (int i = 0; i < windows.size(); i++)
+        annotations.insert(windows.at(i).name, outer.at(windowStart + i));
+
+    // the ordered fields and the primary key, which orders a range on MSSQL
+    QStringList fields;
+    foreach (const QString& field, orderBy) {
+        if (field.startsWith(QLatin1Char('-')) || field.startsWith(QLatin1Char('+')))
+            fields << field.mid(1);
+        else
+            fields << field;
+    }
+    fields << QString::fromLatin1(baseModel.primaryKey());
+    for (int i = 0; i < fields.size(); i++) {
+        if (annotations.contains(fields.at(i)))
+            continue;
+
+        // selected columns are ordered by their outer name, which DISTINCT requires
+        const int index = columns.indexOf(databaseColumn(fields.at(i)));
+        if (index >= 0) {
+            annotations.insert(fields.at(i), outer.at(index));
+            continue;
+        }
+        const QString alias = QLatin1Char('O') + QString::number(i);
+        inner << databaseColumn(fields.at(i)) + QLatin1String(" AS ") + alias;
+        annotations.insert(fields.at(i), table + QLatin1Char('.') + alias);
+    }
+
+    QString sql = QLatin1String("SELECT ") + inner.join(QLatin1String(", ")) + QLatin1String(" FROM ") + fromSql();
+    if (!where.isEmpty())
+        sql += QLatin1String(" WHERE ") + where;
+
+    resolveWhere(qualify, false);
+    const QString condition = qualify.sql(database);
+    sql = QString::fromLatin1(distinct ? "SELECT DISTINCT %1 FROM (%2) %3" : "SELECT %1 FROM (%2) %3")
+            .arg(outer.join(QLatin1String(", ")), sql, table);
+    if (!condition.isEmpty())
+        sql += QLatin1String(" WHERE ") + condition;
+    return sql + orderLimitSql(orderBy, lowMark, highMark);
+}
+
+/** Resolves the columns of \a where and returns false if a lookup could not
+    be resolved, the statement must then not be executed.
+ */
+bool NOrmCompiler::resolve(NOrmWhere& where) {
+    NOrmSpanScope span(NOrmSpan::Resolve, baseModel.className());
+    resolveWhere(where, true);
+    span.setOk(!resolveFailed);
+    return !resolveFailed;
+}
+
+/** Resolves the columns of \a where. Searches are \a rankable when every
+    row of the set has to match them, their rank then orders the set.
+ */
+void NOrmCompiler::resolveWhere(NOrmWhere& where, bool rankable) {
     // resolve column
-    if (where.d->operation != NOrmWhere::None)
-        where.d->key = databaseColumn(where.d->key);
+    if (where.d->subquery) {
+        where.d->key = subquerySql(where);
+        return;
+    } else if (annotations.contains(where.d->key)) {
+        where.d->key = annotations.value(where.d->key);
+        return;
+    } else if (where.d->operation == NOrmWhere::Search)
+        where.d->key = searchSql(where, rankable && !where.d->negate);
+    else if (where.d->key.contains(QLatin1String("__json__")))
+        where.d->key = jsonColumn(where);
+    else if (where.d->operation != NOrmWhere::None) {
+        const QString name = where.d->key;
+        where.d->key = databaseColumn(name);
+        if (isCaseInsensitive(name))
+            resolveCaseInsensitive(where);
+        return;
+    }
 
     // recurse into children
+    rankable = rankable && !where.d->negate && where.d->combine == NOrmWherePrivate::AndCombine;
     for (int i = 0; i < where.d->children.size(); i++)
-        resolve(where.d->children[i]);
+        resolveWhere(where.d->children[i], rankable);
+}
+
+/** Compiles the subquery of \a where into the whole condition. The filter
+    of the subquery is resolved by its own compiler and kept as the only
+    child of \a where, so its values are bound where the condition is.
+    An Exists with a key is correlated: the projected field of the
+    subquery has to match the key of the outer row.
+ */
+QString NOrmCompiler::subquerySql(NOrmWhere& where) {
+    const NOrmSubquery& subquery = *where.d->subquery;
+    const NOrmWhere::Operation operation = where.d->operation;
+    if (operation != NOrmWhere::IsIn && operation != NOrmWhere::Equals
+            && operation != NOrmWhere::NotEquals && operation != NOrmWhere::Exists) {
+        qWarning() << "Subqueries can only be used with IsIn, Equals and Exists";
+        resolveFailed = true;
+        return QString();
+    }
+
+    const QString outerColumn = where.d->key.isEmpty() ? QString() : databaseColumn(where.d->key);
+    if (outerColumn.isEmpty() && operation != NOrmWhere::Exists) {
+        qWarning() << "Subquery lookup requires a key";
+        resolveFailed = true;
+        return QString();
+    }
+
+    const QString subqueryAlias = aliasPrefix + QLatin1Char('S') + QString::number(subqueryCount++);
+    NOrmCompiler compiler(subquery.modelName.constData(), database, subqueryAlias);
+    NOrmWhere resolvedWhere(subquery.where);
+    compiler.resolveWhere(resolvedWhere, false);
+    const QString column = compiler.databaseColumn(subquery.field);
+    resolveFailed = resolveFailed || compiler.resolveFailed;
+
+    QString condition = resolvedWhere.sql(database);
+    if (operation == NOrmWhere::Exists && !outerColumn.isEmpty()) {
+        const QString correlation = column + QLatin1String(" = ") + outerColumn;
+        condition = condition.isEmpty() ? correlation : QString::fromLatin1("(%1) AND %2").arg(condition, correlation);
+    }
+
+    // an order is only kept when it selects the rows of a range
+    const bool limited = subquery.lowMark > 0 || subquery.highMark > 0;
+    const QString limit = compiler.orderLimitSql(limited ? subquery.orderBy : QStringList(),
+                                                 subquery.lowMark, subquery.highMark);
+
+    QString sql = QLatin1String("SELECT ") + (operation == NOrmWhere::Exists ? QString::fromLatin1("1") : column)
+            + QLatin1String(" FROM ") + compiler.fromSql();
+    if (!condition.isEmpty())
+        sql += QLatin1String(" WHERE ") + condition;
+    sql += limit;
+
+    // MySQL does not support LIMIT in an IN subquery, but in a derived table
+    if (limited && operation == NOrmWhere::IsIn && databaseType == NOrmDatabase::MySqlServer)
+        sql = QString::fromLatin1("SELECT * FROM (%1) %2L").arg(sql, subqueryAlias);
+
+    where.d->children = QList<NOrmWhere>() << resolvedWhere;
+    switch (operation) {
+    case NOrmWhere::IsIn:
+        return outerColumn + QString::fromLatin1(" IN (%1)").arg(sql);
+    case NOrmWhere::Equals:
+        return outerColumn + QString::fromLatin1(" = (%1)").arg(sql);
+    case NOrmWhere::NotEquals:
+        return outerColumn + QString::fromLatin1(" != (%1)").arg(sql);
+    default:
+        return QString::fromLatin1("EXISTS (%1)").arg(sql);
+    }
+}
+
+/** Returns the expression which extracts the value at a JSON path for a
+    lookup such as "payload__json__device__temp". On PostgreSQL the text is
+    cast to match the value of the \a where clause, so that numbers compare
+    as numbers and expression indexes declared with json_index are used.
+ */
+QString NOrmCompiler::jsonColumn(const NOrmWhere& where) {
+    const int jsonPos = where.d->key.indexOf(QLatin1String("__json__"));
+    const QString name = where.d->key.left(jsonPos);
+    const QStringList path = where.d->key.mid(jsonPos + 8).split(QLatin1String("__"));
+    if (!NOrmJsonCodec::isValidPath(path)) {
+        qWarning() << "Invalid JSON path lookup" << where.d->key;
+        resolveFailed = true;
+        return QString();
+    }
+
+    QString cast;
+    switch (where.d->operation) {
+    case NOrmWhere::Equals:
+    case NOrmWhere::NotEquals:
+    case NOrmWhere::GreaterThan:
+    case NOrmWhere::LessThan:
+    case NOrmWhere::GreaterOrEquals:
+    case NOrmWhere::LessOrEquals:
+    case NOrmWhere::IsIn:
+        cast = NOrmJsonCodec::pathCast(where.d->data);
+        break;
+    default:
+        break;
+    }
+    return NOrmJsonCodec::pathExpression(databaseType, databaseColumn(name), path, cast);
+}
+
+/** Returns the smallest string greater than every string starting with
+    \a prefix, or an empty string if there is none.
+ */
+static QString prefixUpperBound(QString prefix) {
+    while (!prefix.isEmpty()) {
+        const ushort last = prefix.at(prefix.size() - 1).unicode();
+        prefix.chop(1);
+        if (last < 0xffff)
+            return prefix + QChar(ushort(last + 1));
+    }
+    return QString();
+}
+
+/** Lowers the ASCII letters of \a text, as SQLite's NOCASE collation does.
+ */
+static QString asciiLower(QString text) {
+    for (int i = 0; i < text.size(); ++i) {
+        const ushort c = text.at(i).unicode();
+        if (c >= 'A' && c <= 'Z')
+            text[i] = QChar(ushort(c + 32));
+    }
+    return text;
+}
+
+/** Returns true if the field \a name, possibly across foreign keys, was
+    declared with ci=true.
+ */
+bool NOrmCompiler::isCaseInsensitive(const QString& name) const {
+    NOrmMetaModel model = baseModel;
+    QStringList bits = name.split(QLatin1String("__"));
+    while (bits.size() > 1) {
+        const QByteArray fk = bits.takeFirst().toLatin1();
+        if (!model.foreignFields().contains(fk))
+            return false;
+        model = NOrm::metaModel(model.foreignFields()[fk]);
+    }
+    return model.localField(bits.first().toLatin1()).isCaseInsensitive();
+}
+
+/** Rewrites a case-insensitive lookup on a ci field into comparisons which
+    can use an index: the column collation ignores case on SQLite and MySQL,
+    PostgreSQL compares against the lower() expression index of the field.
+    Prefixes become a range instead of a LIKE.
+ */
+void NOrmCompiler::resolveCaseInsensitive(NOrmWhere& where) {
+    const NOrmWhere::Operation operation = where.d->operation;
+    if (operation != NOrmWhere::IEquals && operation != NOrmWhere::INotEquals && operation != NOrmWhere::IStartsWith)
+        return;
+    if (databaseType != NOrmDatabase::SQLite && databaseType != NOrmDatabase::MySqlServer && databaseType != NOrmDatabase::PostgreSQL)
+        return;
+
+    // MySQL turns LIKE 'x%' into a range of the _ci column itself
+    if (operation == NOrmWhere::IStartsWith && databaseType == NOrmDatabase::MySqlServer)
+        return;
+
+    QString value = where.d->data.toString();
+    if (databaseType == NOrmDatabase::PostgreSQL) {
+        where.d->key = QString::fromLatin1("lower(%1) COLLATE \"C\"").arg(where.d->key);
+        value = value.toLower();
+    } else {
+        value = asciiLower(value);
+    }
+
+    if (operation != NOrmWhere::IStartsWith) {
+        where.d->operation = (operation == NOrmWhere::IEquals) ? NOrmWhere::Equals : NOrmWhere::NotEquals;
+        where.d->data = value;
+        return;
+    }
+
+    // the bounds are folded like the column, so that the range is contiguous
+    if (value.isEmpty()) {
+        where = where.d->negate ? !NOrmWhere() : NOrmWhere(where.d->key, NOrmWhere::IsNull, false);
+        return;
+    }
+    // the bound is folded too: NOCASE compares 'A' as 'a', so the bound
+    // after '@' skips the upper case letters and becomes '['
+    QString upper = prefixUpperBound(value);
+    if (!upper.isEmpty()) {
+        const ushort last = upper.at(upper.size() - 1).unicode();
+        if (last >= 'A' && last <= 'Z')
+            upper[upper.size() - 1] = QLatin1Char('[');
+        upper = asciiLower(upper);
+    }
+    NOrmWhere range;
+    if (upper.isEmpty())
+        range = NOrmWhere(where.d->key, NOrmWhere::GreaterOrEquals, value);
+    else
+        range = NOrmWhere(where.d->key, NOrmWhere::GreaterOrEquals, value) && NOrmWhere(where.d->key, NOrmWhere::LessThan, upper);
+    where = where.d->negate ? !range : range;
+}
+
+/** Returns the condition of a full-text search over the search fields of
+    the model and replaces the value of \a where by what it binds. The first
+    \a rank search also provides the relevance used to order the set.
+ */
+QString NOrmCompiler::searchSql(NOrmWhere& where, bool rank) {
+    const QList<QByteArray> fields = baseModel.searchFields();
+    if (fields.isEmpty()) {
+        qWarning() << "Model" << baseModel.className() << "has no search fields";
+        resolveFailed = true;
+        return QString();
+    }
+
+    QStringList columns;
+    foreach (const QByteArray& name, fields)
+        columns << databaseColumn(QString::fromLatin1(name));
+    const QString text = where.d->data.toString();
+    rank = rank && searchRank.isEmpty();
+
+    // the rank is part of ORDER BY, which is not bound
+    QSqlField literal(QString(), QVariant::String);
+    QString condition;
+    switch (databaseType) {
+    case NOrmDatabase::SQLite: {
+        // quote every word so that the input is not parsed as FTS5 syntax
+        QStringList words;
+        foreach (QString word, text.split(QRegExp(QLatin1String("\\s+")), QString::SkipEmptyParts))
+            words << QLatin1Char('"') + word.replace(QLatin1Char('"'), QLatin1String("\"\"")) + QLatin1Char('"');
+        // MATCH '' is a syntax error, no words match no rows
+        if (words.isEmpty()) {
+            where.d->data = QVariantList();
+            condition = QLatin1String("1 = 0");
+            break;
+        }
+        where.d->data = words.join(QLatin1Char(' '));
+        literal.setValue(where.d->data);
+
+        const QString ftsTable = driver->escapeIdentifier(baseModel.table() + QLatin1String("_fts"), QSqlDriver::TableName);
+        const QString pk = databaseColumn(QLatin1String("pk"));
+        condition = QString::fromLatin1("%1 IN (SELECT rowid FROM %2 WHERE %2 MATCH ?)").arg(pk, ftsTable);
+        if (rank) {
+            // the ranked matches are read once and joined by rowid, a LEFT JOIN
+            // keeps SQLite from flattening the search into a lookup per row
+            const QString alias = aliasPrefix + QLatin1String("R");
+            searchJoin = QString::fromLatin1(" LEFT OUTER JOIN (SELECT rowid, rank FROM %1 WHERE %1 MATCH %2) %3 ON %3.rowid = %4")
+                    .arg(ftsTable, driver->formatValue(literal), alias, pk);
+            searchRank = alias + QLatin1String(".rank ASC");
+        }
+        break;
+    }
+    case NOrmDatabase::MySqlServer:
+        literal.setValue(text);
+        condition = QString::fromLatin1("MATCH (%1) AGAINST (? IN NATURAL LANGUAGE MODE)").arg(columns.join(QLatin1String(", ")));
+        if (rank)
+            searchRank = QString::fromLatin1("MATCH (%1) AGAINST (%2 IN NATURAL LANGUAGE MODE) DESC").arg(
+                        columns.join(QLatin1String(", ")), driver->formatValue(literal));
+        break;
+    case NOrmDatabase::PostgreSQL: {
+        literal.setValue(text);
+        const QString document = baseModel.searchDocumentSql(columns);
+        condition = QString::fromLatin1("%1 @@ %2").arg(document, baseModel.searchQuerySql(QLatin1String("?")));
+        if (rank)
+            searchRank = QString::fromLatin1("ts_rank(%1, %2) DESC").arg(
+                        document, baseModel.searchQuerySql(driver->formatValue(literal)));
+        break;
+    }
+    default: {
+        // no full-text index, match any of the fields; backslash is not
+        // the default LIKE escape of these databases, so it is declared
+        QString pattern = text;
+        pattern.replace(QLatin1String("\\"), QLatin1String("\\\\"));
+        pattern.replace(QLatin1String("%"), QLatin1String("\\%"));
+        pattern.replace(QLatin1String("_"), QLatin1String("\\_"));
+        QVariantList values;
+        QStringList bits;
+        foreach (const QString& column, columns) {
+            bits << column + QLatin1String(" LIKE ? ESCAPE '\\'");
+            values << QString(QLatin1Char('%') + pattern + QLatin1Char('%'));
+        }
+        where.d->data = values;
+        condition = QLatin1Char('(') + bits.join(QLatin1String(" OR ")) + QLatin1Char(')');
+        break;
+    }
+    }
+    return condition;
 }
 
 NOrmQuerySetPrivate::NOrmQuerySetPrivate(const char* modelName)
-    : counter(1), hasResults(false), lowMark(0), highMark(0), selectRelated(false), m_modelName(modelName) {}
+    : counter(1), hasResults(false), distinct(false), lowMark(0), highMark(0), selectRelated(false), shard(-1), m_modelName(modelName) {}
 
 void NOrmQuerySetPrivate::addFilter(const NOrmWhere& where) {
     // it is not possible to add filters once a limit has been set
@@ -232,6 +770,77 @@ NOrmWhere NOrmQuerySetPrivate::resolvedWhere(const QSqlDatabase& db) const {
     return resolvedWhere;
 }
 
+/** Returns the connection used to write the set: its shard if it is bound
+    to one, otherwise the primary database.
+ */
+QSqlDatabase NOrmQuerySetPrivate::writeDatabase() const {
+    return shard >= 0 ? NOrmDatabase::shardDatabase(shard) : NOrm::database();
+}
+
+/** Collects the values of the shard key \a keys the \a where clause is
+    restricted to. Returns false if any value of the key can match.
+ */
+bool NOrmQuerySetPrivate::shardKeyValues(const NOrmWhere& where, const QStringList& keys, QVariantList* values) {
+    if (where.d->negate)
+        return false;
+
+    // one restricted branch of an AND is enough
+    if (where.d->combine == NOrmWherePrivate::AndCombine) {
+        foreach (const NOrmWhere& child, where.d->children) {
+            if (shardKeyValues(child, keys, values))
+                return true;
+        }
+        return false;
+    }
+
+    if (where.d->combine != NOrmWherePrivate::NoCombine || !keys.contains(where.d->key) || where.d->subquery)
+        return false;
+    if (where.d->operation == NOrmWhere::Equals) {
+        *values << where.d->data;
+        return true;
+    } else if (where.d->operation == NOrmWhere::IsIn) {
+        *values << where.d->data.toList();
+        return true;
+    }
+    return false;
+}
+
+/** Returns the shards the set has to run on: none if the model is not
+    sharded, the shards of the shard key values if the filter restricts
+    the key, otherwise every shard.
+ */
+QList<int> NOrmQuerySetPrivate::targetShards() const {
+    QList<int> shards;
+    if (shard >= 0) {
+        shards << shard;
+        return shards;
+    }
+
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    if (!metaModel.isSharded())
+        return shards;
+
+    QStringList keys;
+    keys << QString::fromLatin1(metaModel.shardKey());
+    if (metaModel.shardKey() == metaModel.primaryKey())
+        keys << QLatin1String("pk");
+
+    QVariantList values;
+    if (shardKeyValues(whereClause, keys, &values) && !values.isEmpty()) {
+        foreach (const QVariant& value, values) {
+            const int index = metaModel.shard(value);
+            if (!shards.contains(index))
+                shards << index;
+        }
+        std::sort(shards.begin(), shards.end());
+        return shards;
+    }
+
+    for (int i = 0; i < NOrmDatabase::shardCount(); ++i)
+        shards << i;
+    return shards;
+}
+
 bool NOrmQuerySetPrivate::sqlDelete() {
     // DELETE on an empty queryset doesn't need a query
     if (whereClause.isNone())
@@ -243,10 +852,32 @@ bool NOrmQuerySetPrivate::sqlDelete() {
     if (lowMark || highMark)
         return false;
 
+    // a sharded set is deleted shard by shard
+    if (shard < 0) {
+        const QList<int> shards = targetShards();
+        if (!shards.isEmpty()) {
+            foreach (int index, shards) {
+                NOrmQuerySetPrivate part(m_modelName);
+                part.whereClause = whereClause;
+                part.shard = index;
+                if (!part.sqlDelete())
+                    return false;
+            }
+
+            // invalidate cache
+            if (hasResults) {
+                properties.clear();
+                hasResults = false;
+            }
+            return true;
+        }
+    }
+
     // execute query
     NOrmQuery query(deleteQuery());
     if (!query.exec())
         return false;
+    NOrmDatabase::markWrite();
 
     // invalidate cache
     if (hasResults) {
@@ -260,12 +891,25 @@ bool NOrmQuerySetPrivate::sqlFetch() {
     if (hasResults || whereClause.isNone())
         return true;
 
+    // a sharded set that is not restricted to one shard reads all of them
+    const QList<int> shards = targetShards();
+    if (shards.size() > 1 && !windows.isEmpty()) {
+        qWarning("NOrmQuerySet cannot compute window functions across shards");
+        return false;
+    }
+    if (shards.size() > 1)
+        return sqlFetchShards(shards);
+
+    // reads go to a replica unless routing keeps them on the primary
+    NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+
     // execute query
-    NOrmQuery query(selectQuery());
+    NOrmQuery query(selectQuery(readDatabase.database()));
     if (!query.exec())
         return false;
 
     // store results
+    NOrmSpanScope span(NOrmSpan::Fetch, QString::fromLatin1(m_modelName));
     while (query.next()) {
         QVariantList props;
         const int propCount = query.record().count();
@@ -273,113 +917,1035 @@ bool NOrmQuerySetPrivate::sqlFetch() {
             props << query.value(i);
         properties.append(props);
     }
+    span.setRows(properties.size());
     hasResults = true;
     return true;
 }
 
-bool NOrmQuerySetPrivate::sqlInsert(const QVariantMap& fields, QVariant* insertId) {
-    // execute query
-    NOrmQuery query(insertQuery(fields));
-    if (!query.exec())
-        return false;
-
-    // fetch autoincrement pk
-    if (insertId) {
-        QSqlDatabase db = NOrm::database();
-        NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
-
-        if (databaseType == NOrmDatabase::PostgreSQL) {
-            const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
-            NOrmQuery query(db);
-            const NOrmMetaField primaryKey = metaModel.localField("pk");
-            const QString seqName = db.driver()->escapeIdentifier(
-                        metaModel.table() + QLatin1Char('_') + primaryKey.column() + QLatin1String("_seq"),
-                        QSqlDriver::FieldName);
-            if (!query.exec(QLatin1String("SELECT CURRVAL('") + seqName + QLatin1String("')")) || !query.next())
-                return false;
-            *insertId = query.value(0);
-        } else if (databaseType == NOrmDatabase::DaMeng) {
-            const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
-            NOrmQuery query(db);
-            if (!query.exec(QLatin1String("SELECT IDENT_CURRENT('") + metaModel.table() + QLatin1String("')")) || !query.next())
-                return false;
-            *insertId = query.value(0);
-        } else {
-            *insertId = query.lastInsertId();
+/** Fetches the rows of the set, which is a page of a larger set, and
+    returns the number of rows of the larger set, or -1 on error. Databases
+    with window functions count in the same statement with COUNT(*) OVER (),
+    elsewhere the count runs on another connection while the page is read.
+    With \a estimate the count is estimated by the database unless the
+    estimate is below NOrm::countEstimateThreshold(), \a estimated is then
+    set.
+ */
+qint64 NOrmQuerySetPrivate::sqlFetchPage(bool estimate, bool* estimated) {
+    *estimated = false;
+    if (estimate) {
+        const qint64 total = estimatedRows();
+        if (total >= 0 && total >= NOrm::countEstimateThreshold()) {
+            *estimated = true;
+            return sqlFetch() ? total : -1;
         }
     }
 
-    // invalidate cache
-    if (hasResults) {
-        properties.clear();
-        hasResults = false;
+    // the window is computed before the range is applied
+    if (!hasResults && !distinct && qualifyClause.isAll() && targetShards().size() <= 1
+            && NOrmDatabase::hasWindowFunctions(NOrm::database())) {
+        windows << NOrmWindow(QString(), NOrmWindow::Count, QLatin1String("*"));
+        const bool ok = sqlFetch();
+        windows.removeLast();
+        if (!ok)
+            return -1;
+
+        const qint64 total = properties.isEmpty() ? 0 : properties.first().last().toLongLong();
+        for (int i = 0; i < properties.size(); ++i)
+            properties[i].removeLast();
+
+        // a page past the last row has no row to carry the count
+        if (properties.isEmpty() && lowMark > 0)
+            return sqlCount();
+        return total;
     }
 
-    return true;
+    // a count on another connection does not see an in-memory database nor
+    // the rows of a transaction opened by NOrm
+    const QList<int> shards = targetShards();
+    const QSqlDatabase db = shards.size() == 1 ? NOrmDatabase::shardDatabase(shards.first()) : NOrm::database();
+    if (shards.size() > 1 || NOrmDatabase::isInMemory(db) || NOrmDatabase::inTransaction())
+        return sqlFetch() ? sqlCount() : -1;
+
+    QFuture<qint64> count = QtConcurrent::run([this]() {
+        return sqlCount();
+    });
+    const bool ok = sqlFetch();
+    const qint64 total = count.result();
+    return ok ? total : -1;
 }
 
-bool NOrmQuerySetPrivate::sqlLoad(QObject* model, int index) {
-    if (!sqlFetch())
-        return false;
-
-    if (index < 0 || index >= properties.size()) {
-        qWarning("NOrmQuerySet out of bounds");
-        return false;
+/** Returns the number of rows of the set without its range, or -1 on error.
+ */
+qint64 NOrmQuerySetPrivate::sqlCount() const {
+    NOrmQuerySetPrivate part(m_modelName);
+    part.whereClause = whereClause;
+    part.databaseAlias = databaseAlias;
+    part.shard = shard;
+
+    // rows filtered on windows are counted over the windowed subquery
+    if (!qualifyClause.isAll()) {
+        part.windows = windows;
+        part.qualifyClause = qualifyClause;
+        part.distinct = distinct;
+        part.selectRelated = selectRelated;
+        part.relatedFields = relatedFields;
+        return part.sqlQualifyCount();
     }
 
-    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
-    int pos = 0;
-    metaModel.load(model, properties.at(index), pos, this->relatedFields);
-    return true;
+    // rows repeated by joins are counted once
+    const QVariant count = distinct ? part.sqlAggregate(NOrmWhere::COUNT_DISTINCT, QLatin1String("pk"))
+                                    : part.sqlAggregate(NOrmWhere::COUNT, QLatin1String("*"));
+    return count.isValid() ? count.toLongLong() : -1;
 }
 
-static QString aggregationToString(NOrmWhere::AggregateType type) {
-    switch (type) {
-    case NOrmWhere::AVG:
-        return QLatin1String("AVG");
-    case NOrmWhere::COUNT:
-        return QLatin1String("COUNT");
-    case NOrmWhere::SUM:
-        return QLatin1String("SUM");
-    case NOrmWhere::MIN:
-        return QLatin1String("MIN");
-    case NOrmWhere::MAX:
-        return QLatin1String("MAX");
+/** Returns the number of rows of a set filtered on window functions, or -1
+    on error. The database counts the rows of the windowed subquery, so
+    that they are not fetched.
+ */
+qint64 NOrmQuerySetPrivate::sqlQualifyCount() const {
+    const QList<int> shards = targetShards();
+    if (shards.size() > 1) {
+        qWarning("NOrmQuerySet cannot compute window functions across shards");
+        return -1;
     }
-    return QString();
-}
-
-NOrmQuery NOrmQuerySetPrivate::aggregateQuery(const NOrmWhere::AggregateType func, const QString& field) const {
-    QSqlDatabase db = NOrm::database();
 
-    // build query
-    NOrmCompiler compiler(m_modelName, db);
-    NOrmWhere resolvedWhere(whereClause);
-    compiler.resolve(resolvedWhere);
+    NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+    NOrmQuery query(qualifyCountQuery(readDatabase.database()));
+    if (!query.exec() || !query.next())
+        return -1;
+    return query.value(0).toLongLong();
+}
 
-    const QString where = resolvedWhere.sql(db);
-    const QString limit = compiler.orderLimitSql(QStringList(), lowMark, highMark);
+/** Returns the number of rows of the set estimated by the database, or an
+    exact count if the estimate is below NOrm::countEstimateThreshold().
+ */
+qint64 NOrmQuerySetPrivate::sqlEstimatedCount() const {
+    qint64 rows = estimatedRows();
+    if (rows < 0 || rows < NOrm::countEstimateThreshold())
+        rows = sqlCount();
+    if (rows < 0)
+        return rows;
+
+    rows = qMax<qint64>(0, rows - lowMark);
+    if (highMark > 0)
+        rows = qMin<qint64>(rows, highMark - lowMark);
+    return rows;
+}
 
-    QString sql =
-            QLatin1String("SELECT ") + aggregationToString(func) + "(" + field + ") " + "FROM " + compiler.fromSql();
-    if (!where.isEmpty())
-        sql += QLatin1String(" WHERE ") + where;
-    sql += limit;
-    NOrmQuery query(db);
-    query.prepare(sql);
-    resolvedWhere.bindValues(query);
-    return query;
+/** Returns the number of rows of the set without its range estimated from
+    the table statistics if it is unfiltered, or by the query planner
+    otherwise. Returns -1 if the database gives no estimate.
+ */
+qint64 NOrmQuerySetPrivate::estimatedRows() const {
+    if (!qualifyClause.isAll())
+        return -1;
+    return whereClause.isAll() ? statisticsRows() : plannedRows();
 }
 
-/** Returns the SQL query to perform a DELETE on the current set.
+/** Returns the number of rows of the table according to the statistics of
+    the database, or -1 if it keeps no such statistics.
  */
-NOrmQuery NOrmQuerySetPrivate::deleteQuery() const {
-    QSqlDatabase db = NOrm::database();
+qint64 NOrmQuerySetPrivate::statisticsRows() const {
+    const QList<int> shards = targetShards();
+    if (shards.size() > 1)
+        return -1;
+
+    NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+    QSqlDatabase db = readDatabase.database();
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    QString table = db.driver()->escapeIdentifier(metaModel.table(), QSqlDriver::TableName);
+
+    QString sql;
+    switch (NOrmDatabase::databaseType(db)) {
+    case NOrmDatabase::PostgreSQL:
+        // -1 until the table has been analyzed
+        sql = QLatin1String("SELECT reltuples::bigint FROM pg_class WHERE oid = to_regclass(?)");
+        break;
+    case NOrmDatabase::MySqlServer:
+        sql = QLatin1String("SELECT TABLE_ROWS FROM information_schema.TABLES WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = ?");
+        table = metaModel.table();
+        break;
+    case NOrmDatabase::MSSqlServer:
+        sql = QLatin1String("SELECT SUM(row_count) FROM sys.dm_db_partition_stats WHERE object_id = OBJECT_ID(?) AND index_id < 2");
+        break;
+    case NOrmDatabase::SQLite:
+        // sqlite_stat1 exists once ANALYZE has run, every stat starts with the row count
+        sql = QLatin1String("SELECT stat FROM sqlite_stat1 WHERE tbl = ? ORDER BY idx IS NOT NULL LIMIT 1");
+        table = metaModel.table();
+        break;
+    default:
+        return -1;
+    }
+
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    query.addBindValue(table);
+    if (!query.exec() || !query.next() || query.value(0).isNull())
+        return -1;
+    bool ok = false;
+    const qint64 rows = query.value(0).toString().section(QLatin1Char(' '), 0, 0).toLongLong(&ok);
+    return (ok && rows >= 0) ? rows : -1;
+}
+
+/** Returns the number of distinct values of \a field estimated by the
+    database, or an exact COUNT(DISTINCT) if there is no estimate or it is
+    below NOrm::countEstimateThreshold(). The range is ignored.
+ */
+qint64 NOrmQuerySetPrivate::sqlEstimatedDistinctCount(const QString& field) const {
+    NOrmQuerySetPrivate part(m_modelName);
+    part.whereClause = whereClause;
+    part.databaseAlias = databaseAlias;
+    part.shard = shard;
+
+    qint64 rows = whereClause.isAll() ? statisticsDistinctRows(field) : -1;
+    const QList<int> shards = targetShards();
+    if (rows < 0 && shards.size() <= 1) {
+        // SQL Server and Oracle estimate over any filter
+        NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+        QSqlDatabase db = readDatabase.database();
+        const NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+        if (databaseType == NOrmDatabase::MSSqlServer || databaseType == NOrmDatabase::Oracle) {
+            NOrmQuery query(part.aggregateQuery(db, NOrmWhere::COUNT_DISTINCT, field, true));
+            if (query.exec() && query.next() && !query.value(0).isNull())
+                rows = query.value(0).toLongLong();
+        }
+    }
+    if (rows >= 0 && rows >= NOrm::countEstimateThreshold())
+        return rows;
+
+    const QVariant count = part.sqlAggregate(NOrmWhere::COUNT_DISTINCT, field);
+    return count.isValid() ? count.toLongLong() : -1;
+}
+
+/** Returns the number of distinct values of the local \a field according
+    to the statistics of the database, or -1 if it keeps no such statistics.
+ */
+qint64 NOrmQuerySetPrivate::statisticsDistinctRows(const QString& field) const {
+    const QList<int> shards = targetShards();
+    if (shards.size() > 1 || field.contains(QLatin1String("__")))
+        return -1;
+
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    const QString column = metaModel.localField(field.toLatin1()).column();
+    if (column.isEmpty())
+        return -1;
+
+    NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+    QSqlDatabase db = readDatabase.database();
+    QString sql;
+    switch (NOrmDatabase::databaseType(db)) {
+    case NOrmDatabase::PostgreSQL:
+        // a negative n_distinct is a fraction of the rows
+        sql = QLatin1String("SELECT (CASE WHEN s.n_distinct >= 0 THEN s.n_distinct ELSE -s.n_distinct * c.reltuples END)::bigint"
+                            " FROM pg_stats s JOIN pg_namespace n ON n.nspname = s.schemaname"
+                            " JOIN pg_class c ON c.relnamespace = n.oid AND c.relname = s.tablename"
+                            " WHERE s.tablename = ? AND s.attname = ? AND s.schemaname = ANY(current_schemas(false))");
+        break;
+    case NOrmDatabase::MySqlServer:
+        // the cardinality of an index is kept for each prefix of its columns
+        sql = QLatin1String("SELECT MAX(CARDINALITY) FROM information_schema.STATISTICS"
+                            " WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = ? AND COLUMN_NAME = ? AND SEQ_IN_INDEX = 1");
+        break;
+    default:
+        return -1;
+    }
+
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    query.addBindValue(metaModel.table());
+    query.addBindValue(column);
+    if (!query.exec() || !query.next() || query.value(0).isNull())
+        return -1;
+    const qint64 rows = query.value(0).toLongLong();
+    return rows >= 0 ? rows : -1;
+}
+
+/** Replaces the positional placeholders of \a sql, outside of string
+    literals, with the values bound to \a values.
+ */
+static QString inlineValues(const QString& sql, const QSqlQuery& values, QSqlDriver* driver) {
+    QString inlined;
+    const int count = values.boundValues().size();
+    int pos = 0;
+    bool quoted = false;
+    foreach (const QChar& c, sql) {
+        if (c == QLatin1Char('\''))
+            quoted = !quoted;
+        if (c == QLatin1Char('?') && !quoted && pos < count) {
+            const QVariant value = values.boundValue(pos++);
+            QSqlField field(QString(), value.type());
+            field.setValue(value);
+            inlined += driver->formatValue(field);
+        } else {
+            inlined += c;
+        }
+    }
+    return inlined;
+}
+
+/** Returns the number of rows of the set estimated by the query planner,
+    or -1 if the database gives no estimate. The range is ignored.
+ */
+qint64 NOrmQuerySetPrivate::plannedRows() const {
+    const QList<int> shards = targetShards();
+    if (shards.size() > 1)
+        return -1;
+
+    NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+    QSqlDatabase db = readDatabase.database();
+    const NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+    if (databaseType != NOrmDatabase::PostgreSQL && databaseType != NOrmDatabase::MySqlServer)
+        return -1;
 
     // build query
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
     NOrmCompiler compiler(m_modelName, db);
     NOrmWhere resolvedWhere(whereClause);
-    compiler.resolve(resolvedWhere);
+    if (!compiler.resolve(resolvedWhere))
+        return -1;
+
+    const QString where = resolvedWhere.sql(db);
+    QString sql = QLatin1String("SELECT 1 FROM ") + compiler.fromSql();
+    if (!where.isEmpty())
+        sql += QLatin1String(" WHERE ") + where;
+    span.setSql(sql);
+    span.finish();
+
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    if (databaseType == NOrmDatabase::PostgreSQL) {
+        // an EXPLAIN cannot be prepared, the values are inlined
+        NOrmQuery values(db);
+        resolvedWhere.bindValues(values);
+        if (!query.exec(QLatin1String("EXPLAIN ") + inlineValues(sql, values, db.driver())) || !query.next())
+            return -1;
+
+        // the first line is the top node of the plan: "... (cost=0.00..35.50 rows=2550 width=4)"
+        QRegExp rows(QLatin1String("rows=(\\d+)"));
+        return rows.indexIn(query.value(0).toString()) >= 0 ? rows.cap(1).toLongLong() : -1;
+    }
+
+    query.prepare(QLatin1String("EXPLAIN ") + sql);
+    resolvedWhere.bindValues(query);
+    if (!query.exec() || !query.next())
+        return -1;
+
+    // the rows examined in the first table, times the percentage kept by the filter
+    const QSqlRecord record = query.record();
+    if (record.indexOf(QLatin1String("rows")) < 0 || query.value(record.indexOf(QLatin1String("rows"))).isNull())
+        return -1;
+    const qint64 rows = query.value(record.indexOf(QLatin1String("rows"))).toLongLong();
+    const int filtered = record.indexOf(QLatin1String("filtered"));
+    return filtered >= 0 ? qint64(rows * query.value(filtered).toDouble() / 100) : rows;
+}
+
+bool NOrmQuerySetPrivate::sqlInsert(const QVariantMap& fields, QVariant* insertId) {
+    // a sharded row goes to the shard of its key
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    if (shard < 0 && metaModel.isSharded()) {
+        NOrmQuerySetPrivate part(m_modelName);
+        part.shard = metaModel.shard(fields.value(QString::fromLatin1(metaModel.shardKey())));
+        if (!part.sqlInsert(fields, insertId))
+            return false;
+
+        // invalidate cache
+        if (hasResults) {
+            properties.clear();
+            hasResults = false;
+        }
+        return true;
+    }
+
+    QSqlDatabase db = writeDatabase();
+    const bool returning = insertId && NOrmDatabase::hasInsertReturning(db);
+
+    // execute query
+    NOrmQuery query(insertQuery(fields, returning));
+    if (!query.exec())
+        return false;
+    NOrmDatabase::markWrite();
+
+    // fetch autoincrement pk
+    if (insertId) {
+        if (returning) {
+            if (!query.next())
+                return false;
+            *insertId = query.value(0);
+        } else if (NOrmDatabase::databaseType(db) == NOrmDatabase::DaMeng) {
+            // unlike IDENT_CURRENT, SCOPE_IDENTITY is bound to the current session
+            NOrmQuery identityQuery(db);
+            if (!identityQuery.exec(QLatin1String("SELECT SCOPE_IDENTITY()")) || !identityQuery.next())
+                return false;
+            *insertId = identityQuery.value(0);
+        } else {
+            *insertId = query.lastInsertId();
+        }
+    }
+
+    // invalidate cache
+    if (hasResults) {
+        properties.clear();
+        hasResults = false;
+    }
+
+    return true;
+}
+
+/** Inserts all \a rows using multi-row INSERTs. Every row must contain the
+    same set of fields. If \a insertIds is given, the generated primary keys
+    are appended to it in the order of \a rows.
+ */
+bool NOrmQuerySetPrivate::sqlBulkInsert(const QList<QVariantMap>& rows, QVariantList* insertIds) {
+    if (rows.isEmpty())
+        return true;
+
+    // sharded rows are grouped by shard, the keys are reported in the order of rows
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    if (shard < 0 && metaModel.isSharded()) {
+        const QString shardKey = QString::fromLatin1(metaModel.shardKey());
+        QMap<int, QList<int> > groups;
+        for (int i = 0; i < rows.size(); ++i)
+            groups[metaModel.shard(rows.at(i).value(shardKey))] << i;
+
+        QVariantList ids;
+        if (insertIds) {
+            for (int i = 0; i < rows.size(); ++i)
+                ids << QVariant();
+        }
+        QMap<int, QList<int> >::const_iterator group;
+        for (group = groups.constBegin(); group != groups.constEnd(); ++group) {
+            QList<QVariantMap> partRows;
+            foreach (int pos, group.value())
+                partRows << rows.at(pos);
+
+            NOrmQuerySetPrivate part(m_modelName);
+            part.shard = group.key();
+            QVariantList partIds;
+            if (!part.sqlBulkInsert(partRows, insertIds ? &partIds : nullptr))
+                return false;
+            if (insertIds) {
+                if (partIds.size() != partRows.size())
+                    return false;
+                for (int j = 0; j < partIds.size(); ++j)
+                    ids[group.value().at(j)] = partIds.at(j);
+            }
+        }
+        if (insertIds)
+            *insertIds << ids;
+
+        // invalidate cache
+        if (hasResults) {
+            properties.clear();
+            hasResults = false;
+        }
+        return true;
+    }
+
+    QSqlDatabase db = writeDatabase();
+    const NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+    const int idStep = NOrmDatabase::insertIdStep(db);
+
+    // the order of RETURNING rows is unspecified, only the OUTPUT clause of
+    // MSSQL can report the ordinal of the row together with its key
+    const bool returning = insertIds && databaseType == NOrmDatabase::MSSqlServer
+            && NOrmDatabase::hasInsertReturning(db);
+
+    // PostgreSQL keys are drawn from the sequence and inserted explicitly
+    const NOrmMetaField primaryKey = metaModel.localField("pk");
+    QList<QVariantMap> keyedRows;
+    if (insertIds && databaseType == NOrmDatabase::PostgreSQL) {
+        NOrmQuery keyQuery(db);
+        if (keyQuery.exec(QString::fromLatin1("SELECT nextval(pg_get_serial_sequence('%1', '%2')) FROM generate_series(1, %3)")
+                          .arg(metaModel.table(), primaryKey.column()).arg(rows.size()))) {
+            QVariantList keys;
+            while (keyQuery.next() && !keyQuery.value(0).isNull())
+                keys << keyQuery.value(0);
+            if (keys.size() == rows.size()) {
+                for (int i = 0; i < rows.size(); ++i) {
+                    QVariantMap row = rows.at(i);
+                    row.insert(primaryKey.name(), keys.at(i));
+                    keyedRows << row;
+                }
+            }
+        }
+    }
+    const bool reserved = !keyedRows.isEmpty();
+
+    // without ordered keys, every key needs its own INSERT
+    if (insertIds && !returning && !reserved && !idStep) {
+        NOrmDiagnosticsBatch batch;
+        foreach (const QVariantMap& row, rows) {
+            QVariant insertId;
+            if (!sqlInsert(row, &insertId))
+                return false;
+            *insertIds << insertId;
+        }
+        return true;
+    }
+
+    // stay below the bind value limit of the driver
+    const QList<QVariantMap>& insertRows = reserved ? keyedRows : rows;
+    int step = NOrmDatabase::maxBindValues(db) / qMax(1, insertRows.first().size());
+    step = qBound(1, step, maxRowsPerInsert);
+    for (int i = 0; i < insertRows.size(); i += step) {
+        const QList<QVariantMap> chunk = insertRows.mid(i, step);
+
+        // execute query
+        NOrmQuery query(bulkInsertQuery(chunk, returning));
+        if (!query.exec())
+            return false;
+        NOrmDatabase::markWrite();
+
+        if (reserved) {
+            foreach (const QVariantMap& row, chunk)
+                *insertIds << row.value(primaryKey.name());
+        } else if (returning) {
+            // every key is matched to its row by the reported ordinal
+            QVariantList keys;
+            for (int j = 0; j < chunk.size(); ++j)
+                keys << QVariant();
+            int count = 0;
+            while (query.next()) {
+                const int pos = query.value(1).toInt();
+                if (pos < 0 || pos >= chunk.size() || !keys.at(pos).isNull())
+                    return false;
+                keys[pos] = query.value(0);
+                ++count;
+            }
+            if (count != chunk.size())
+                return false;
+            *insertIds << keys;
+        } else if (insertIds) {
+            // MySQL reports the first key of a multi-row INSERT
+            const qlonglong firstId = query.lastInsertId().toLongLong();
+            for (int j = 0; j < chunk.size(); ++j)
+                *insertIds << firstId + j * idStep;
+        }
+    }
+
+    // invalidate cache
+    if (hasResults) {
+        properties.clear();
+        hasResults = false;
+    }
+
+    return true;
+}
+
+/** Inserts all \a models with multi-row INSERTs and stores the generated
+    primary keys back into them.
+ */
+bool NOrmQuerySetPrivate::sqlBulkCreate(const QList<QObject*>& models) {
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+
+    // prepare data
+    QList<QVariantMap> rows;
+    foreach (QObject* model, models) {
+        QVariantMap fields;
+        foreach (const NOrmMetaField& field, metaModel.localFields()) {
+            if (!field.isAutoIncrement()) {
+                const QVariant value = model->property(field.name().toLatin1());
+                fields.insert(field.name(), field.toDatabase(value));
+            }
+        }
+        rows << fields;
+    }
+
+    // perform INSERT
+    if (!metaModel.localField("pk").isAutoIncrement())
+        return sqlBulkInsert(rows);
+
+    QVariantList insertIds;
+    if (!sqlBulkInsert(rows, &insertIds) || insertIds.size() != models.size())
+        return false;
+    for (int i = 0; i < models.size(); ++i)
+        models.at(i)->setProperty(metaModel.primaryKey(), insertIds.at(i));
+    return true;
+}
+
+/** Inserts \a rows, updating the rows which already exist with the same
+    \a conflictFields. Backends without an upsert statement update each row
+    and insert it when no row was updated.
+ */
+bool NOrmQuerySetPrivate::sqlBulkUpsert(const QList<QVariantMap>& rows, const QStringList& conflictFields) {
+    if (rows.isEmpty())
+        return true;
+
+    // sharded rows are grouped by shard
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    if (shard < 0 && metaModel.isSharded()) {
+        const QString shardKey = QString::fromLatin1(metaModel.shardKey());
+        QMap<int, QList<QVariantMap> > groups;
+        foreach (const QVariantMap& row, rows)
+            groups[metaModel.shard(row.value(shardKey))] << row;
+
+        QMap<int, QList<QVariantMap> >::const_iterator group;
+        for (group = groups.constBegin(); group != groups.constEnd(); ++group) {
+            NOrmQuerySetPrivate part(m_modelName);
+            part.shard = group.key();
+            if (!part.sqlBulkUpsert(group.value(), conflictFields))
+                return false;
+        }
+        return true;
+    }
+
+    QSqlDatabase db = writeDatabase();
+    const NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+    if (databaseType != NOrmDatabase::SQLite && databaseType != NOrmDatabase::PostgreSQL
+            && databaseType != NOrmDatabase::MySqlServer) {
+        NOrmDiagnosticsBatch batch;
+        foreach (const QVariantMap& row, rows) {
+            NOrmQuerySetPrivate existing(m_modelName);
+            existing.shard = shard;
+            existing.databaseAlias = QLatin1String("primary");
+            foreach (const QString& name, conflictFields)
+                existing.addFilter(NOrmWhere(name, NOrmWhere::Equals, row.value(name)));
+            QVariantMap fields(row);
+            foreach (const QString& name, conflictFields)
+                fields.remove(name);
+
+            const int updated = fields.isEmpty() ? existing.sqlAggregate(NOrmWhere::COUNT, QLatin1String("*")).toInt()
+                                                 : existing.sqlUpdate(fields);
+            if (updated < 0 || (!updated && !sqlInsert(row)))
+                return false;
+        }
+        return true;
+    }
+
+    // stay below the bind value limit of the driver
+    int step = NOrmDatabase::maxBindValues(db) / qMax(1, rows.first().size());
+    step = qBound(1, step, maxRowsPerInsert);
+    for (int i = 0; i < rows.size(); i += step) {
+        NOrmQuery query(bulkUpsertQuery(rows.mid(i, step), conflictFields));
+        if (!query.exec())
+            return false;
+        NOrmDatabase::markWrite();
+    }
+
+    // invalidate cache
+    if (hasResults) {
+        properties.clear();
+        hasResults = false;
+    }
+    return true;
+}
+
+template <class T>
+static int compareOrdered(const T& a, const T& b) {
+    return a < b ? -1 : (b < a ? 1 : 0);
+}
+
+// orders values the way the database does, NULL first
+static int compareValues(const QVariant& a, const QVariant& b) {
+    if (a.isNull() || b.isNull())
+        return int(b.isNull()) - int(a.isNull());
+
+    switch (a.type()) {
+    case QVariant::Bool:
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+    case QVariant::ULongLong:
+    case QVariant::Double:
+        return compareOrdered(a.toDouble(), b.toDouble());
+    case QVariant::Date:
+        return compareOrdered(a.toDate(), b.toDate());
+    case QVariant::Time:
+        return compareOrdered(a.toTime(), b.toTime());
+    case QVariant::DateTime:
+        return compareOrdered(a.toDateTime(), b.toDateTime());
+    default:
+        return QString::compare(a.toString(), b.toString());
+    }
+}
+
+/** Returns true if \a shards can be read from pool threads. Each pool
+    thread uses its own connection to the shard, which does not see an
+    in-memory database nor the rows of a transaction opened by NOrm.
+ */
+static bool readShardsInParallel(const QList<int>& shards) {
+    if (NOrmDatabase::inTransaction())
+        return false;
+    foreach (int index, shards) {
+        if (NOrmDatabase::isInMemory(NOrmDatabase::shardDatabase(index)))
+            return false;
+    }
+    return true;
+}
+
+/** Fetches the set from all \a shards in parallel and merges the rows,
+    keeping the order requested with orderBy.
+ */
+bool NOrmQuerySetPrivate::sqlFetchShards(const QList<int>& shards) {
+    // positions of the ordering fields, local fields come first in every row
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    const QList<NOrmMetaField> localFields = metaModel.localFields();
+    QList<QPair<int, bool> > keys;
+    foreach (const QString& key, orderBy) {
+        const bool descending = key.startsWith(QLatin1Char('-'));
+        QString name = (descending || key.startsWith(QLatin1Char('+'))) ? key.mid(1) : key;
+        if (name == QLatin1String("pk"))
+            name = QString::fromLatin1(metaModel.primaryKey());
+
+        int pos = localFields.size() - 1;
+        while (pos >= 0 && localFields.at(pos).name() != name)
+            --pos;
+        if (pos < 0) {
+            qWarning("NOrmQuerySet cannot merge shards ordered by '%s'", qPrintable(key));
+            return false;
+        }
+        keys << qMakePair(pos, descending);
+    }
+
+    // every shard returns its first highMark rows, the offset is applied after merging
+    QList<NOrmQuerySetPrivate*> parts;
+    foreach (int index, shards) {
+        NOrmQuerySetPrivate* part = new NOrmQuerySetPrivate(m_modelName);
+        part->whereClause = whereClause;
+        part->orderBy = orderBy;
+        part->highMark = highMark;
+        part->selectRelated = selectRelated;
+        part->relatedFields = relatedFields;
+        part->shard = index;
+        parts << part;
+    }
+
+    if (readShardsInParallel(shards)) {
+        QtConcurrent::blockingMap(parts, [](NOrmQuerySetPrivate* part) { part->sqlFetch(); });
+    } else {
+        foreach (NOrmQuerySetPrivate* part, parts)
+            part->sqlFetch();
+    }
+
+    QList<QList<QVariantList> > results;
+    bool ok = true;
+    foreach (NOrmQuerySetPrivate* part, parts) {
+        ok = ok && part->hasResults;
+        results << part->properties;
+    }
+    qDeleteAll(parts);
+    if (!ok)
+        return false;
+
+    // merge the sorted rows of every shard
+    QVector<int> heads(results.size(), 0);
+    while (highMark <= 0 || properties.size() < highMark) {
+        int best = -1;
+        for (int i = 0; i < results.size(); ++i) {
+            if (heads.at(i) >= results.at(i).size())
+                continue;
+            if (best < 0) {
+                best = i;
+                continue;
+            }
+
+            const QVariantList& row = results.at(i).at(heads.at(i));
+            const QVariantList& bestRow = results.at(best).at(heads.at(best));
+            for (int k = 0; k < keys.size(); ++k) {
+                const int cmp = compareValues(row.at(keys.at(k).first), bestRow.at(keys.at(k).first));
+                if (cmp) {
+                    if ((cmp < 0) != keys.at(k).second)
+                        best = i;
+                    break;
+                }
+            }
+        }
+        if (best < 0)
+            break;
+        properties << results.at(best).at(heads[best]++);
+    }
+    if (lowMark > 0)
+        properties = properties.mid(lowMark);
+
+    hasResults = true;
+    return true;
+}
+
+/** Performs the aggregate \a func on \a field on all \a shards in parallel
+    and combines the results.
+ */
+QVariant NOrmQuerySetPrivate::sqlAggregateShards(const QList<int>& shards, const NOrmWhere::AggregateType func, const QString& field) const {
+    // a value can be on several shards
+    if (func == NOrmWhere::COUNT_DISTINCT) {
+        qWarning("NOrmQuerySet cannot combine a distinct count across shards");
+        return QVariant();
+    }
+
+    // only the number of rows of a limited set can be derived from the shards
+    if ((lowMark || highMark) && func != NOrmWhere::COUNT) {
+        qWarning("NOrmQuerySet cannot combine a limited aggregate across shards");
+        return QVariant();
+    }
+
+    QList<NOrmQuerySetPrivate*> parts;
+    foreach (int index, shards) {
+        NOrmQuerySetPrivate* part = new NOrmQuerySetPrivate(m_modelName);
+        part->whereClause = whereClause;
+        part->shard = index;
+        parts << part;
+    }
+
+    // AVG is combined from the SUM and COUNT of every shard
+    const bool average = func == NOrmWhere::AVG;
+    QVector<QVariant> values(parts.size());
+    QVector<QVariant> counts(parts.size());
+    QVariant* valueData = values.data();
+    QVariant* countData = counts.data();
+    QList<int> positions;
+    for (int i = 0; i < parts.size(); ++i)
+        positions << i;
+    const auto aggregatePart = [&](int i) {
+        valueData[i] = parts.at(i)->sqlAggregate(average ? NOrmWhere::SUM : func, field);
+        if (average)
+            countData[i] = parts.at(i)->sqlAggregate(NOrmWhere::COUNT, field);
+    };
+    if (readShardsInParallel(shards)) {
+        QtConcurrent::blockingMap(positions, aggregatePart);
+    } else {
+        foreach (int i, positions)
+            aggregatePart(i);
+    }
+    qDeleteAll(parts);
+
+    // an invalid value means the query failed, NULL means no rows
+    QVariant result;
+    qlonglong intSum = 0;
+    double doubleSum = 0;
+    qlonglong count = 0;
+    bool isDouble = false;
+    for (int i = 0; i < values.size(); ++i) {
+        if (!values.at(i).isValid() || (average && !counts.at(i).isValid()))
+            return QVariant();
+        count += counts.at(i).toLongLong();
+        if (values.at(i).isNull())
+            continue;
+
+        switch (func) {
+        case NOrmWhere::MIN:
+            if (result.isNull() || compareValues(values.at(i), result) < 0)
+                result = values.at(i);
+            break;
+        case NOrmWhere::MAX:
+            if (result.isNull() || compareValues(values.at(i), result) > 0)
+                result = values.at(i);
+            break;
+        default:
+            isDouble = isDouble || values.at(i).type() == QVariant::Double;
+            intSum += values.at(i).toLongLong();
+            doubleSum += values.at(i).toDouble();
+            result = values.at(i);
+            break;
+        }
+    }
+
+    switch (func) {
+    case NOrmWhere::MIN:
+    case NOrmWhere::MAX:
+        return result.isValid() ? result : values.first();
+    case NOrmWhere::AVG:
+        return count ? QVariant(doubleSum / count) : QVariant(QVariant::Double);
+    case NOrmWhere::COUNT:
+        intSum = qMax<qlonglong>(0, intSum - lowMark);
+        if (highMark > 0)
+            intSum = qMin<qlonglong>(intSum, highMark - lowMark);
+        return intSum;
+    case NOrmWhere::SUM:
+        if (result.isNull())
+            return values.first();
+        return isDouble ? QVariant(doubleSum) : QVariant(intSum);
+    case NOrmWhere::COUNT_DISTINCT:
+        break;
+    }
+    return QVariant();
+}
+
+bool NOrmQuerySetPrivate::sqlLoad(QObject* model, int index) {
+    if (!sqlFetch())
+        return false;
+
+    if (index < 0 || index >= properties.size()) {
+        qWarning("NOrmQuerySet out of bounds");
+        return false;
+    }
+
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    int pos = 0;
+    metaModel.load(model, properties.at(index), pos, this->relatedFields);
+    return true;
+}
+
+/** Performs the aggregate \a func on \a field, on a replica if one is
+    available.
+ */
+QVariant NOrmQuerySetPrivate::sqlAggregate(const NOrmWhere::AggregateType func, const QString& field) const {
+    // a sharded set that is not restricted to one shard combines all of them
+    const QList<int> shards = targetShards();
+    if (shards.size() > 1)
+        return sqlAggregateShards(shards, func, field);
+
+    NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+
+    // execute query
+    NOrmQuery query(aggregateQuery(readDatabase.database(), func, field));
+    if (!query.exec() || !query.next())
+        return QVariant();
+    return query.value(0);
+}
+
+NOrmQuery NOrmQuerySetPrivate::aggregateQuery(const QSqlDatabase& db, const NOrmWhere::AggregateType func, const QString& field, bool approximate) const {
+    // build query
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
+    NOrmCompiler compiler(m_modelName, db);
+    NOrmWhere resolvedWhere(whereClause);
+    if (!compiler.resolve(resolvedWhere))
+        return NOrmQuery(db);
+
+    const QString where = resolvedWhere.sql(db);
+    const QString limit = compiler.orderLimitSql(QStringList(), lowMark, highMark);
+
+    const QString aggregate = compiler.aggregateSql(func, field, approximate);
+    QString sql = QLatin1String("SELECT ") + aggregate + QLatin1String(" FROM ") + compiler.fromSql();
+    if (!where.isEmpty())
+        sql += QLatin1String(" WHERE ") + where;
+    sql += limit;
+    span.setSql(sql);
+    span.finish();
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    resolvedWhere.bindValues(query);
+    return query;
+}
+
+/** Performs the \a aggregates on the set in a single statement, grouped by
+    the groupBy() fields, and returns one map per group holding the grouped
+    fields and the aggregates by name.
+ */
+QList<QVariantMap> NOrmQuerySetPrivate::sqlAggregates(const QList<NOrmAggregate>& aggregates) const {
+    QList<QVariantMap> rows;
+
+    // groups and HAVING clauses cannot be combined from per-shard results
+    const QList<int> shards = targetShards();
+    if (shards.size() > 1) {
+        qWarning("NOrmQuerySet cannot combine grouped aggregates across shards");
+        return rows;
+    }
+
+    NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+    NOrmQuery query(aggregatesQuery(readDatabase.database(), aggregates));
+    if (!query.exec())
+        return rows;
+
+    while (query.next()) {
+        QVariantMap row;
+        int pos = 0;
+        foreach (const QString& field, groupBy)
+            row.insert(field, query.value(pos++));
+        foreach (const NOrmAggregate& aggregate, aggregates)
+            row.insert(aggregate.name, query.value(pos++));
+        rows << row;
+    }
+    return rows;
+}
+
+NOrmQuery NOrmQuerySetPrivate::aggregatesQuery(const QSqlDatabase& db, const QList<NOrmAggregate>& aggregates) const {
+    // build query
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
+    NOrmCompiler compiler(m_modelName, db);
+    NOrmWhere resolvedWhere(whereClause);
+    if (!compiler.resolve(resolvedWhere))
+        return NOrmQuery(db);
+
+    // grouped columns come first, then the aggregates in order
+    QStringList columns = compiler.groupColumns(groupBy);
+    const QString group = columns.join(QLatin1String(", "));
+    foreach (const NOrmAggregate& aggregate, aggregates)
+        columns << compiler.annotate(aggregate);
+
+    // the HAVING clause refers to aggregates by name
+    NOrmWhere resolvedHaving(havingClause);
+    if (!compiler.resolve(resolvedHaving))
+        return NOrmQuery(db);
+
+    const QString where = resolvedWhere.sql(db);
+    const QString having = resolvedHaving.sql(db);
+    const QString limit = compiler.orderLimitSql(orderBy, lowMark, highMark);
+
+    QString sql = QLatin1String("SELECT ") + columns.join(QLatin1String(", ")) + QLatin1String(" FROM ") + compiler.fromSql();
+    if (!where.isEmpty())
+        sql += QLatin1String(" WHERE ") + where;
+    if (!group.isEmpty())
+        sql += QLatin1String(" GROUP BY ") + group;
+    if (!having.isEmpty())
+        sql += QLatin1String(" HAVING ") + having;
+    sql += limit;
+    span.setSql(sql);
+    span.finish();
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    resolvedWhere.bindValues(query);
+    resolvedHaving.bindValues(query);
+    return query;
+}
+
+/** Returns the SQL query to select the distinct values of \a fields, which
+    may follow foreign keys. PostgreSQL and SQL Server only order a DISTINCT
+    selection by selected columns, other orderings are dropped and a range
+    without ordering is ordered by the first field.
+ */
+NOrmQuery NOrmQuerySetPrivate::distinctValuesQuery(const QSqlDatabase& db, const QStringList& fields) const {
+    // build query
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
+    NOrmCompiler compiler(m_modelName, db);
+    NOrmWhere resolvedWhere(whereClause);
+    if (!compiler.resolve(resolvedWhere))
+        return NOrmQuery(db);
+
+    const QString primaryKey = QString::fromLatin1(NOrm::metaModel(m_modelName).primaryKey());
+    QStringList projected;
+    foreach (const QString& field, fields)
+        projected << (field == QLatin1String("pk") ? primaryKey : field);
+    QStringList order;
+    foreach (const QString& key, orderBy) {
+        QString name = (key.startsWith(QLatin1Char('-')) || key.startsWith(QLatin1Char('+'))) ? key.mid(1) : key;
+        if (name == QLatin1String("pk"))
+            name = primaryKey;
+        if (projected.contains(name))
+            order << key;
+    }
+    if (order.isEmpty() && (lowMark || highMark))
+        order << fields.first();
+
+    const QStringList columns = compiler.groupColumns(fields);
+    const QString where = resolvedWhere.sql(db);
+    const QString limit = compiler.orderLimitSql(order, lowMark, highMark);
+    QString sql = QLatin1String("SELECT DISTINCT ") + columns.join(QLatin1String(", ")) + QLatin1String(" FROM ") + compiler.fromSql();
+    if (!where.isEmpty())
+        sql += QLatin1String(" WHERE ") + where;
+    sql += limit;
+    span.setSql(sql);
+    span.finish();
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    resolvedWhere.bindValues(query);
+    return query;
+}
+
+/** Returns the SQL query to perform a DELETE on the current set.
+ */
+NOrmQuery NOrmQuerySetPrivate::deleteQuery() const {
+    QSqlDatabase db = writeDatabase();
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
+
+    // build query
+    NOrmCompiler compiler(m_modelName, db);
+    NOrmWhere resolvedWhere(whereClause);
+    if (!compiler.resolve(resolvedWhere))
+        return NOrmQuery(db);
 
     const QString where = resolvedWhere.sql(db);
     const QString limit = compiler.orderLimitSql(orderBy, lowMark, highMark);
@@ -387,18 +1953,33 @@ NOrmQuery NOrmQuerySetPrivate::deleteQuery() const {
     if (!where.isEmpty())
         sql += QLatin1String(" WHERE ") + where;
     sql += limit;
+    span.setSql(sql);
+    span.finish();
     NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
     query.prepare(sql);
     resolvedWhere.bindValues(query);
 
     return query;
 }
 
+/** Builds the clauses which make an INSERT return the generated primary key:
+    \a output goes before VALUES (MSSQL) and \a returning after it.
+ */
+static void returningSql(const QSqlDatabase& db, const NOrmMetaModel& metaModel, QString& output, QString& returning) {
+    const QString pkColumn = db.driver()->escapeIdentifier(metaModel.localField("pk").column(), QSqlDriver::FieldName);
+    if (NOrmDatabase::databaseType(db) == NOrmDatabase::MSSqlServer)
+        output = QLatin1String(" OUTPUT INSERTED.") + pkColumn;
+    else
+        returning = QLatin1String(" RETURNING ") + pkColumn;
+}
+
 /** Returns the SQL query to perform an INSERT for the specified \a fields.
  */
-NOrmQuery NOrmQuerySetPrivate::insertQuery(const QVariantMap& fields) const {
-    QSqlDatabase db = NOrm::database();
+NOrmQuery NOrmQuerySetPrivate::insertQuery(const QVariantMap& fields, bool returning) const {
+    QSqlDatabase db = writeDatabase();
     const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
 
     // perform INSERT
     QStringList fieldColumns;
@@ -409,36 +1990,260 @@ NOrmQuery NOrmQuerySetPrivate::insertQuery(const QVariantMap& fields) const {
         fieldHolders << QLatin1String("?");
     }
 
+    QString outputClause;
+    QString returningClause;
+    if (returning)
+        returningSql(db, metaModel, outputClause, returningClause);
+
+    const QString sql = QString::fromLatin1("INSERT INTO %1 (%2)%3 VALUES(%4)%5")
+            .arg(db.driver()->escapeIdentifier(metaModel.table(), QSqlDriver::TableName),
+                 fieldColumns.join(QLatin1String(", ")), outputClause,
+                 fieldHolders.join(QLatin1String(", ")), returningClause);
+    span.setSql(sql);
+    span.finish();
     NOrmQuery query(db);
-    query.prepare(QString::fromLatin1("INSERT INTO %1 (%2) VALUES(%3)")
-                  .arg(db.driver()->escapeIdentifier(metaModel.table(), QSqlDriver::TableName),
-                       fieldColumns.join(QLatin1String(", ")), fieldHolders.join(QLatin1String(", "))));
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
     foreach (const QString& name, fields.keys())
         query.addBindValue(fields.value(name));
     return query;
 }
 
-/** Returns the SQL query to perform a SELECT on the current set.
+/** Returns the SQL query to perform a multi-row INSERT for the specified \a rows.
+    With \a returning, the query reports the generated primary keys in an
+    unspecified order; on MSSQL each key is followed by the ordinal of its
+    row in \a rows.
  */
-NOrmQuery NOrmQuerySetPrivate::selectQuery() const {
-    QSqlDatabase db = NOrm::database();
+NOrmQuery NOrmQuerySetPrivate::bulkInsertQuery(const QList<QVariantMap>& rows, bool returning) const {
+    QSqlDatabase db = writeDatabase();
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
+
+    // the first row defines the column list
+    const QStringList names = rows.isEmpty() ? QStringList() : rows.first().keys();
+    QStringList fieldColumns;
+    QStringList fieldHolders;
+    foreach (const QString& name, names) {
+        const NOrmMetaField field = metaModel.localField(name.toLatin1());
+        fieldColumns << db.driver()->escapeIdentifier(field.column(), QSqlDriver::FieldName);
+        fieldHolders << QLatin1String("?");
+    }
+
+    QString sql;
+    if (returning && NOrmDatabase::databaseType(db) == NOrmDatabase::MSSqlServer) {
+        // the OUTPUT order is not guaranteed, MERGE can output the ordinal
+        // of the source row together with the generated key
+        const QString pkColumn = db.driver()->escapeIdentifier(metaModel.localField("pk").column(), QSqlDriver::FieldName);
+        const QString ordinalColumn = db.driver()->escapeIdentifier(QLatin1String("_norm_row"), QSqlDriver::FieldName);
+        QStringList rowHolders;
+        for (int i = 0; i < rows.size(); ++i)
+            rowHolders << QString::fromLatin1("(%1, %2)").arg(fieldHolders.join(QLatin1String(", "))).arg(i);
+        QStringList sourceColumns;
+        foreach (const QString& column, fieldColumns)
+            sourceColumns << QLatin1String("S.") + column;
+
+        sql = QString::fromLatin1("MERGE INTO %1 USING (VALUES %2) AS S (%3, %4) ON 1 = 0 "
+                                  "WHEN NOT MATCHED THEN INSERT (%5) VALUES (%6) "
+                                  "OUTPUT INSERTED.%7, S.%4;")
+                .arg(db.driver()->escapeIdentifier(metaModel.table(), QSqlDriver::TableName),
+                     rowHolders.join(QLatin1String(", ")),
+                     fieldColumns.join(QLatin1String(", ")), ordinalColumn,
+                     fieldColumns.join(QLatin1String(", ")),
+                     sourceColumns.join(QLatin1String(", ")), pkColumn);
+    } else {
+        QStringList rowHolders;
+        const QString rowHolder = QLatin1Char('(') + fieldHolders.join(QLatin1String(", ")) + QLatin1Char(')');
+        for (int i = 0; i < rows.size(); ++i)
+            rowHolders << rowHolder;
+
+        QString outputClause;
+        QString returningClause;
+        if (returning)
+            returningSql(db, metaModel, outputClause, returningClause);
+
+        sql = QString::fromLatin1("INSERT INTO %1 (%2)%3 VALUES %4%5")
+                .arg(db.driver()->escapeIdentifier(metaModel.table(), QSqlDriver::TableName),
+                     fieldColumns.join(QLatin1String(", ")), outputClause,
+                     rowHolders.join(QLatin1String(", ")), returningClause);
+    }
+    span.setSql(sql);
+    span.finish();
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    foreach (const QVariantMap& row, rows) {
+        foreach (const QString& name, names)
+            query.addBindValue(row.value(name));
+    }
+    return query;
+}
+
+/** Returns the SQL query to insert \a rows and update the rows which
+    already exist with the same \a conflictFields.
+ */
+NOrmQuery NOrmQuerySetPrivate::bulkUpsertQuery(const QList<QVariantMap>& rows, const QStringList& conflictFields) const {
+    QSqlDatabase db = writeDatabase();
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
+
+    // the first row defines the column list
+    const QStringList names = rows.isEmpty() ? QStringList() : rows.first().keys();
+    QStringList fieldColumns;
+    QStringList fieldHolders;
+    QStringList updateColumns;
+    foreach (const QString& name, names) {
+        const NOrmMetaField field = metaModel.localField(name.toLatin1());
+        const QString column = db.driver()->escapeIdentifier(field.column(), QSqlDriver::FieldName);
+        fieldColumns << column;
+        fieldHolders << QLatin1String("?");
+        if (!conflictFields.contains(field.name()))
+            updateColumns << column;
+    }
+    QStringList conflictColumns;
+    foreach (const QString& name, conflictFields)
+        conflictColumns << db.driver()->escapeIdentifier(metaModel.localField(name.toLatin1()).column(), QSqlDriver::FieldName);
+
+    QStringList rowHolders;
+    const QString rowHolder = QLatin1Char('(') + fieldHolders.join(QLatin1String(", ")) + QLatin1Char(')');
+    for (int i = 0; i < rows.size(); ++i)
+        rowHolders << rowHolder;
+
+    QString sql = QString::fromLatin1("INSERT INTO %1 (%2) VALUES %3")
+            .arg(db.driver()->escapeIdentifier(metaModel.table(), QSqlDriver::TableName),
+                 fieldColumns.join(QLatin1String(", ")), rowHolders.join(QLatin1String(", ")));
+    QStringList assign;
+    if (NOrmDatabase::databaseType(db) == NOrmDatabase::MySqlServer) {
+        foreach (const QString& column, updateColumns)
+            assign << column + QLatin1String(" = VALUES(") + column + QLatin1Char(')');
+        if (assign.isEmpty())
+            assign << conflictColumns.first() + QLatin1String(" = ") + conflictColumns.first();
+        sql += QLatin1String(" ON DUPLICATE KEY UPDATE ") + assign.join(QLatin1String(", "));
+    } else {
+        foreach (const QString& column, updateColumns)
+            assign << column + QLatin1String(" = excluded.") + column;
+        sql += QLatin1String(" ON CONFLICT (") + conflictColumns.join(QLatin1String(", ")) + QLatin1Char(')');
+        if (assign.isEmpty())
+            sql += QLatin1String(" DO NOTHING");
+        else
+            sql += QLatin1String(" DO UPDATE SET ") + assign.join(QLatin1String(", "));
+    }
+    span.setSql(sql);
+    span.finish();
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    foreach (const QVariantMap& row, rows) {
+        foreach (const QString& name, names)
+            query.addBindValue(row.value(name));
+    }
+    return query;
+}
+
+/** Returns the keys of orderBy which refer to selected columns: the local
+    fields, the fields of the followed related fields and the windows.
+    PostgreSQL and SQL Server only order a DISTINCT selection by selected
+    columns.
+ */
+QStringList NOrmQuerySetPrivate::selectedOrderBy() const {
+    QStringList order;
+    foreach (const QString& key, orderBy) {
+        const QString name = (key.startsWith(QLatin1Char('-')) || key.startsWith(QLatin1Char('+'))) ? key.mid(1) : key;
+        if (windowIndex(name) >= 0) {
+            order << key;
+            continue;
+        }
 
+        NOrmMetaModel model = NOrm::metaModel(m_modelName);
+        QStringList bits = name.split(QLatin1String("__"));
+        QString path;
+        while (bits.size() > 1) {
+            const QByteArray fk = bits.first().toLatin1();
+            path += (path.isEmpty() ? QString() : QLatin1String("__")) + bits.first();
+            if (!selectRelated || !model.foreignFields().contains(fk) || !relatedFields.contains(path))
+                break;
+            model = NOrm::metaModel(model.foreignFields()[fk]);
+            bits.removeFirst();
+        }
+        if (bits.size() == 1 && model.localField(bits.first().toLatin1()).isValid())
+            order << key;
+    }
+    return order;
+}
+
+/** Returns the SQL query to perform a SELECT on the current set. A
+    DISTINCT selection is only ordered by selected columns.
+ */
+NOrmQuery NOrmQuerySetPrivate::selectQuery(const QSqlDatabase& db) const {
     // build query
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
     NOrmCompiler compiler(m_modelName, db);
     NOrmWhere resolvedWhere(whereClause);
-    compiler.resolve(resolvedWhere);
+    if (!compiler.resolve(resolvedWhere))
+        return NOrmQuery(db);
 
-    const QStringList columns = compiler.fieldNames(selectRelated, &this->relatedFields);
+    QStringList columns = compiler.fieldNames(selectRelated, &this->relatedFields);
+    foreach (const NOrmWindow& window, windows)
+        columns << compiler.windowSql(window);
     const QString where = resolvedWhere.sql(db);
-    const QString limit = compiler.orderLimitSql(orderBy, lowMark, highMark);
-    QString sql = QLatin1String("SELECT ") + columns.join(QLatin1String(", ")) + QLatin1String(" FROM ") + compiler.fromSql();
-    if (!where.isEmpty())
-        sql += QLatin1String(" WHERE ") + where;
-    sql += limit;
+
+    // the search relevance is not selected either
+    const QStringList order = distinct ? selectedOrderBy() : orderBy;
+
+    // window functions are filtered in a wrapping subquery
+    NOrmWhere resolvedQualify(qualifyClause);
+    QString sql;
+    if (!qualifyClause.isAll()) {
+        sql = compiler.windowSubquerySql(columns, windows, where, resolvedQualify, order, lowMark, highMark, distinct);
+    } else {
+        const QString limit = compiler.orderLimitSql(order, lowMark, highMark, !distinct);
+        sql = QLatin1String(distinct ? "SELECT DISTINCT " : "SELECT ") + columns.join(QLatin1String(", "))
+                + QLatin1String(" FROM ") + compiler.fromSql();
+        if (!where.isEmpty())
+            sql += QLatin1String(" WHERE ") + where;
+        sql += limit;
+    }
+    span.setSql(sql);
+    span.finish();
     NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
     query.prepare(sql);
     resolvedWhere.bindValues(query);
+    resolvedQualify.bindValues(query);
+
+    return query;
+}
+
+/** Returns the SQL query to count the rows of a set filtered on window
+    functions: the windowed subquery of selectQuery() wrapped in a COUNT.
+ */
+NOrmQuery NOrmQuerySetPrivate::qualifyCountQuery(const QSqlDatabase& db) const {
+    // build query
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
+    NOrmCompiler compiler(m_modelName, db);
+    NOrmWhere resolvedWhere(whereClause);
+    if (!compiler.resolve(resolvedWhere))
+        return NOrmQuery(db);
 
+    QStringList columns = compiler.fieldNames(selectRelated, &this->relatedFields);
+    foreach (const NOrmWindow& window, windows)
+        columns << compiler.windowSql(window);
+    const QString where = resolvedWhere.sql(db);
+
+    // the order only matters to pick the rows of a range
+    QStringList order;
+    if (lowMark || highMark)
+        order = distinct ? selectedOrderBy() : orderBy;
+
+    NOrmWhere resolvedQualify(qualifyClause);
+    const QString subquery = compiler.windowSubquerySql(columns, windows, where, resolvedQualify, order, lowMark, highMark, distinct);
+    const QString sql = QString::fromLatin1("SELECT COUNT(*) FROM (%1) N").arg(subquery);
+    span.setSql(sql);
+    span.finish();
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    resolvedWhere.bindValues(query);
+    resolvedQualify.bindValues(query);
     return query;
 }
 
@@ -446,34 +2251,108 @@ NOrmQuery NOrmQuerySetPrivate::selectQuery() const {
     specified \a fields.
  */
 NOrmQuery NOrmQuerySetPrivate::updateQuery(const QVariantMap& fields) const {
-    QSqlDatabase db = NOrm::database();
+    QSqlDatabase db = writeDatabase();
     const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
 
     // build query
     NOrmCompiler compiler(m_modelName, db);
     NOrmWhere resolvedWhere(whereClause);
-    compiler.resolve(resolvedWhere);
+    if (!compiler.resolve(resolvedWhere))
+        return NOrmQuery(db);
 
     QString sql = QLatin1String("UPDATE ") + compiler.fromSql();
 
+    // the version field is never assigned, it is incremented by every UPDATE
+    QStringList names = fields.keys();
+    const QByteArray versionName = metaModel.versionField();
+    if (!versionName.isEmpty())
+        names.removeAll(QString::fromLatin1(versionName));
+
     // add SET
     QStringList fieldAssign;
-    foreach (const QString& name, fields.keys()) {
+    foreach (const QString& name, names) {
         const NOrmMetaField field = metaModel.localField(name.toLatin1());
         fieldAssign << db.driver()->escapeIdentifier(field.column(), QSqlDriver::FieldName) + QLatin1String(" = ?");
     }
-    sql += QLatin1String(" SET ") + fieldAssign.join(QLatin1String(", "));
+    if (!versionName.isEmpty()) {
+        const QString versionColumn = db.driver()->escapeIdentifier(metaModel.localField(versionName).column(), QSqlDriver::FieldName);
+        fieldAssign << versionColumn + QLatin1String(" = ") + versionColumn + QLatin1String(" + 1");
+    }
+    sql += QLatin1String(" SET ") + fieldAssign.join(QLatin1String(", "));
+
+    // add WHERE
+    const QString where = resolvedWhere.sql(db);
+    if (!where.isEmpty())
+        sql += QLatin1String(" WHERE ") + where;
+
+    span.setSql(sql);
+    span.finish();
+    NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
+    query.prepare(sql);
+    foreach (const QString& name, names)
+        query.addBindValue(fields.value(name));
+    resolvedWhere.bindValues(query);
+
+    return query;
+}
+
+/** Returns the SQL query to perform a multi-row UPDATE for the specified
+    \a rows. Each row is keyed by its primary key, which must be one of the
+    fields, and the new values are selected with a CASE on the primary key.
+ */
+NOrmQuery NOrmQuerySetPrivate::bulkUpdateQuery(const QList<QVariantMap>& rows) const {
+    QSqlDatabase db = writeDatabase();
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    NOrmSpanScope span(NOrmSpan::Build, QString::fromLatin1(m_modelName));
+    const NOrmMetaField primaryKey = metaModel.localField("pk");
+    const QString pkColumn = db.driver()->escapeIdentifier(primaryKey.column(), QSqlDriver::FieldName);
+
+    // the first row defines the column list
+    QStringList names = rows.isEmpty() ? QStringList() : rows.first().keys();
+    names.removeAll(primaryKey.name());
+    const QByteArray versionName = metaModel.versionField();
+    if (!versionName.isEmpty())
+        names.removeAll(QString::fromLatin1(versionName));
+
+    // add SET
+    QStringList fieldAssign;
+    foreach (const QString& name, names) {
+        const NOrmMetaField field = metaModel.localField(name.toLatin1());
+        QString assign = db.driver()->escapeIdentifier(field.column(), QSqlDriver::FieldName)
+                + QLatin1String(" = CASE ") + pkColumn;
+        for (int i = 0; i < rows.size(); ++i)
+            assign += QLatin1String(" WHEN ? THEN ?");
+        assign += QLatin1String(" END");
+        fieldAssign << assign;
+    }
+    if (!versionName.isEmpty()) {
+        const QString versionColumn = db.driver()->escapeIdentifier(metaModel.localField(versionName).column(), QSqlDriver::FieldName);
+        fieldAssign << versionColumn + QLatin1String(" = ") + versionColumn + QLatin1String(" + 1");
+    }
 
     // add WHERE
-    const QString where = resolvedWhere.sql(db);
-    if (!where.isEmpty())
-        sql += QLatin1String(" WHERE ") + where;
-
+    QStringList pkHolders;
+    for (int i = 0; i < rows.size(); ++i)
+        pkHolders << QLatin1String("?");
+
+    const QString sql = QString::fromLatin1("UPDATE %1 SET %2 WHERE %3 IN (%4)")
+            .arg(db.driver()->escapeIdentifier(metaModel.table(), QSqlDriver::TableName),
+                 fieldAssign.join(QLatin1String(", ")), pkColumn, pkHolders.join(QLatin1String(", ")));
+    span.setSql(sql);
+    span.finish();
     NOrmQuery query(db);
+    query.setModel(QString::fromLatin1(m_modelName));
     query.prepare(sql);
-    foreach (const QString& name, fields.keys())
-        query.addBindValue(fields.value(name));
-    resolvedWhere.bindValues(query);
+    foreach (const QString& name, names) {
+        foreach (const QVariantMap& row, rows) {
+            query.addBindValue(row.value(primaryKey.name()));
+            query.addBindValue(row.value(name));
+        }
+    }
+    foreach (const QVariantMap& row, rows)
+        query.addBindValue(row.value(primaryKey.name()));
 
     return query;
 }
@@ -489,10 +2368,35 @@ int NOrmQuerySetPrivate::sqlUpdate(const QVariantMap& fields) {
     if (lowMark || highMark)
         return -1;
 
+    // a sharded set is updated shard by shard
+    if (shard < 0) {
+        const QList<int> shards = targetShards();
+        if (!shards.isEmpty()) {
+            int affected = 0;
+            foreach (int index, shards) {
+                NOrmQuerySetPrivate part(m_modelName);
+                part.whereClause = whereClause;
+                part.shard = index;
+                const int partAffected = part.sqlUpdate(fields);
+                if (partAffected < 0)
+                    return -1;
+                affected += partAffected;
+            }
+
+            // invalidate cache
+            if (hasResults) {
+                properties.clear();
+                hasResults = false;
+            }
+            return affected;
+        }
+    }
+
     // execute query
     NOrmQuery query(updateQuery(fields));
     if (!query.exec())
         return -1;
+    NOrmDatabase::markWrite();
 
     // invalidate cache
     if (hasResults) {
@@ -503,6 +2407,93 @@ int NOrmQuerySetPrivate::sqlUpdate(const QVariantMap& fields) {
     return query.numRowsAffected();
 }
 
+/** Updates all \a rows, each identified by its primary key, and returns the
+    number of affected rows or -1 on error. Rows of a versioned model are only
+    updated if their version still matches.
+ */
+int NOrmQuerySetPrivate::sqlBulkUpdate(const QList<QVariantMap>& rows) {
+    // nothing to update besides the primary key
+    if (rows.isEmpty() || rows.first().size() < 2)
+        return 0;
+
+    int affected = 0;
+    QSqlDatabase db = writeDatabase();
+    NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+
+    // sharded rows are updated on the shard of their key
+    if (shard < 0 && metaModel.isSharded()) {
+        const QString shardKey = QString::fromLatin1(metaModel.shardKey());
+        QMap<int, QList<QVariantMap> > groups;
+        foreach (const QVariantMap& row, rows)
+            groups[metaModel.shard(row.value(shardKey))] << row;
+
+        QMap<int, QList<QVariantMap> >::const_iterator group;
+        for (group = groups.constBegin(); group != groups.constEnd(); ++group) {
+            NOrmQuerySetPrivate part(m_modelName);
+            part.shard = group.key();
+            const int partAffected = part.sqlBulkUpdate(group.value());
+            if (partAffected < 0)
+                return -1;
+            affected += partAffected;
+        }
+        return affected;
+    }
+    const QByteArray versionName = metaModel.versionField();
+    if (versionName.isEmpty() && (databaseType == NOrmDatabase::SQLite || databaseType == NOrmDatabase::MySqlServer)) {
+        // every row binds a (pk, value) pair per column plus its pk in the IN list
+        const int paramsPerRow = 2 * (rows.first().size() - 1) + 1;
+        const int step = qMax(1, NOrmDatabase::maxBindValues(db) / paramsPerRow);
+        for (int i = 0; i < rows.size(); i += step) {
+            // execute query
+            NOrmQuery query(bulkUpdateQuery(rows.mid(i, step)));
+            if (!query.exec())
+                return -1;
+            NOrmDatabase::markWrite();
+            affected += query.numRowsAffected();
+        }
+    } else {
+        // strictly typed backends can not infer the type of "CASE ... THEN ?"
+        // and versioned rows need their own check, so fall back to one UPDATE
+        // per row
+        const QString pkName = metaModel.localField("pk").name();
+        NOrmDiagnosticsBatch batch;
+        foreach (const QVariantMap& row, rows) {
+            QVariantMap fields = row;
+            fields.remove(pkName);
+
+            NOrmWhere where(QLatin1String("pk"), NOrmWhere::Equals, row.value(pkName));
+            if (!versionName.isEmpty())
+                where = where && NOrmWhere(QString::fromLatin1(versionName), NOrmWhere::Equals, row.value(QString::fromLatin1(versionName)));
+            NOrmQuerySetPrivate qs(m_modelName);
+            qs.shard = shard;
+            qs.addFilter(where);
+            const int rowAffected = qs.sqlUpdate(fields);
+            if (rowAffected < 0)
+                return -1;
+            affected += rowAffected;
+        }
+    }
+
+    // invalidate cache
+    if (hasResults) {
+        properties.clear();
+        hasResults = false;
+    }
+
+    return affected;
+}
+
+/** Returns the position of the window named \a name, or -1.
+ */
+int NOrmQuerySetPrivate::windowIndex(const QString& name) const {
+    for (int i = 0; i < windows.size(); ++i) {
+        if (windows.at(i).name == name)
+            return i;
+    }
+    return -1;
+}
+
 QList<QVariantMap> NOrmQuerySetPrivate::sqlValues(const QStringList& fields) {
     QList<QVariantMap> values;
     if (!sqlFetch())
@@ -516,8 +2507,16 @@ QList<QVariantMap> NOrmQuerySetPrivate::sqlValues(const QStringList& fields) {
     if (fields.isEmpty()) {
         for (int i = 0; i < localFields.size(); ++i)
             fieldPos.insert(localFields[i].name(), i);
+        for (int i = 0; i < windows.size(); ++i)
+            fieldPos.insert(windows[i].name, -1 - i);
     } else {
         foreach (const QString& name, fields) {
+            // windows follow all the other columns, they are counted from the end
+            const int window = windowIndex(name);
+            if (window >= 0) {
+                fieldPos.insert(name, -1 - window);
+                continue;
+            }
             int pos = 0;
             foreach (const NOrmMetaField& field, localFields) {
                 if (field.name() == name)
@@ -534,18 +2533,52 @@ QList<QVariantMap> NOrmQuerySetPrivate::sqlValues(const QStringList& fields) {
         QVariantMap map;
         QMap<QString, int>::const_iterator i;
         for (i = fieldPos.constBegin(); i != fieldPos.constEnd(); ++i)
-            map[i.key()] = props[i.value()];
+            map[i.key()] = props[i.value() >= 0 ? i.value() : props.size() - windows.size() - 1 - i.value()];
         values.append(map);
     }
     return values;
 }
 
-QList<QVariantList> NOrmQuerySetPrivate::sqlValuesList(const QStringList& fields) {
+/** Returns the values of \a fields for every row of the set. With
+    \a distinct, or on a distinct() set, repeated rows are returned once:
+    the database projects and deduplicates the columns unless the rows
+    are already fetched, come from several shards or are filtered on
+    windows, they are then deduplicated here.
+ */
+QList<QVariantList> NOrmQuerySetPrivate::sqlValuesList(const QStringList& fields, bool distinct) {
     QList<QVariantList> values;
-    if (!sqlFetch())
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    distinct = distinct || this->distinct;
+
+    bool projected = distinct && !hasResults && qualifyClause.isAll();
+    foreach (const QString& name, fields)
+        projected = projected && windowIndex(name) < 0;
+    const QList<int> shards = projected ? targetShards() : QList<int>();
+    if (projected && shards.size() <= 1) {
+        QStringList names = fields;
+        if (names.isEmpty()) {
+            foreach (const NOrmMetaField& field, metaModel.localFields())
+                names << field.name();
+        }
+
+        NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+        NOrmQuery query(distinctValuesQuery(readDatabase.database(), names));
+        if (!query.exec())
+            return values;
+
+        NOrmSpanScope span(NOrmSpan::Fetch, QString::fromLatin1(m_modelName));
+        while (query.next()) {
+            QVariantList list;
+            for (int i = 0; i < names.size(); ++i)
+                list << query.value(i);
+            values.append(list);
+        }
+        span.setRows(values.size());
         return values;
+    }
 
-    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    if (!sqlFetch())
+        return values;
 
     // build field list
     const QList<NOrmMetaField> localFields = metaModel.localFields();
@@ -553,8 +2586,16 @@ QList<QVariantList> NOrmQuerySetPrivate::sqlValuesList(const QStringList& fields
     if (fields.isEmpty()) {
         for (int i = 0; i < localFields.size(); ++i)
             fieldPos << i;
+        for (int i = 0; i < windows.size(); ++i)
+            fieldPos << -1 - i;
     } else {
         foreach (const QString& name, fields) {
+            // windows follow all the other columns, they are counted from the end
+            const int window = windowIndex(name);
+            if (window >= 0) {
+                fieldPos << -1 - window;
+                continue;
+            }
             int pos = 0;
             foreach (const NOrmMetaField& field, localFields) {
                 if (field.name() == name)
@@ -566,14 +2607,910 @@ QList<QVariantList> NOrmQuerySetPrivate::sqlValuesList(const QStringList& fields
         }
     }
 
-    // extract values
+    // extract values, repeated rows are found by their serialized values
+    QSet<QByteArray> seen;
     foreach (const QVariantList& props, properties) {
         QVariantList list;
         foreach (int pos, fieldPos)
-            list << props.at(pos);
+            list << props.at(pos >= 0 ? pos : props.size() - windows.size() - 1 - pos);
+        if (distinct) {
+            QByteArray key;
+            QDataStream stream(&key, QIODevice::WriteOnly);
+            stream << list;
+            if (seen.contains(key))
+                continue;
+            seen.insert(key);
+        }
         values.append(list);
     }
     return values;
 }
 
+/** Converts a \a value read from the database to the type of \a field,
+    drivers such as SQLite return dates and encoded string lists as plain text.
+ */
+static QVariant exportValue(const NOrmMetaField& field, const QVariant& value) {
+    if (value.isNull())
+        return QVariant();
+
+    if (field.isJson())
+        return NOrmJsonCodec::decode(value, QMetaType::QVariantMap);
+
+    switch (field.type()) {
+    case QVariant::StringList:
+        return NOrmStringListCodec::decode(value.toString());
+    case QVariant::DateTime:
+        return value.toDateTime();
+    case QVariant::Date:
+        return value.toDate();
+    case QVariant::Time:
+        return value.toTime();
+    case QVariant::ByteArray:
+        return value.toByteArray();
+    case QVariant::Bool:
+        return value.toBool();
+    default:
+        return value;
+    }
+}
+
+/** Appends \a text to \a out as a quoted JSON string.
+ */
+static void exportJsonString(QByteArray& out, const QString& text) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    const QByteArray utf8 = text.toUtf8();
+    for (int i = 0; i < utf8.size(); ++i) {
+        const uchar c = uchar(utf8.at(i));
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (c < 0x20) {
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+            } else {
+                out += char(c);
+            }
+        }
+    }
+    out += '"';
+}
+
+/** Appends \a text to \a out as a CSV field, quoted when needed. The empty
+    string is quoted so that it can be told apart from NULL.
+ */
+static void exportCsvString(QByteArray& out, const QString& text) {
+    const QByteArray utf8 = text.toUtf8();
+    bool quote = utf8.isEmpty();
+    for (int i = 0; i < utf8.size() && !quote; ++i) {
+        const char c = utf8.at(i);
+        quote = (c == ',' || c == '"' || c == '\n' || c == '\r');
+    }
+    if (!quote) {
+        out += utf8;
+        return;
+    }
+    out += '"';
+    for (int i = 0; i < utf8.size(); ++i) {
+        if (utf8.at(i) == '"')
+            out += '"';
+        out += utf8.at(i);
+    }
+    out += '"';
+}
+
+/** Appends the \a value of one field to \a out.
+ */
+static void exportCell(QByteArray& out, const QVariant& value, NOrm::DataFormat format) {
+    const bool csv = (format == NOrm::Csv);
+    if (value.isNull()) {
+        if (!csv)
+            out += "null";
+        return;
+    }
+
+    QString text;
+    switch (value.type()) {
+    case QVariant::Bool:
+        out += value.toBool() ? "true" : "false";
+        return;
+    case QVariant::Int:
+    case QVariant::LongLong:
+        out += QByteArray::number(value.toLongLong());
+        return;
+    case QVariant::UInt:
+    case QVariant::ULongLong:
+        out += QByteArray::number(value.toULongLong());
+        return;
+    case QVariant::Double: {
+        const double number = value.toDouble();
+        if (qIsFinite(number))
+            out += QByteArray::number(number, 'g', QLocale::FloatingPointShortest);
+        else if (!csv)
+            out += "null";
+        return;
+    }
+    case QVariant::StringList: {
+        const QStringList items = value.toStringList();
+        // CSV embeds the JSON array, as stored in the database
+        if (csv) {
+            text = NOrmStringListCodec::encode(items);
+            break;
+        }
+        out += '[';
+        for (int i = 0; i < items.size(); ++i) {
+            if (i)
+                out += ',';
+            exportJsonString(out, items.at(i));
+        }
+        out += ']';
+        return;
+    }
+    case QVariant::Map: {
+        const QByteArray json = QJsonDocument(QJsonObject::fromVariantMap(value.toMap())).toJson(QJsonDocument::Compact);
+        if (csv) {
+            text = QString::fromUtf8(json);
+            break;
+        }
+        out += json;
+        return;
+    }
+    case QVariant::DateTime:
+        text = value.toDateTime().toString(Qt::ISODateWithMs);
+        break;
+    case QVariant::Date:
+        text = value.toDate().toString(Qt::ISODate);
+        break;
+    case QVariant::Time:
+        text = value.toTime().toString(Qt::ISODateWithMs);
+        break;
+    case QVariant::ByteArray:
+        text = QString::fromLatin1(value.toByteArray().toBase64());
+        break;
+    default:
+        text = value.toString();
+        break;
+    }
+
+    if (csv)
+        exportCsvString(out, text);
+    else
+        exportJsonString(out, text);
+}
+
+/** Writes the \a fields of the set to \a device in the given \a format and
+    returns the number of rows written, or -1 if an error occurred.
+
+    Rows are streamed from a forward-only cursor into a fixed size buffer,
+    so memory does not depend on the size of the set. Sets which already
+    hold their results or span several shards are written from memory.
+ */
+qint64 NOrmQuerySetPrivate::sqlExport(QIODevice* device, NOrm::DataFormat format, const QStringList& fields) {
+    if (!device || !device->isWritable()) {
+        qWarning("NOrmQuerySet cannot export to a device which is not writable");
+        return -1;
+    }
+
+    // build field list
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    const QList<NOrmMetaField> localFields = metaModel.localFields();
+    QList<int> fieldPos;
+    if (fields.isEmpty()) {
+        for (int i = 0; i < localFields.size(); ++i)
+            fieldPos << i;
+        for (int i = 0; i < windows.size(); ++i)
+            fieldPos << -1 - i;
+    } else {
+        foreach (const QString& name, fields) {
+            // windows follow all the other columns, they are counted from the end
+            const int window = windowIndex(name);
+            if (window >= 0) {
+                fieldPos << -1 - window;
+                continue;
+            }
+            int pos = 0;
+            while (pos < localFields.size() && localFields.at(pos).name() != name)
+                pos++;
+            if (pos >= localFields.size()) {
+                qWarning("NOrmQuerySet cannot export unknown field '%s'", qPrintable(name));
+                return -1;
+            }
+            fieldPos << pos;
+        }
+    }
+
+    // the field names in the format of the output
+    QList<QByteArray> keys;
+    foreach (int pos, fieldPos) {
+        const QString name = pos >= 0 ? localFields.at(pos).name() : windows.at(-1 - pos).name;
+        QByteArray key;
+        if (format == NOrm::Csv)
+            exportCsvString(key, name);
+        else
+            exportJsonString(key, name);
+        keys << key;
+    }
+
+    QByteArray buffer;
+    buffer.reserve(exportBufferSize + 4096);
+    qint64 rows = 0;
+    bool ok = true;
+
+    const auto flush = [&](bool force) {
+        if (!ok || (!force && buffer.size() < exportBufferSize))
+            return;
+        if (device->write(buffer) != buffer.size()) {
+            qWarning() << "NOrmQuerySet export write error:" << device->errorString();
+            ok = false;
+        }
+        buffer.clear();
+    };
+
+    // windows are written as returned by the database
+    const auto cellValue = [&](const QVariantList& props, int pos) {
+        if (pos < 0)
+            return props.at(props.size() - windows.size() - 1 - pos);
+        return exportValue(localFields.at(pos), props.at(pos));
+    };
+
+    const auto writeRow = [&](const QVariantList& props) {
+        if (format == NOrm::Csv) {
+            for (int i = 0; i < fieldPos.size(); ++i) {
+                if (i)
+                    buffer += ',';
+                exportCell(buffer, cellValue(props, fieldPos.at(i)), format);
+            }
+            buffer += "\r\n";
+        } else {
+            if (format == NOrm::Json && rows)
+                buffer += ",\n";
+            buffer += '{';
+            for (int i = 0; i < fieldPos.size(); ++i) {
+                if (i)
+                    buffer += ',';
+                buffer += keys.at(i);
+                buffer += ':';
+                exportCell(buffer, cellValue(props, fieldPos.at(i)), format);
+            }
+            buffer += '}';
+            if (format == NOrm::NdJson)
+                buffer += '\n';
+        }
+        ++rows;
+        flush(false);
+    };
+
+    // header
+    if (format == NOrm::Csv) {
+        for (int i = 0; i < keys.size(); ++i) {
+            if (i)
+                buffer += ',';
+            buffer += keys.at(i);
+        }
+        buffer += "\r\n";
+    } else if (format == NOrm::Json) {
+        buffer += "[\n";
+    }
+
+    const QList<int> shards = targetShards();
+    if (hasResults || whereClause.isNone() || shards.size() > 1) {
+        if (!sqlFetch())
+            return -1;
+        foreach (const QVariantList& props, properties) {
+            writeRow(props);
+            if (!ok)
+                return -1;
+        }
+    } else {
+        NOrmReadDatabase readDatabase(databaseAlias, shards.isEmpty() ? -1 : shards.first());
+        NOrmQuery query(selectQuery(readDatabase.database()));
+        query.setForwardOnly(true);
+        if (!query.exec())
+            return -1;
+
+        NOrmSpanScope span(NOrmSpan::Fetch, QString::fromLatin1(m_modelName));
+        QVariantList props;
+        while (ok && query.next()) {
+            props.clear();
+            const int propCount = query.record().count();
+            for (int i = 0; i < propCount; ++i)
+                props << query.value(i);
+            writeRow(props);
+        }
+        span.setRows(rows);
+        span.setOk(ok);
+        if (!ok)
+            return -1;
+    }
+
+    // footer
+    if (format == NOrm::Json)
+        buffer += rows ? "\n]\n" : "]\n";
+    flush(true);
+    return ok ? rows : -1;
+}
+
+/** Splits the input of an import into records: CSV lines, where quoted
+    fields may span several lines, or JSON objects, either one per line or
+    as the elements of an array.
+ */
+class NOrmImportReader
+{
+public:
+    NOrmImportReader(QIODevice* device, NOrm::DataFormat format)
+        : m_device(device), m_format(format), m_pos(0), m_scan(0), m_depth(0)
+        , m_quoted(false), m_escape(false), m_started(false), m_first(true) {}
+
+    bool next(QByteArray* record);
+
+private:
+    bool fill();
+    bool scanCsv(QByteArray* record);
+    bool scanJson(QByteArray* record);
+
+    QIODevice* m_device;
+    NOrm::DataFormat m_format;
+    QByteArray m_buffer;
+    int m_pos;
+    int m_scan;
+    int m_depth;
+    bool m_quoted;
+    bool m_escape;
+    bool m_started;
+    bool m_first;
+};
+
+bool NOrmImportReader::next(QByteArray* record) {
+    forever {
+        const bool found = (m_format == NOrm::Csv) ? scanCsv(record) : scanJson(record);
+        if (found) {
+            // skip blank lines
+            if (record->isEmpty())
+                continue;
+            return true;
+        }
+        if (!fill())
+            break;
+    }
+
+    // the last record may have no terminator
+    if (m_pos >= m_buffer.size())
+        return false;
+    *record = m_buffer.mid(m_pos).trimmed();
+    m_pos = m_scan = m_buffer.size();
+    return !record->isEmpty();
+}
+
+bool NOrmImportReader::fill() {
+    // drop the records which were already returned
+    if (m_pos > 0) {
+        m_buffer.remove(0, m_pos);
+        m_scan -= m_pos;
+        m_pos = 0;
+    }
+
+    QByteArray data = m_device->read(importReadSize);
+    if (data.isEmpty() && m_device->isSequential() && m_device->waitForReadyRead(30000))
+        data = m_device->read(importReadSize);
+    if (data.isEmpty())
+        return false;
+
+    // skip the UTF-8 byte order mark
+    if (m_first) {
+        m_first = false;
+        if (data.startsWith("\xEF\xBB\xBF"))
+            data.remove(0, 3);
+    }
+    m_buffer += data;
+    return true;
+}
+
+bool NOrmImportReader::scanCsv(QByteArray* record) {
+    const char* data = m_buffer.constData();
+    const int size = m_buffer.size();
+    while (m_scan < size) {
+        const char c = data[m_scan++];
+        if (c == '"') {
+            m_quoted = !m_quoted;
+        } else if (c == '\n' && !m_quoted) {
+            int end = m_scan - 1;
+            if (end > m_pos && data[end - 1] == '\r')
+                --end;
+            *record = m_buffer.mid(m_pos, end - m_pos);
+            m_pos = m_scan;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool isJsonSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool NOrmImportReader::scanJson(QByteArray* record) {
+    const char* data = m_buffer.constData();
+    const int size = m_buffer.size();
+    if (!m_started) {
+        // skip the separators between values and the brackets of an array
+        while (m_scan < size && (isJsonSpace(data[m_scan]) || data[m_scan] == ',' || data[m_scan] == '[' || data[m_scan] == ']'))
+            ++m_scan;
+        m_pos = m_scan;
+        if (m_scan >= size)
+            return false;
+        m_started = true;
+    }
+
+    while (m_scan < size) {
+        const char c = data[m_scan++];
+        if (m_quoted) {
+            if (m_escape)
+                m_escape = false;
+            else if (c == '\\')
+                m_escape = true;
+            else if (c == '"')
+                m_quoted = false;
+            continue;
+        }
+
+        bool end = false;
+        if (c == '"') {
+            m_quoted = true;
+        } else if (c == '{' || c == '[') {
+            ++m_depth;
+        } else if (c == '}' || c == ']') {
+            end = (--m_depth <= 0);
+        } else if (!m_depth && (isJsonSpace(c) || c == ',')) {
+            // a value which is not an object, rejected by the parser
+            end = true;
+            --m_scan;
+        }
+        if (end) {
+            *record = m_buffer.mid(m_pos, m_scan - m_pos);
+            m_pos = m_scan;
+            m_depth = 0;
+            m_started = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Records read by the import reader, numbered from \a first.
+ */
+struct NOrmImportChunk
+{
+    qint64 first;
+    QList<QByteArray> records;
+};
+
+/** Rows converted by an import parser and the records it rejected.
+ */
+struct NOrmImportRows
+{
+    QList<QVariantMap> rows;
+    QStringList errors;
+};
+
+/** What the import parsers share, read-only once the import started.
+ */
+struct NOrmImportContext
+{
+    NOrm::DataFormat format;
+    QList<NOrmMetaField> fields;
+    QHash<QString, int> fieldIndex;
+
+    // field of every CSV column, -1 for ignored columns
+    QList<int> columns;
+};
+
+/** Bounded queue between the import reader thread and the calling thread.
+ */
+class NOrmImportQueue
+{
+public:
+    explicit NOrmImportQueue(int capacity) : m_capacity(capacity), m_closed(false) {}
+
+    bool push(const NOrmImportChunk& chunk) {
+        QMutexLocker locker(&m_mutex);
+        while (!m_closed && m_chunks.size() >= m_capacity)
+            m_notFull.wait(&m_mutex);
+        if (m_closed)
+            return false;
+        m_chunks.enqueue(chunk);
+        m_notEmpty.wakeOne();
+        return true;
+    }
+
+    bool pop(NOrmImportChunk* chunk) {
+        QMutexLocker locker(&m_mutex);
+        while (!m_closed && m_chunks.isEmpty())
+            m_notEmpty.wait(&m_mutex);
+        if (m_chunks.isEmpty())
+            return false;
+        *chunk = m_chunks.dequeue();
+        m_notFull.wakeOne();
+        return true;
+    }
+
+    void close() {
+        QMutexLocker locker(&m_mutex);
+        m_closed = true;
+        m_notEmpty.wakeAll();
+        m_notFull.wakeAll();
+    }
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_notEmpty;
+    QWaitCondition m_notFull;
+    QQueue<NOrmImportChunk> m_chunks;
+    int m_capacity;
+    bool m_closed;
+};
+
+/** Splits a CSV \a record into \a cells: unquoted empty cells are NULL,
+    all others are strings. Returns false if the quotes are unbalanced.
+ */
+static bool parseCsvRecord(const QByteArray& record, QVariantList* cells) {
+    const int size = record.size();
+    int i = 0;
+    forever {
+        if (i < size && record.at(i) == '"') {
+            QByteArray cell;
+            ++i;
+            forever {
+                if (i >= size)
+                    return false;
+                const char c = record.at(i++);
+                if (c != '"')
+                    cell += c;
+                else if (i < size && record.at(i) == '"')
+                    cell += record.at(i++);
+                else
+                    break;
+            }
+            *cells << QString::fromUtf8(cell);
+            if (i < size && record.at(i) != ',')
+                return false;
+        } else {
+            int end = record.indexOf(',', i);
+            if (end < 0)
+                end = size;
+            const QByteArray cell = record.mid(i, end - i);
+            *cells << (cell.isEmpty() ? QVariant() : QVariant(QString::fromUtf8(cell)));
+            i = end;
+        }
+        if (i >= size)
+            return true;
+        ++i;
+    }
+}
+
+/** Converts an imported \a input to the type of \a field and then to the
+    value stored in the database. Returns false if \a input is not valid
+    for the field.
+ */
+static bool importValue(const NOrmMetaField& field, const QVariant& input, QVariant* output) {
+    QVariant value;
+    if (!input.isNull() && field.isJson()) {
+        // JSON objects are embedded as text in CSV and as objects in JSON input
+        if (input.type() == QVariant::String) {
+            const QJsonDocument document = QJsonDocument::fromJson(input.toString().toUtf8());
+            if (!document.isObject())
+                return false;
+            value = document.object().toVariantMap();
+        } else if (input.type() == QVariant::Map) {
+            value = input;
+        } else {
+            return false;
+        }
+    } else if (!input.isNull()) {
+        const bool text = (input.type() == QVariant::String);
+        const QString string = input.toString();
+        switch (field.type()) {
+        case QVariant::StringList:
+            // text is a JSON array, or a comma separated list of earlier versions
+            if (text)
+                value = NOrmStringListCodec::decode(string);
+            else
+                value = input.toStringList();
+            break;
+        case QVariant::DateTime:
+            value = QDateTime::fromString(string, Qt::ISODateWithMs);
+            if (!value.toDateTime().isValid())
+                return false;
+            break;
+        case QVariant::Date:
+            value = QDate::fromString(string, Qt::ISODate);
+            if (!value.toDate().isValid())
+                return false;
+            break;
+        case QVariant::Time:
+            value = QTime::fromString(string, Qt::ISODateWithMs);
+            if (!value.toTime().isValid())
+                return false;
+            break;
+        case QVariant::ByteArray:
+            value = QByteArray::fromBase64(string.toLatin1());
+            break;
+        case QVariant::Bool:
+            if (!text) {
+                value = input.toBool();
+            } else if (!string.compare(QLatin1String("true"), Qt::CaseInsensitive) || string == QLatin1String("1")) {
+                value = true;
+            } else if (!string.compare(QLatin1String("false"), Qt::CaseInsensitive) || string == QLatin1String("0")) {
+                value = false;
+            } else {
+                return false;
+            }
+            break;
+        case QVariant::String:
+            value = string;
+            break;
+        default:
+            // numbers are checked, JSON numbers arrive as double
+            value = input;
+            if (!value.convert(int(field.type())))
+                return false;
+            break;
+        }
+    }
+    *output = field.toDatabase(value);
+    return true;
+}
+
+/** Parses the records of a \a chunk into rows keyed by field name.
+ */
+static NOrmImportRows importParse(const NOrmImportContext& context, const NOrmImportChunk& chunk) {
+    NOrmImportRows result;
+    for (int i = 0; i < chunk.records.size(); ++i) {
+        const QByteArray& record = chunk.records.at(i);
+        QVariantMap row;
+        QString error;
+
+        if (context.format == NOrm::Csv) {
+            QVariantList cells;
+            if (!parseCsvRecord(record, &cells)) {
+                error = QLatin1String("unbalanced quotes");
+            } else if (cells.size() != context.columns.size()) {
+                error = QString::fromLatin1("%1 columns, expected %2").arg(cells.size()).arg(context.columns.size());
+            } else {
+                for (int j = 0; j < cells.size() && error.isEmpty(); ++j) {
+                    const int pos = context.columns.at(j);
+                    if (pos < 0)
+                        continue;
+                    const NOrmMetaField& field = context.fields.at(pos);
+                    QVariant value;
+                    if (importValue(field, cells.at(j), &value))
+                        row.insert(field.name(), value);
+                    else
+                        error = QString::fromLatin1("invalid value for field '%1'").arg(field.name());
+                }
+            }
+        } else {
+            QJsonParseError parseError;
+            const QJsonDocument document = QJsonDocument::fromJson(record, &parseError);
+            if (parseError.error != QJsonParseError::NoError) {
+                error = parseError.errorString();
+            } else if (!document.isObject()) {
+                error = QLatin1String("not an object");
+            } else {
+                const QJsonObject object = document.object();
+                for (QJsonObject::const_iterator it = object.constBegin(); it != object.constEnd() && error.isEmpty(); ++it) {
+                    const int pos = context.fieldIndex.value(it.key(), -1);
+                    if (pos < 0)
+                        continue;
+                    const NOrmMetaField& field = context.fields.at(pos);
+                    QVariant value;
+                    if (importValue(field, it.value().toVariant(), &value))
+                        row.insert(field.name(), value);
+                    else
+                        error = QString::fromLatin1("invalid value for field '%1'").arg(field.name());
+                }
+            }
+        }
+
+        if (error.isEmpty())
+            result.rows << row;
+        else
+            result.errors << QString::fromLatin1("record %1: %2").arg(chunk.first + i).arg(error);
+    }
+    return result;
+}
+
+/** Reads rows from \a device in the given \a format and stores them, returns
+    the number of rows stored or -1 if an error occurred. Transactions which
+    were committed before the error are kept.
+
+    A reader thread splits the input into records, parser threads convert
+    them through NOrmMetaField::toDatabase() and the calling thread writes
+    them with multi-row INSERTs (or upserts), \a options.transactionSize rows
+    per transaction. Sequential devices are read in the calling thread.
+ */
+qint64 NOrmQuerySetPrivate::sqlImport(QIODevice* device, NOrm::DataFormat format, const NOrmImportOptions& options) {
+    if (!device || !device->isReadable()) {
+        qWarning("NOrmQuerySet cannot import from a device which is not readable");
+        return -1;
+    }
+
+    const NOrmMetaModel metaModel = NOrm::metaModel(m_modelName);
+    NOrmImportContext context;
+    context.format = format;
+    context.fields = metaModel.localFields();
+    for (int i = 0; i < context.fields.size(); ++i)
+        context.fieldIndex.insert(context.fields.at(i).name(), i);
+
+    // upserts match existing rows on the primary key unless told otherwise
+    QStringList conflictFields;
+    if (options.upsert) {
+        const QStringList names = options.conflictFields.isEmpty() ? QStringList(QLatin1String("pk")) : options.conflictFields;
+        foreach (const QString& name, names) {
+            const NOrmMetaField field = metaModel.localField(name.toLatin1());
+            if (!field.isValid()) {
+                qWarning("NOrmQuerySet cannot upsert on unknown field '%s'", qPrintable(name));
+                return -1;
+            }
+            conflictFields << field.name();
+        }
+    }
+
+    // the CSV header maps the columns to fields
+    NOrmImportReader reader(device, format);
+    if (format == NOrm::Csv) {
+        QByteArray header;
+        QVariantList names;
+        if (!reader.next(&header))
+            return 0;
+        if (!parseCsvRecord(header, &names)) {
+            qWarning("NOrmQuerySet cannot parse the CSV header");
+            return -1;
+        }
+        foreach (const QVariant& name, names) {
+            const int pos = context.fieldIndex.value(name.toString().trimmed(), -1);
+            if (pos < 0)
+                qWarning("NOrmQuerySet ignores unknown column '%s'", qPrintable(name.toString()));
+            context.columns << pos;
+        }
+    }
+
+    qint64 readRecords = 0;
+    const auto readChunk = [&reader, &readRecords](NOrmImportChunk* chunk) -> bool {
+        chunk->first = readRecords + 1;
+        chunk->records.clear();
+        QByteArray record;
+        while (chunk->records.size() < importRecordsPerChunk && reader.next(&record))
+            chunk->records << record;
+        readRecords += chunk->records.size();
+        return !chunk->records.isEmpty();
+    };
+
+    // the pool owns the reader and the parsers, it is destroyed first
+    const int parsers = options.parserThreads > 0 ? options.parserThreads : qMax(1, QThread::idealThreadCount() - 1);
+    const int window = parsers * 2;
+    NOrmImportQueue queue(window);
+    QThreadPool pool;
+    pool.setMaxThreadCount(parsers + 1);
+
+    const bool readerThread = !device->isSequential();
+    if (readerThread) {
+        QtConcurrent::run(&pool, [&queue, &readChunk]() {
+            NOrmImportChunk chunk;
+            while (readChunk(&chunk) && queue.push(chunk)) {}
+            queue.close();
+        });
+    }
+
+    QSqlDatabase db = NOrm::database();
+    const NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+    if (options.disableForeignKeyChecks && databaseType == NOrmDatabase::MySqlServer) {
+        NOrmQuery query(db);
+        query.exec(QLatin1String("SET foreign_key_checks = 0"));
+    }
+
+    // writes one transaction, rows of one statement share the same fields
+    const int batchSize = qMax(1, options.batchSize);
+    const auto write = [&](const QList<QVariantMap>& rows) -> bool {
+        return NOrm::transaction([&]() -> bool {
+            if (options.deferForeignKeys) {
+                NOrmQuery query(db);
+                if (databaseType == NOrmDatabase::SQLite)
+                    query.exec(QLatin1String("PRAGMA defer_foreign_keys = ON"));
+                else if (databaseType == NOrmDatabase::PostgreSQL)
+                    query.exec(QLatin1String("SET CONSTRAINTS ALL DEFERRED"));
+            }
+
+            int begin = 0;
+            while (begin < rows.size()) {
+                const QStringList keys = rows.at(begin).keys();
+                int end = begin + 1;
+                while (end < rows.size() && end - begin < batchSize && rows.at(end).keys() == keys)
+                    ++end;
+                const QList<QVariantMap> batch = rows.mid(begin, end - begin);
+                if (!(options.upsert ? sqlBulkUpsert(batch, conflictFields) : sqlBulkInsert(batch)))
+                    return false;
+                begin = end;
+            }
+            return true;
+        });
+    };
+
+    const int transactionSize = qMax(1, options.transactionSize);
+    QQueue<QFuture<NOrmImportRows> > parsing;
+    QList<QVariantMap> pending;
+    bool readerDone = false;
+    bool ok = true;
+    qint64 imported = 0;
+    forever {
+        // keep the parsers busy
+        while (!readerDone && parsing.size() < window) {
+            NOrmImportChunk chunk;
+            if (readerThread ? queue.pop(&chunk) : readChunk(&chunk))
+                parsing.enqueue(QtConcurrent::run(&pool, importParse, context, chunk));
+            else
+                readerDone = true;
+        }
+        if (parsing.isEmpty())
+            break;
+
+        // rows are written in the order of the input
+        const NOrmImportRows parsed = parsing.dequeue().result();
+        foreach (const QString& error, parsed.errors)
+            qWarning("NOrmQuerySet import %s", qPrintable(error));
+        if (!parsed.errors.isEmpty() && !options.skipInvalidRows) {
+            ok = false;
+            break;
+        }
+
+        pending += parsed.rows;
+        while (ok && pending.size() >= transactionSize) {
+            ok = write(pending.mid(0, transactionSize));
+            pending = pending.mid(transactionSize);
+            imported += transactionSize;
+        }
+        if (!ok)
+            break;
+    }
+    if (ok && !pending.isEmpty()) {
+        ok = write(pending);
+        imported += pending.size();
+    }
+
+    // stop the reader and let the pipeline drain
+    queue.close();
+    pool.waitForDone();
+
+    if (options.disableForeignKeyChecks && databaseType == NOrmDatabase::MySqlServer) {
+        NOrmQuery query(db);
+        query.exec(QLatin1String("SET foreign_key_checks = 1"));
+    }
+
+    // imported keys do not advance the sequence of a serial primary key
+    const NOrmMetaField primaryKey = metaModel.localField("pk");
+    if (ok && imported && databaseType == NOrmDatabase::PostgreSQL && primaryKey.isAutoIncrement() && !metaModel.isSharded()) {
+        const QString column = db.driver()->escapeIdentifier(primaryKey.column(), QSqlDriver::FieldName);
+        const QString table = db.driver()->escapeIdentifier(metaModel.table(), QSqlDriver::TableName);
+        NOrmQuery query(db);
+        query.exec(QString::fromLatin1("SELECT setval(pg_get_serial_sequence('%1', '%2'), COALESCE(MAX(%3), 0) + 1, false) FROM %4")
+                   .arg(metaModel.table(), primaryKey.column(), column, table));
+    }
+
+    return ok ? imported : -1;
+}
+
 /// \endcond
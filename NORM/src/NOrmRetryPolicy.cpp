@@ -0,0 +1,44 @@
+#include <QRandomGenerator>
+#include <QSqlError>
+#include <QtMath>
+#include "NOrmRetryPolicy.h"
+
+NOrmRetryPolicy::NOrmRetryPolicy()
+    : maxAttempts(1)
+    , initialBackoff(10)
+    , maxBackoff(1000)
+    , multiplier(2.0)
+{
+    // sqlite: SQLITE_BUSY / SQLITE_LOCKED, mysql: 锁等待超时
+    statementErrors << QLatin1String("5") << QLatin1String("6") << QLatin1String("1205");
+
+    // mysql: 死锁 / 锁等待超时, postgresql: 序列化失败 / 死锁
+    transactionErrors << QLatin1String("5") << QLatin1String("6")
+                      << QLatin1String("1205") << QLatin1String("1213")
+                      << QLatin1String("40001") << QLatin1String("40P01");
+}
+
+bool NOrmRetryPolicy::isStatementRetryable(const QSqlError &error, bool inTransaction) const
+{
+    const QString code = error.nativeErrorCode();
+    if (code.isEmpty() || !statementErrors.contains(code))
+        return false;
+
+    // 事务中两个写入者互相等待时, 只有重放整个事务才能解开
+    return !(inTransaction && transactionErrors.contains(code));
+}
+
+bool NOrmRetryPolicy::isTransactionRetryable(const QSqlError &error) const
+{
+    const QString code = error.nativeErrorCode();
+    return !code.isEmpty() && transactionErrors.contains(code);
+}
+
+int NOrmRetryPolicy::backoff(int attempt) const
+{
+    // full jitter: 在 [0, min(上限, 初始值 * 倍数^(n-1))] 中随机取值, 避免写入者同时醒来
+    const double ceiling = qMin<double>(maxBackoff, initialBackoff * qPow(multiplier, attempt - 1));
+    if (ceiling < 1)
+        return 0;
+    return QRandomGenerator::global()->bounded(int(ceiling) + 1);
+}
@@ -0,0 +1,78 @@
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include "NOrmSlowQueryLog.h"
+
+// 日志文件锁
+static QMutex slowQueryFileMutex;
+
+NOrmSlowQuery::NOrmSlowQuery()
+    : duration(0)
+{
+}
+
+QString NOrmSlowQuery::toString() const
+{
+    QStringList values;
+    foreach (const QVariant &value, bindValues) {
+        if (value.isNull())
+            values << QLatin1String("NULL");
+        else if (value.type() == QVariant::String)
+            values << QLatin1Char('\'') + value.toString() + QLatin1Char('\'');
+        else
+            values << value.toString();
+    }
+
+    QString text = QString::fromLatin1("# %1 thread=%2 duration=%3ms\n")
+            .arg(time.toString(Qt::ISODateWithMs), thread, QString::number(duration));
+    text += QLatin1String("SQL: ") + sql + QLatin1Char('\n');
+    if (!values.isEmpty())
+        text += QLatin1String("Bind: ") + values.join(QLatin1String(", ")) + QLatin1Char('\n');
+    if (!plan.isEmpty())
+        text += QLatin1String("Plan:\n") + plan + QLatin1Char('\n');
+    return text;
+}
+
+NOrmSlowQueryLog::NOrmSlowQueryLog()
+    : threshold(-1)
+    , explain(true)
+    , maxFileSize(10 * 1024 * 1024)
+    , maxFiles(5)
+{
+}
+
+bool NOrmSlowQueryLog::isEnabled() const
+{
+    return threshold >= 0;
+}
+
+void NOrmSlowQueryLog::write(const NOrmSlowQuery &query) const
+{
+    if (callback)
+        callback(query);
+    if (filePath.isEmpty())
+        return;
+
+    const QByteArray entry = query.toString().toUtf8() + '\n';
+    QMutexLocker locker(&slowQueryFileMutex);
+
+    // 滚动: filePath -> filePath.1 -> ... -> filePath.maxFiles
+    if (QFileInfo(filePath).size() + entry.size() > maxFileSize) {
+        const QString oldest = filePath + QLatin1Char('.') + QString::number(maxFiles);
+        QFile::remove(oldest);
+        for (int i = maxFiles - 1; i >= 1; --i)
+            QFile::rename(filePath + QLatin1Char('.') + QString::number(i), filePath + QLatin1Char('.') + QString::number(i + 1));
+        if (maxFiles > 0)
+            QFile::rename(filePath, filePath + QLatin1String(".1"));
+        else
+            QFile::remove(filePath);
+    }
+
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "Slow query log open error:" << file.errorString();
+        return;
+    }
+    file.write(entry);
+}
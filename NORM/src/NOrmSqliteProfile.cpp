@@ -0,0 +1,40 @@
+#include "NOrmSqliteProfile.h"
+
+NOrmSqliteProfile::NOrmSqliteProfile()
+    : mmapSize(-1)
+    , cacheSize(0)
+    , busyTimeout(-1)
+{
+}
+
+NOrmSqliteProfile NOrmSqliteProfile::performance()
+{
+    NOrmSqliteProfile profile;
+    profile.journalMode = QLatin1String("WAL");
+    profile.synchronous = QLatin1String("NORMAL");
+    profile.mmapSize = 256 * 1024 * 1024;
+    profile.cacheSize = -64000;
+    profile.tempStore = QLatin1String("MEMORY");
+    profile.busyTimeout = 5000;
+    return profile;
+}
+
+QStringList NOrmSqliteProfile::pragmas() const
+{
+    QStringList pragmas;
+
+    // 先设置忙等待, 切换日志模式时可能需要等待其他连接
+    if (busyTimeout >= 0)
+        pragmas << QLatin1String("PRAGMA busy_timeout=") + QString::number(busyTimeout);
+    if (!journalMode.isEmpty())
+        pragmas << QLatin1String("PRAGMA journal_mode=") + journalMode;
+    if (!synchronous.isEmpty())
+        pragmas << QLatin1String("PRAGMA synchronous=") + synchronous;
+    if (mmapSize >= 0)
+        pragmas << QLatin1String("PRAGMA mmap_size=") + QString::number(mmapSize);
+    if (cacheSize != 0)
+        pragmas << QLatin1String("PRAGMA cache_size=") + QString::number(cacheSize);
+    if (!tempStore.isEmpty())
+        pragmas << QLatin1String("PRAGMA temp_store=") + tempStore;
+    return pragmas;
+}
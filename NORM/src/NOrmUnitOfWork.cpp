@@ -0,0 +1,330 @@
+#include <QDebug>
+#include <QScopedPointer>
+#include <QSqlDatabase>
+#include <QStack>
+#include "NOrm.h"
+#include "NOrmDiagnosticsScope.h"
+#include "NOrmUnitOfWork.h"
+#include "NOrmQuerySet_p.h"
+
+// 默认单条语句写入的最大行数
+static const int defaultBatchSize = 100;
+
+// 工作单元私有类
+class NOrmUnitOfWorkPrivate
+{
+public:
+    NOrmUnitOfWorkPrivate();
+
+    bool flushInserts(const NOrmMetaModel &metaModel, QList<QObject*> &inserted);
+    bool flushUpdates(const NOrmMetaModel &metaModel, QList<QObject*> &versioned);
+    bool flushDeletes(const NOrmMetaModel &metaModel);
+
+    // 新增对象
+    QList<QObject*> newObjects;
+
+    // 修改对象
+    QList<QObject*> dirtyObjects;
+
+    // 删除对象
+    QList<QObject*> deletedObjects;
+
+    // 单条语句写入的最大行数
+    int batchSize;
+};
+
+NOrmUnitOfWorkPrivate::NOrmUnitOfWorkPrivate()
+    : batchSize(defaultBatchSize)
+{
+}
+
+static bool isRegisteredModel(const QObject *model)
+{
+    if (!model)
+        return false;
+    if (!NOrm::metaModel(model->metaObject()->className()).isValid()) {
+        qWarning("NOrmUnitOfWork cannot register unknown model '%s'", model->metaObject()->className());
+        return false;
+    }
+    return true;
+}
+
+static QList<QObject*> objectsOf(const QList<QObject*> &objects, const NOrmMetaModel &metaModel)
+{
+    QList<QObject*> result;
+    foreach (QObject *object, objects) {
+        if (metaModel.className() == QLatin1String(object->metaObject()->className()))
+            result << object;
+    }
+    return result;
+}
+
+// 主键是否已经生成
+static bool hasPrimaryKey(const NOrmMetaModel &metaModel, const QObject *model)
+{
+    const QVariant pk = model->property(metaModel.primaryKey());
+    return !pk.isNull() && !(metaModel.localField("pk").isAutoIncrement() && !pk.toInt());
+}
+
+// 用外键对象当前的主键刷新 _id 属性
+static void refreshForeignKeys(const NOrmMetaModel &metaModel, QObject *model)
+{
+    const QMap<QByteArray, QByteArray> foreignFields = metaModel.foreignFields();
+    foreach (const QByteArray &fkName, foreignFields.keys()) {
+        QObject *foreign = model->property(fkName + "_ptr").value<QObject*>();
+        if (!foreign)
+            continue;
+
+        const NOrmMetaModel foreignMeta = NOrm::metaModel(foreignFields[fkName]);
+        if (hasPrimaryKey(foreignMeta, foreign))
+            model->setProperty(fkName + "_id", foreign->property(foreignMeta.primaryKey()));
+    }
+}
+
+// 是否引用了同一批次中尚未写入的对象
+static bool dependsOnPending(const NOrmMetaModel &metaModel, const QObject *model, const QList<QObject*> &pending)
+{
+    foreach (const QByteArray &fkName, metaModel.foreignFields().keys()) {
+        QObject *foreign = model->property(fkName + "_ptr").value<QObject*>();
+        if (foreign && foreign != model && pending.contains(foreign))
+            return true;
+    }
+    return false;
+}
+
+static QVariantMap modelFields(const NOrmMetaModel &metaModel, const QObject *model, bool withAutoIncrement)
+{
+    QVariantMap fields;
+    foreach (const NOrmMetaField &field, metaModel.localFields()) {
+        if (withAutoIncrement || !field.isAutoIncrement()) {
+            const QVariant value = model->property(field.name().toLatin1());
+            fields.insert(field.name(), field.toDatabase(value));
+        }
+    }
+    return fields;
+}
+
+bool NOrmUnitOfWorkPrivate::flushInserts(const NOrmMetaModel &metaModel, QList<QObject*> &inserted)
+{
+    QList<QObject*> pending = objectsOf(newObjects, metaModel);
+    const QByteArray modelName = metaModel.className().toLatin1();
+    const bool autoIncrement = metaModel.localField("pk").isAutoIncrement();
+
+    while (!pending.isEmpty()) {
+        // 自关联的模型需要先写入被引用的对象
+        QList<QObject*> ready;
+        foreach (QObject *object, pending) {
+            if (!dependsOnPending(metaModel, object, pending))
+                ready << object;
+        }
+        if (ready.isEmpty()) {
+            qWarning("NOrmUnitOfWork found a foreign key cycle in model '%s'", modelName.constData());
+            return false;
+        }
+
+        QList<QVariantMap> rows;
+        foreach (QObject *object, ready) {
+            pending.removeOne(object);
+            refreshForeignKeys(metaModel, object);
+            rows << modelFields(metaModel, object, false);
+        }
+
+        for (int i = 0; i < rows.size(); i += batchSize) {
+            NOrmQuerySetPrivate qs(modelName);
+            if (!autoIncrement) {
+                if (!qs.sqlBulkInsert(rows.mid(i, batchSize)))
+                    return false;
+                continue;
+            }
+
+            // 回填生成的主键
+            QVariantList insertIds;
+            const QList<QObject*> chunk = ready.mid(i, batchSize);
+            if (!qs.sqlBulkInsert(rows.mid(i, batchSize), &insertIds) || insertIds.size() != chunk.size())
+                return false;
+            for (int j = 0; j < chunk.size(); ++j) {
+                chunk.at(j)->setProperty(metaModel.primaryKey(), insertIds.at(j));
+                inserted << chunk.at(j);
+            }
+        }
+    }
+    return true;
+}
+
+bool NOrmUnitOfWorkPrivate::flushUpdates(const NOrmMetaModel &metaModel, QList<QObject*> &versioned)
+{
+    const QList<QObject*> objects = objectsOf(dirtyObjects, metaModel);
+    if (objects.isEmpty())
+        return true;
+
+    QList<QVariantMap> rows;
+    foreach (QObject *object, objects) {
+        refreshForeignKeys(metaModel, object);
+        rows << modelFields(metaModel, object, true);
+    }
+
+    const QByteArray modelName = metaModel.className().toLatin1();
+    const QByteArray versionName = metaModel.versionField();
+    for (int i = 0; i < rows.size(); i += batchSize) {
+        NOrmQuerySetPrivate qs(modelName);
+        const int affected = qs.sqlBulkUpdate(rows.mid(i, batchSize));
+        if (affected < 0)
+            return false;
+        if (versionName.isEmpty())
+            continue;
+
+        // 版本不匹配的行不会被更新
+        const QList<QObject*> chunk = objects.mid(i, batchSize);
+        if (affected != chunk.size()) {
+            qWarning("NOrmUnitOfWork detected a concurrent update in model '%s'", modelName.constData());
+            return false;
+        }
+        foreach (QObject *object, chunk) {
+            object->setProperty(versionName, object->property(versionName).toLongLong() + 1);
+            versioned << object;
+        }
+    }
+    return true;
+}
+
+bool NOrmUnitOfWorkPrivate::flushDeletes(const NOrmMetaModel &metaModel)
+{
+    const QList<QObject*> objects = objectsOf(deletedObjects, metaModel);
+    if (objects.isEmpty())
+        return true;
+
+    QVariantList pks;
+    foreach (QObject *object, objects)
+        pks << object->property(metaModel.primaryKey());
+
+    const QByteArray modelName = metaModel.className().toLatin1();
+    const int step = qMin(batchSize, NOrmDatabase::maxBindValues(NOrm::database()));
+    for (int i = 0; i < pks.size(); i += step) {
+        NOrmQuerySetPrivate qs(modelName);
+        qs.addFilter(NOrmWhere(QLatin1String("pk"), NOrmWhere::IsIn, pks.mid(i, step)));
+        if (!qs.sqlDelete())
+            return false;
+    }
+    return true;
+}
+
+NOrmUnitOfWork::NOrmUnitOfWork()
+    : d(new NOrmUnitOfWorkPrivate)
+{
+}
+
+NOrmUnitOfWork::~NOrmUnitOfWork()
+{
+    delete d;
+}
+
+void NOrmUnitOfWork::registerNew(QObject *model)
+{
+    if (!isRegisteredModel(model))
+        return;
+    if (d->deletedObjects.contains(model)) {
+        qWarning("NOrmUnitOfWork cannot register a deleted object as new");
+        return;
+    }
+    if (!d->newObjects.contains(model))
+        d->newObjects << model;
+}
+
+void NOrmUnitOfWork::registerDirty(QObject *model)
+{
+    if (!isRegisteredModel(model))
+        return;
+
+    // 新增对象在提交时会整体写入
+    if (d->newObjects.contains(model) || d->deletedObjects.contains(model))
+        return;
+    if (!d->dirtyObjects.contains(model))
+        d->dirtyObjects << model;
+}
+
+void NOrmUnitOfWork::registerDeleted(QObject *model)
+{
+    if (!isRegisteredModel(model))
+        return;
+
+    // 尚未写入的对象直接撤销登记即可
+    if (d->newObjects.removeOne(model))
+        return;
+    d->dirtyObjects.removeOne(model);
+    if (!d->deletedObjects.contains(model))
+        d->deletedObjects << model;
+}
+
+int NOrmUnitOfWork::batchSize() const
+{
+    return d->batchSize;
+}
+
+void NOrmUnitOfWork::setBatchSize(int size)
+{
+    d->batchSize = qMax(1, size);
+}
+
+bool NOrmUnitOfWork::isEmpty() const
+{
+    return d->newObjects.isEmpty() && d->dirtyObjects.isEmpty() && d->deletedObjects.isEmpty();
+}
+
+void NOrmUnitOfWork::clear()
+{
+    d->newObjects.clear();
+    d->dirtyObjects.clear();
+    d->deletedObjects.clear();
+}
+
+bool NOrmUnitOfWork::commit()
+{
+    if (isEmpty())
+        return true;
+
+    // 统计提交过程中重复执行的语句
+    QScopedPointer<NOrmDiagnosticsScope> diagnostics;
+    if (NOrmDiagnosticsScope::isEnabled())
+        diagnostics.reset(new NOrmDiagnosticsScope(QLatin1String("NOrmUnitOfWork")));
+
+    // 已处于外部事务中时由调用者负责提交
+    QSqlDatabase db = NOrm::database();
+    const bool ownTransaction = !NOrmDatabase::inTransaction() && db.transaction();
+    if (ownTransaction)
+        NOrmDatabase::enterTransaction();
+
+    // 被引用的模型排在前面: 按顺序写入, 逆序删除
+    const QStack<NOrmMetaModel> models = NOrm::metaModels();
+    QList<QObject*> inserted;
+    QList<QObject*> versioned;
+    bool ok = true;
+    for (int i = 0; ok && i < models.size(); ++i)
+        ok = d->flushInserts(models.at(i), inserted) && d->flushUpdates(models.at(i), versioned);
+    for (int i = models.size() - 1; ok && i >= 0; --i)
+        ok = d->flushDeletes(models.at(i));
+    if (ownTransaction)
+        NOrmDatabase::leaveTransaction();
+
+    if (ok && ownTransaction)
+        ok = db.commit();
+
+    if (!ok) {
+        if (ownTransaction) {
+            db.rollback();
+
+            // 回滚后生成的主键和递增的版本不再有效
+            foreach (QObject *object, inserted) {
+                const NOrmMetaModel metaModel = NOrm::metaModel(object->metaObject()->className());
+                object->setProperty(metaModel.primaryKey(), QVariant());
+            }
+            foreach (QObject *object, versioned) {
+                const NOrmMetaModel metaModel = NOrm::metaModel(object->metaObject()->className());
+                object->setProperty(metaModel.versionField(), object->property(metaModel.versionField()).toLongLong() - 1);
+            }
+        }
+        return false;
+    }
+
+    clear();
+    return true;
+}
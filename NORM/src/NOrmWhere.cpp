@@ -13,6 +13,164 @@ static QString escapeLike(const QString &data)
     return escaped;
 }
 
+// 没有 JSON 函数的数据库用 LIKE 匹配编码后的元素
+static bool arrayContainsLike(NOrmDatabase::DatabaseType databaseType)
+{
+    return databaseType != NOrmDatabase::SQLite
+            && databaseType != NOrmDatabase::MySqlServer
+            && databaseType != NOrmDatabase::PostgreSQL;
+}
+
+// 字符串列表字段包含所有给定元素, 每个元素绑定一个参数
+static QString arrayContainsSql(const QString &key, int count, NOrmDatabase::DatabaseType databaseType, bool negate)
+{
+    QString atom;
+    switch (databaseType) {
+    case NOrmDatabase::SQLite:
+        // 早期版本写入的逗号连接的值不是合法的 JSON, 不参与匹配
+        atom = QString::fromLatin1("EXISTS (SELECT 1 FROM json_each(CASE WHEN json_valid(%1) THEN %1 END) WHERE value = ?)").arg(key);
+        break;
+    case NOrmDatabase::MySqlServer:
+        atom = QString::fromLatin1("JSON_CONTAINS(%1, JSON_ARRAY(?))").arg(key);
+        break;
+    case NOrmDatabase::PostgreSQL:
+        // 可以使用 jsonb 上的 GIN 索引
+        atom = QString::fromLatin1("%1 @> jsonb_build_array(?::text)").arg(key);
+        break;
+    default:
+        atom = key + QLatin1String(" LIKE ?");
+        break;
+    }
+
+    QStringList bits;
+    for (int i = 0; i < count; i++)
+        bits << atom;
+    const QString combined = count ? bits.join(QLatin1String(" AND ")) : QString::fromLatin1("1 = 1");
+    return negate ? QString::fromLatin1("NOT (%1)").arg(combined) : combined;
+}
+
+// IsIn 条件一个 IN 中的元素个数上限(oracle 的限制), 超过时拆成多个 IN
+static const int maxInListSize = 1000;
+
+/**
+ * @brief The InListArray enum 大列表整体绑定为一个参数时的元素类型
+ */
+enum InListArray {
+    // 不整体绑定
+    NoArray,
+    // 整数
+    IntegerArray,
+    // 字符串
+    StringArray
+};
+
+// 列表超过阈值时能否整体绑定: postgresql/sqlite 支持整数和字符串,
+// mysql/sqlserver 只支持整数(字符串会遇到排序规则和类型转换的问题, 用不上索引)
+static InListArray inListArray(const QVariantList &values, const QSqlDatabase &db)
+{
+    if (values.size() <= NOrm::largeInThreshold() || !NOrmDatabase::hasJsonArrays(db))
+        return NoArray;
+
+    bool integers = true;
+    bool strings = true;
+    foreach (const QVariant &value, values) {
+        switch (int(value.type())) {
+        case QVariant::Int:
+        case QVariant::UInt:
+        case QVariant::LongLong:
+        case QVariant::ULongLong:
+            strings = false;
+            break;
+        case QVariant::String:
+            integers = false;
+            break;
+        default:
+            return NoArray;
+        }
+    }
+
+    switch (NOrmDatabase::databaseType(db)) {
+    case NOrmDatabase::PostgreSQL:
+    case NOrmDatabase::SQLite:
+        return integers ? IntegerArray : (strings ? StringArray : NoArray);
+    case NOrmDatabase::MySqlServer:
+    case NOrmDatabase::MSSqlServer:
+        return integers ? IntegerArray : NoArray;
+    default:
+        return NoArray;
+    }
+}
+
+// 整体绑定的参数: postgresql 为数组字面量, 其他为 JSON 数组
+static QString inListArrayValue(const QVariantList &values, InListArray array, NOrmDatabase::DatabaseType databaseType)
+{
+    const bool postgre = databaseType == NOrmDatabase::PostgreSQL;
+    QString out = QLatin1String(postgre ? "{" : "[");
+    for (int i = 0; i < values.size(); i++) {
+        if (i)
+            out += QLatin1Char(',');
+        if (array == IntegerArray) {
+            out += values[i].toString();
+        } else if (postgre) {
+            QString item = values[i].toString();
+            item.replace(QLatin1String("\\"), QLatin1String("\\\\"));
+            item.replace(QLatin1String("\""), QLatin1String("\\\""));
+            out += QLatin1Char('"') + item + QLatin1Char('"');
+        } else {
+            NOrmStringListCodec::encodeString(out, values[i].toString());
+        }
+    }
+    out += QLatin1String(postgre ? "}" : "]");
+    return out;
+}
+
+// 占位符个数按档位补齐(重复最后一个元素), 不同长度的列表共用少量语句
+static int inListBucket(int count, const QSqlDatabase &db)
+{
+    int bucket = count;
+    if (count > 1024) {
+        bucket = (count + 1023) / 1024 * 1024;
+    } else if (count > 8) {
+        bucket = 16;
+        while (bucket < count)
+            bucket *= 2;
+    }
+    return qMax(count, qMin(bucket, NOrmDatabase::maxBindValues(db)));
+}
+
+static QString inListSql(const QString &key, const QVariantList &values, const QSqlDatabase &db, bool negate)
+{
+    const NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
+    const QString op = QLatin1String(negate ? " NOT IN (%1)" : " IN (%1)");
+    if (inListArray(values, db) != NoArray) {
+        switch (databaseType) {
+        case NOrmDatabase::PostgreSQL:
+            return negate ? QString::fromLatin1("NOT (%1 = ANY(?))").arg(key) : key + QLatin1String(" = ANY(?)");
+        case NOrmDatabase::SQLite:
+            return key + op.arg(QLatin1String("SELECT value FROM json_each(?)"));
+        case NOrmDatabase::MySqlServer:
+            return key + op.arg(QLatin1String("SELECT value FROM JSON_TABLE(?, '$[*]' COLUMNS (value BIGINT PATH '$')) AS items"));
+        default:
+            return key + op.arg(QLatin1String("SELECT value FROM OPENJSON(?)"));
+        }
+    }
+
+    const int count = inListBucket(values.size(), db);
+    QStringList lists;
+    int start = 0;
+    do {
+        QStringList bits;
+        for (int i = start; i < qMin(count, start + maxInListSize); i++)
+            bits << QLatin1String("?");
+        lists << key + op.arg(bits.join(QLatin1String(", ")));
+        start += maxInListSize;
+    } while (start < count);
+
+    if (lists.size() == 1)
+        return lists.first();
+    return QString::fromLatin1("(%1)").arg(lists.join(QLatin1String(negate ? " AND " : " OR ")));
+}
+
 /// \cond
 
 NOrmWherePrivate::NOrmWherePrivate()
@@ -22,6 +180,35 @@ NOrmWherePrivate::NOrmWherePrivate()
 {
 }
 
+NOrmSubquery::NOrmSubquery(const QByteArray &modelName, const NOrmWhere &where, const QString &field,
+                           const QStringList &orderBy, int lowMark, int highMark)
+    : modelName(modelName)
+    , where(where)
+    , field(field)
+    , orderBy(orderBy)
+    , lowMark(lowMark)
+    , highMark(highMark)
+{
+}
+
+NOrmAggregate::NOrmAggregate(const QString &name, NOrmWhere::AggregateType type, const QString &field)
+    : name(name)
+    , type(type)
+    , field(field)
+{
+}
+
+NOrmWindow::NOrmWindow(const QString &name, Function function, const QString &field,
+                       const QStringList &partitionBy, const QStringList &orderBy, int offset)
+    : name(name)
+    , function(function)
+    , field(field)
+    , partitionBy(partitionBy)
+    , orderBy(orderBy)
+    , offset(offset)
+{
+}
+
 NOrmWhere::NOrmWhere()
 {
     d = new NOrmWherePrivate;
@@ -40,6 +227,14 @@ NOrmWhere::NOrmWhere(const QString &key, NOrmWhere::Operation operation, QVarian
     d->data = value;
 }
 
+NOrmWhere::NOrmWhere(const QString &key, NOrmWhere::Operation operation, const NOrmSubquery &subquery)
+{
+    d = new NOrmWherePrivate;
+    d->key = key;
+    d->operation = operation;
+    d->subquery = QSharedPointer<NOrmSubquery>(new NOrmSubquery(subquery));
+}
+
 NOrmWhere::~NOrmWhere()
 {
 }
@@ -65,6 +260,9 @@ NOrmWhere NOrmWhere::operator!() const
         case IEndsWith:
         case Contains:
         case IContains:
+        case ArrayContains:
+        case Search:
+        case Exists:
             result.d->negate = !d->negate;
             break;
         case IsNull:
@@ -151,10 +349,23 @@ NOrmWhere NOrmWhere::operator||(const NOrmWhere &other) const
 
 void NOrmWhere::bindValues(NOrmQuery &query) const
 {
-    if (d->operation == NOrmWhere::IsIn) {
+    if (d->subquery) {
+        // 子查询的参数在条件所在的位置
+        foreach (const NOrmWhere &child, d->children)
+            child.bindValues(query);
+    } else if (d->operation == NOrmWhere::IsIn) {
+        // 与生成语句时使用同一个链接的特性
+        const QSqlDatabase db = query.database();
+        const NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
         const QList<QVariant> values = d->data.toList();
-        for (int i = 0; i < values.size(); i++)
-            query.addBindValue(values[i]);
+        const InListArray array = inListArray(values, db);
+        if (array != NoArray) {
+            query.addBindValue(inListArrayValue(values, array, databaseType));
+        } else {
+            const int count = inListBucket(values.size(), db);
+            for (int i = 0; i < count; i++)
+                query.addBindValue(values[qMin(i, values.size() - 1)]);
+        }
     } else if (d->operation == NOrmWhere::IsNull) {
         // no data to bind
     } else if (d->operation == NOrmWhere::StartsWith || d->operation == NOrmWhere::IStartsWith) {
@@ -163,6 +374,25 @@ void NOrmWhere::bindValues(NOrmQuery &query) const
         query.addBindValue(QLatin1String("%") + escapeLike(d->data.toString()));
     } else if (d->operation == NOrmWhere::Contains || d->operation == NOrmWhere::IContains) {
         query.addBindValue(QLatin1String("%") + escapeLike(d->data.toString()) + QLatin1String("%"));
+    } else if (d->operation == NOrmWhere::Search) {
+        // 不支持全文检索的数据库按字段逐个 LIKE
+        if (d->data.type() == QVariant::List) {
+            foreach (const QVariant &value, d->data.toList())
+                query.addBindValue(value);
+        } else {
+            query.addBindValue(d->data);
+        }
+    } else if (d->operation == NOrmWhere::ArrayContains) {
+        const bool like = arrayContainsLike(NOrmDatabase::databaseType(query.database()));
+        foreach (const QString &item, d->data.toStringList()) {
+            if (like) {
+                QString encoded;
+                NOrmStringListCodec::encodeString(encoded, item);
+                query.addBindValue(QLatin1String("%") + escapeLike(encoded) + QLatin1String("%"));
+            } else {
+                query.addBindValue(item);
+            }
+        }
     } else if (d->operation != NOrmWhere::None) {
         query.addBindValue(d->data);
     } else {
@@ -183,6 +413,10 @@ bool NOrmWhere::isNone() const
 
 QString NOrmWhere::sql(const QSqlDatabase &db) const
 {
+    // 子查询条件已由 NOrmCompiler 编译
+    if (d->subquery)
+        return d->negate ? QString::fromLatin1("NOT (%1)").arg(d->key) : d->key;
+
     NOrmDatabase::DatabaseType databaseType = NOrmDatabase::databaseType(db);
 
     switch (databaseType) {
@@ -243,15 +477,7 @@ QString NOrmWhere::sqlDefult(const QSqlDatabase &db) const
         case LessOrEquals:
             return d->key + QLatin1String(" <= ?");
         case IsIn:
-        {
-            QStringList bits;
-            for (int i = 0; i < d->data.toList().size(); i++)
-                bits << QLatin1String("?");
-            if (d->negate)
-                return d->key + QString::fromLatin1(" NOT IN (%1)").arg(bits.join(QLatin1String(", ")));
-            else
-                return d->key + QString::fromLatin1(" IN (%1)").arg(bits.join(QLatin1String(", ")));
-        }
+            return inListSql(d->key, d->data.toList(), db, d->negate);
         case IsNull:
             return d->key + QLatin1String(d->data.toBool() ? " IS NULL" : " IS NOT NULL");
         case StartsWith:
@@ -275,6 +501,11 @@ QString NOrmWhere::sqlDefult(const QSqlDatabase &db) const
             const QString op = QLatin1String(d->negate ? "LIKE" : "NOT LIKE");
             return d->key + QLatin1String(" ") + op + QLatin1String(" ?");
         }
+        case Search:
+        case Exists:
+            return d->negate ? QString::fromLatin1("NOT (%1)").arg(d->key) : d->key;
+        case ArrayContains:
+            return arrayContainsSql(d->key, d->data.toStringList().size(), NOrmDatabase::databaseType(db), d->negate);
         case None:
             if (d->combine == NOrmWherePrivate::NoCombine) {
                 return d->negate ? QLatin1String("1 != 0") : QString();
@@ -318,15 +549,7 @@ QString NOrmWhere::sqlMysql(const QSqlDatabase &db) const
         case LessOrEquals:
             return d->key + QLatin1String(" <= ?");
         case IsIn:
-        {
-            QStringList bits;
-            for (int i = 0; i < d->data.toList().size(); i++)
-                bits << QLatin1String("?");
-            if (d->negate)
-                return d->key + QString::fromLatin1(" NOT IN (%1)").arg(bits.join(QLatin1String(", ")));
-            else
-                return d->key + QString::fromLatin1(" IN (%1)").arg(bits.join(QLatin1String(", ")));
-        }
+            return inListSql(d->key, d->data.toList(), db, d->negate);
         case IsNull:
             return d->key + QLatin1String(d->data.toBool() ? " IS NULL" : " IS NOT NULL");
         case StartsWith:
@@ -350,6 +573,11 @@ QString NOrmWhere::sqlMysql(const QSqlDatabase &db) const
             const QString op = QLatin1String(d->negate ? "LIKE" : "NOT LIKE");
             return d->key + QLatin1String(" ") + op + QLatin1String(" ?");
         }
+        case Search:
+        case Exists:
+            return d->negate ? QString::fromLatin1("NOT (%1)").arg(d->key) : d->key;
+        case ArrayContains:
+            return arrayContainsSql(d->key, d->data.toStringList().size(), NOrmDatabase::MySqlServer, d->negate);
         case None:
             if (d->combine == NOrmWherePrivate::NoCombine) {
                 return d->negate ? QLatin1String("1 != 0") : QString();
@@ -393,15 +621,7 @@ QString NOrmWhere::sqlSqlite(const QSqlDatabase &db) const
         case LessOrEquals:
             return d->key + QLatin1String(" <= ?");
         case IsIn:
-        {
-            QStringList bits;
-            for (int i = 0; i < d->data.toList().size(); i++)
-                bits << QLatin1String("?");
-            if (d->negate)
-                return d->key + QString::fromLatin1(" NOT IN (%1)").arg(bits.join(QLatin1String(", ")));
-            else
-                return d->key + QString::fromLatin1(" IN (%1)").arg(bits.join(QLatin1String(", ")));
-        }
+            return inListSql(d->key, d->data.toList(), db, d->negate);
         case IsNull:
             return d->key + QLatin1String(d->data.toBool() ? " IS NULL" : " IS NOT NULL");
         case StartsWith:
@@ -425,6 +645,11 @@ QString NOrmWhere::sqlSqlite(const QSqlDatabase &db) const
             const QString op = QLatin1String(d->negate ? "LIKE" : "NOT LIKE");
             return d->key + QLatin1String(" ") + op + QLatin1String(" ? ESCAPE '\\'");
         }
+        case Search:
+        case Exists:
+            return d->negate ? QString::fromLatin1("NOT (%1)").arg(d->key) : d->key;
+        case ArrayContains:
+            return arrayContainsSql(d->key, d->data.toStringList().size(), NOrmDatabase::SQLite, d->negate);
         case None:
             if (d->combine == NOrmWherePrivate::NoCombine) {
                 return d->negate ? QLatin1String("1 != 0") : QString();
@@ -468,15 +693,7 @@ QString NOrmWhere::sqlPostgre(const QSqlDatabase &db) const
         case LessOrEquals:
             return d->key + QLatin1String(" <= ?");
         case IsIn:
-        {
-            QStringList bits;
-            for (int i = 0; i < d->data.toList().size(); i++)
-                bits << QLatin1String("?");
-            if (d->negate)
-                return d->key + QString::fromLatin1(" NOT IN (%1)").arg(bits.join(QLatin1String(", ")));
-            else
-                return d->key + QString::fromLatin1(" IN (%1)").arg(bits.join(QLatin1String(", ")));
-        }
+            return inListSql(d->key, d->data.toList(), db, d->negate);
         case IsNull:
             return d->key + QLatin1String(d->data.toBool() ? " IS NULL" : " IS NOT NULL");
         case StartsWith:
@@ -500,6 +717,11 @@ QString NOrmWhere::sqlPostgre(const QSqlDatabase &db) const
             const QString op = QLatin1String(d->negate ? "LIKE" : "NOT LIKE");
             return QLatin1String("UPPER(") + d->key + QLatin1String("::text) ") + op + QLatin1String(" UPPER(?)");
         }
+        case Search:
+        case Exists:
+            return d->negate ? QString::fromLatin1("NOT (%1)").arg(d->key) : d->key;
+        case ArrayContains:
+            return arrayContainsSql(d->key, d->data.toStringList().size(), NOrmDatabase::PostgreSQL, d->negate);
         case None:
             if (d->combine == NOrmWherePrivate::NoCombine) {
                 return d->negate ? QLatin1String("1 != 0") : QString();
@@ -550,15 +772,7 @@ QString NOrmWhere::sqlDaMeng(const QSqlDatabase &db) const
         case LessOrEquals:
             return d->key + QString(" <= %1").arg(tmp);
         case IsIn:
-        {
-            QStringList bits;
-            for (int i = 0; i < d->data.toList().size(); i++)
-                bits << QString("%1").arg(tmp);
-            if (d->negate)
-                return d->key + QString::fromLatin1(" NOT IN (%1)").arg(bits.join(QLatin1String(", ")));
-            else
-                return d->key + QString::fromLatin1(" IN (%1)").arg(bits.join(QLatin1String(", ")));
-        }
+            return inListSql(d->key, d->data.toList(), db, d->negate);
         case IsNull:
             return d->key + QLatin1String(d->data.toBool() ? " IS NULL" : " IS NOT NULL");
         case StartsWith:
@@ -582,6 +796,11 @@ QString NOrmWhere::sqlDaMeng(const QSqlDatabase &db) const
             const QString op = QLatin1String(d->negate ? "LIKE" : "NOT LIKE");
             return d->key + QLatin1String(" ") + op + QString(" %1").arg(tmp);
         }
+        case Search:
+        case Exists:
+            return d->negate ? QString::fromLatin1("NOT (%1)").arg(d->key) : d->key;
+        case ArrayContains:
+            return arrayContainsSql(d->key, d->data.toStringList().size(), NOrmDatabase::DaMeng, d->negate);
         case None:
             if (d->combine == NOrmWherePrivate::NoCombine) {
                 return d->negate ? QLatin1String("1 != 0") : QString();
@@ -627,6 +846,9 @@ QString NOrmWherePrivate::operationToString(NOrmWhere::Operation operation)
     case NOrmWhere::IContains: return QLatin1String("IContains");
     case NOrmWhere::IsIn: return QLatin1String("IsIn");
     case NOrmWhere::IsNull: return QLatin1String("IsNull");
+    case NOrmWhere::ArrayContains: return QLatin1String("ArrayContains");
+    case NOrmWhere::Search: return QLatin1String("Search");
+    case NOrmWhere::Exists: return QLatin1String("Exists");
     case NOrmWhere::None:
     default:
         return QLatin1String("");